@@ -3,11 +3,609 @@
 #include <sstream>
 #include <vector>
 #include <unordered_map>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <shared_mutex>
+#include <cstdint>
+#include <functional>
+#include <ctime>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <string_view>
+#include <charconv>
 #include <algorithm> 
+#include <cmath>
+#include <iomanip>
+#include <array>
+#include <numeric>
+#include <type_traits>
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <csignal>
+#include <cerrno>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
 
 
 using namespace std;
 
+// Parses a whole field as a number; false if it is empty or has trailing junk
+template<typename T>
+bool parseNumber(string_view text, T& value) {
+    const char* end = text.data() + text.size();
+    from_chars_result result = from_chars(text.data(), end, value);
+    return !text.empty() && result.ec == errc() && result.ptr == end;
+}
+
+// Bit helpers; GCC and Clang compile these to single instructions
+inline int popcount64(uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#else
+    int n = 0;
+    for (; x != 0; x &= x - 1) {
+        n++;
+    }
+    return n;
+#endif
+}
+
+// Index of the lowest set bit; x must not be zero
+inline int lowestBit64(uint64_t x) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(x);
+#else
+    int n = 0;
+    for (; (x & 1) == 0; x >>= 1) {
+        n++;
+    }
+    return n;
+#endif
+}
+
+// Field Splitter Class
+// Walks the delimited fields of a line in place, without copying
+class FieldSplitter {
+private:
+    string_view rest;
+    bool exhausted;
+
+public:
+    explicit FieldSplitter(string_view line) : rest(line), exhausted(false) {}
+
+    bool next(string_view& field, char delimiter = ',') {
+        if (exhausted) {
+            return false;
+        }
+        size_t end = rest.find(delimiter);
+        if (end == string_view::npos) {
+            field = rest;
+            exhausted = true;
+            return true;
+        }
+        field = rest.substr(0, end);
+        rest.remove_prefix(end + 1);
+        return true;
+    }
+
+    string_view remaining() const {
+        return exhausted ? string_view() : rest;
+    }
+};
+
+// Calendar Dates
+// Dates are day numbers counted from 1970-01-01 (UTC) in the proleptic
+// Gregorian calendar; 0 also stands for "no date" in records.
+inline int32_t daysFromCivil(int64_t year, int64_t month, int64_t day) {
+    year -= month <= 2 ? 1 : 0;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    int64_t yearOfEra = year - era * 400;
+    int64_t dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    int64_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return static_cast<int32_t>(era * 146097 + dayOfEra - 719468);
+}
+
+inline void civilFromDays(int64_t days, int64_t& year, int64_t& month, int64_t& day) {
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    int64_t dayOfEra = days - era * 146097;
+    int64_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    int64_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    int64_t mp = (5 * dayOfYear + 2) / 153;
+    day = dayOfYear - (153 * mp + 2) / 5 + 1;
+    month = mp < 10 ? mp + 3 : mp - 9;
+    year = yearOfEra + era * 400 + (month <= 2 ? 1 : 0);
+}
+
+// Today's day number
+inline int32_t currentDay() {
+    return static_cast<int32_t>(time(nullptr) / 86400);
+}
+
+// Parses "YYYY-MM-DD"; false unless it is a real date after 1970-01-01
+inline bool parseDate(string_view text, int32_t& day) {
+    int year, month, dayOfMonth;
+    if (text.size() != 10 || text[4] != '-' || text[7] != '-' || !parseNumber(text.substr(0, 4), year) || !parseNumber(text.substr(5, 2), month)
+        || !parseNumber(text.substr(8, 2), dayOfMonth) || month < 1 || month > 12 || dayOfMonth < 1) {
+        return false;
+    }
+    int64_t y, m, d;
+    day = daysFromCivil(year, month, dayOfMonth);
+    civilFromDays(day, y, m, d);
+    return day > 0 && d == dayOfMonth;
+}
+
+inline string formatDate(int32_t day) {
+    int64_t year, month, dayOfMonth;
+    civilFromDays(day, year, month, dayOfMonth);
+    char text[64];
+    snprintf(text, sizeof(text), "%04lld-%02lld-%02lld", static_cast<long long>(year), static_cast<long long>(month),
+        static_cast<long long>(dayOfMonth));
+    return text;
+}
+
+// Schedule
+// The days a train runs: a set of weekdays, optionally within a range of dates.
+// A train with no weekdays is undated; it runs once and sells one set of seats,
+// as every train did before schedules.
+struct Schedule {
+    uint32_t weekdays; // bit 0 is Monday
+    int32_t firstDay;  // 0 means no bound
+    int32_t lastDay;
+
+    static constexpr uint32_t DAILY = 0x7f;
+    static constexpr const char* DAY_NAMES[7] = { "mon", "tue", "wed", "thu", "fri", "sat", "sun" };
+
+    bool dated() const {
+        return weekdays != 0;
+    }
+
+    // 0 is Monday; 1970-01-01 was a Thursday
+    static int weekday(int32_t day) {
+        return static_cast<int>((day % 7 + 10) % 7);
+    }
+
+    bool runsOn(int32_t day) const {
+        return (weekdays >> weekday(day) & 1) != 0 && (firstDay == 0 || day >= firstDay) && (lastDay == 0 || day <= lastDay);
+    }
+
+    // The first run on or after day, or -1 if the schedule has ended
+    int32_t nextRun(int32_t day) const {
+        day = max(day, firstDay);
+        for (int i = 0; i < 7 && (lastDay == 0 || day <= lastDay); i++, day++) {
+            if (runsOn(day)) {
+                return day;
+            }
+        }
+        return -1;
+    }
+
+    // "mon;wed;fri" or "daily", optionally followed by "@first:last", either
+    // date of which may be left out; empty for an undated train
+    void appendText(string& out) const {
+        if (weekdays == DAILY) {
+            out += "daily";
+        }
+        bool first = true;
+        for (int i = 0; weekdays != DAILY && i < 7; i++) {
+            if ((weekdays >> i & 1) != 0) {
+                out += first ? "" : ";";
+                out += DAY_NAMES[i];
+                first = false;
+            }
+        }
+        if (firstDay != 0 || lastDay != 0) {
+            out += '@';
+            out += firstDay != 0 ? formatDate(firstDay) : "";
+            out += ':';
+            out += lastDay != 0 ? formatDate(lastDay) : "";
+        }
+    }
+
+    bool parse(string_view text) {
+        *this = Schedule{ 0, 0, 0 };
+        size_t at = text.find('@');
+        FieldSplitter days(text.substr(0, at));
+        string_view name;
+        while (days.next(name, ';')) {
+            if (name == "daily") {
+                weekdays = DAILY;
+                continue;
+            }
+            int i = 0;
+            while (i < 7 && name != DAY_NAMES[i]) {
+                i++;
+            }
+            if (i == 7) {
+                return name.empty() && text.empty();
+            }
+            weekdays |= 1u << i;
+        }
+        if (at == string_view::npos) {
+            return true;
+        }
+        FieldSplitter range(text.substr(at + 1));
+        string_view first, last;
+        return weekdays != 0 && range.next(first, ':') && range.next(last, ':') && (first.empty() || parseDate(first, firstDay))
+            && (last.empty() || parseDate(last, lastDay)) && (firstDay == 0 || lastDay == 0 || firstDay <= lastDay);
+    }
+
+    // For listings: "Mon, Wed, Fri from 2026-11-01 until 2027-03-31"
+    string describe() const {
+        string text = weekdays == DAILY ? "Daily" : "";
+        for (int i = 0; weekdays != DAILY && i < 7; i++) {
+            if ((weekdays >> i & 1) != 0) {
+                text += text.empty() ? "" : ", ";
+                text += static_cast<char>(DAY_NAMES[i][0] - 'a' + 'A');
+                text += DAY_NAMES[i] + 1;
+            }
+        }
+        text += firstDay != 0 ? " from " + formatDate(firstDay) : "";
+        text += lastDay != 0 ? " until " + formatDate(lastDay) : "";
+        return text;
+    }
+};
+
+typedef uint32_t StationId;
+
+// Stations Class
+// Dictionary that interns station names into dense integer IDs. There is one
+// for the whole process: every RailwayManagementSystem shares it (the benchmark
+// and the stress test build several), and it never shrinks or resets. Names are
+// never removed, so an ID means the same station in every instance, and IDs and
+// the references name() returns stay valid. Files hold names, or IDs remapped
+// on load, so they do not depend on it; count(), memoryUsage() and stations.txt
+// also cover names that only another instance in the process has used.
+class Stations {
+private:
+    struct Table {
+        shared_mutex m;
+        deque<string> names;
+        unordered_map<string_view, StationId> ids; // views into names
+    };
+
+    static Table& table() {
+        static Table t;
+        return t;
+    }
+
+public:
+    static StationId intern(string_view name) {
+        Table& t = table();
+        {
+            shared_lock<shared_mutex> lock(t.m);
+            auto it = t.ids.find(name);
+            if (it != t.ids.end()) {
+                return it->second;
+            }
+        }
+        unique_lock<shared_mutex> lock(t.m);
+        auto it = t.ids.find(name);
+        if (it != t.ids.end()) {
+            return it->second;
+        }
+        StationId id = static_cast<StationId>(t.names.size());
+        t.names.emplace_back(name);
+        t.ids.emplace(string_view(t.names.back()), id);
+        return id;
+    }
+
+    static bool find(string_view name, StationId& id) {
+        Table& t = table();
+        shared_lock<shared_mutex> lock(t.m);
+        auto it = t.ids.find(name);
+        if (it == t.ids.end()) {
+            return false;
+        }
+        id = it->second;
+        return true;
+    }
+
+    static const string& name(StationId id) {
+        Table& t = table();
+        shared_lock<shared_mutex> lock(t.m);
+        return t.names[id];
+    }
+
+    static size_t count() {
+        Table& t = table();
+        shared_lock<shared_mutex> lock(t.m);
+        return t.names.size();
+    }
+
+    static size_t memoryUsage() {
+        Table& t = table();
+        shared_lock<shared_mutex> lock(t.m);
+        size_t bytes = t.names.size() * sizeof(string) + t.ids.bucket_count() * sizeof(void*)
+            + t.ids.size() * (sizeof(pair<string_view, StationId>) + 2 * sizeof(void*));
+        for (const string& name : t.names) {
+            bytes += name.capacity() > 15 ? name.capacity() + 1 : 0;
+        }
+        return bytes;
+    }
+};
+
+// Record Schemas
+// A record type declares its fields once, in line order, as a list of field
+// codecs. RecordSchema derives the comma-separated text line, its parser and a
+// fixed-width binary row from that list, so a new field is one more entry.
+// Codecs that need outside state (the snapshot's string pool, the user table)
+// get it from a context object passed through by the caller.
+
+// A string stored in a pool elsewhere, by offset and length
+struct StringRef {
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct NoContext {};
+
+// Appends a number without building a temporary string
+template<typename T>
+void appendNumber(string& out, T value) {
+    char digits[24];
+    to_chars_result result = to_chars(digits, digits + sizeof(digits), value);
+    out.append(digits, result.ptr);
+}
+
+template<typename T>
+void putRaw(char* row, size_t& offset, const T& value) {
+    memcpy(row + offset, &value, sizeof(T));
+    offset += sizeof(T);
+}
+
+template<typename T>
+T getRaw(const char* row, size_t& offset) {
+    T value;
+    memcpy(&value, row + offset, sizeof(T));
+    offset += sizeof(T);
+    return value;
+}
+
+template<typename> struct MemberOf;
+template<typename Record, typename T>
+struct MemberOf<T Record::*> {
+    typedef T Type;
+};
+
+// An integer member; an optional one may be missing from the end of older lines
+// and then reads as zero
+template<auto Member, bool Optional = false>
+struct NumberField {
+    typedef typename MemberOf<decltype(Member)>::Type Type;
+    static constexpr size_t BINARY_SIZE = sizeof(Type);
+
+    template<typename Record, typename Context>
+    static void appendText(string& out, const Record& record, Context&) {
+        appendNumber(out, record.*Member);
+    }
+
+    template<typename Record, typename Context>
+    static bool parseText(string_view text, Record& record, Context&) {
+        return parseNumber(text, record.*Member);
+    }
+
+    template<typename Record>
+    static bool missing(Record& record) {
+        record.*Member = 0;
+        return Optional;
+    }
+
+    template<typename Record, typename Context>
+    static void encode(char* row, size_t& offset, const Record& record, Context&) {
+        putRaw(row, offset, record.*Member);
+    }
+
+    template<typename Record, typename Context>
+    static bool decode(const char* row, size_t& offset, Record& record, Context&) {
+        record.*Member = getRaw<Type>(row, offset);
+        return true;
+    }
+};
+
+// A string member without commas; stored in binary rows as a StringRef
+template<auto Member, bool NonEmpty = false>
+struct TextField {
+    static constexpr size_t BINARY_SIZE = sizeof(StringRef);
+
+    template<typename Record, typename Context>
+    static void appendText(string& out, const Record& record, Context&) {
+        out += record.*Member;
+    }
+
+    template<typename Record, typename Context>
+    static bool parseText(string_view text, Record& record, Context&) {
+        (record.*Member).assign(text);
+        return !NonEmpty || !text.empty();
+    }
+
+    template<typename Record>
+    static bool missing(Record&) {
+        return false;
+    }
+
+    template<typename Record, typename Context>
+    static void encode(char* row, size_t& offset, const Record& record, Context& context) {
+        putRaw(row, offset, context.intern(record.*Member));
+    }
+
+    template<typename Record, typename Context>
+    static bool decode(const char* row, size_t& offset, Record& record, Context& context) {
+        string_view text;
+        if (!context.text(getRaw<StringRef>(row, offset), text)) {
+            return false;
+        }
+        (record.*Member).assign(text);
+        return !NonEmpty || !text.empty();
+    }
+};
+
+// A StationId member: the station's name in text, its dictionary ID in binary
+template<auto Member>
+struct StationField {
+    static constexpr size_t BINARY_SIZE = sizeof(uint32_t);
+
+    template<typename Record, typename Context>
+    static void appendText(string& out, const Record& record, Context&) {
+        out += Stations::name(record.*Member);
+    }
+
+    template<typename Record, typename Context>
+    static bool parseText(string_view text, Record& record, Context&) {
+        record.*Member = Stations::intern(text);
+        return true;
+    }
+
+    template<typename Record>
+    static bool missing(Record&) {
+        return false;
+    }
+
+    template<typename Record, typename Context>
+    static void encode(char* row, size_t& offset, const Record& record, Context&) {
+        putRaw<uint32_t>(row, offset, record.*Member);
+    }
+
+    template<typename Record, typename Context>
+    static bool decode(const char* row, size_t& offset, Record& record, Context& context) {
+        return context.station(getRaw<uint32_t>(row, offset), record.*Member);
+    }
+};
+
+// A uint32_t slot in the user table: the username in text. The context
+// resolves names both ways; there is no binary form.
+template<auto Member>
+struct UserField {
+    template<typename Record, typename Context>
+    static void appendText(string& out, const Record& record, Context& context) {
+        out += context.userName(record.*Member);
+    }
+
+    template<typename Record, typename Context>
+    static bool parseText(string_view text, Record& record, Context& context) {
+        long slot = context.userSlot(text);
+        record.*Member = static_cast<uint32_t>(slot);
+        return slot >= 0;
+    }
+
+    template<typename Record>
+    static bool missing(Record&) {
+        return false;
+    }
+};
+
+// A day number member, "YYYY-MM-DD" in text. Day 0 (no date) is an empty field
+// and is what lines from before the field existed read as.
+template<auto Member>
+struct DateField {
+    static constexpr size_t BINARY_SIZE = sizeof(int32_t);
+
+    template<typename Record, typename Context>
+    static void appendText(string& out, const Record& record, Context&) {
+        if (record.*Member != 0) {
+            out += formatDate(record.*Member);
+        }
+    }
+
+    template<typename Record, typename Context>
+    static bool parseText(string_view text, Record& record, Context&) {
+        record.*Member = 0;
+        return text.empty() || parseDate(text, record.*Member);
+    }
+
+    template<typename Record>
+    static bool missing(Record& record) {
+        record.*Member = 0;
+        return true;
+    }
+
+    template<typename Record, typename Context>
+    static void encode(char* row, size_t& offset, const Record& record, Context&) {
+        putRaw<int32_t>(row, offset, record.*Member);
+    }
+
+    template<typename Record, typename Context>
+    static bool decode(const char* row, size_t& offset, Record& record, Context&) {
+        record.*Member = getRaw<int32_t>(row, offset);
+        return true;
+    }
+};
+
+template<typename Record, typename... Fields>
+struct RecordSchema {
+    static constexpr size_t FIELD_COUNT = sizeof...(Fields);
+
+    // Bytes in a binary row; only schemas whose fields all have one may call it
+    static constexpr size_t binarySize() {
+        return (Fields::BINARY_SIZE + ... + 0);
+    }
+
+    // Appends the record's line, without its newline, to out
+    template<typename Context>
+    static void appendText(string& out, const Record& record, Context& context) {
+        size_t field = 0;
+        ((field++ > 0 ? void(out += ',') : void(), Fields::appendText(out, record, context)), ...);
+    }
+
+    static void appendText(string& out, const Record& record) {
+        NoContext context;
+        appendText(out, record, context);
+    }
+
+    // Parses a line; extra trailing fields are ignored
+    template<typename Context>
+    static bool parseText(string_view line, Record& record, Context& context) {
+        FieldSplitter fields(line);
+        string_view text;
+        return ((fields.next(text) ? Fields::parseText(text, record, context) : Fields::missing(record)) && ...);
+    }
+
+    static bool parseText(string_view line, Record& record) {
+        NoContext context;
+        return parseText(line, record, context);
+    }
+
+    // Writes the fields into row, which holds at least binarySize() bytes; the
+    // row is zeroed first, so no byte of it keeps what was there before
+    template<typename Context>
+    static void encode(char* row, const Record& record, Context& context) {
+        memset(row, 0, binarySize());
+        size_t offset = 0;
+        (Fields::encode(row, offset, record, context), ...);
+    }
+
+    template<typename Context>
+    static bool decode(const char* row, Record& record, Context& context) {
+        size_t offset = 0;
+        return (Fields::decode(row, offset, record, context) && ...);
+    }
+};
+
+// A binary row as raw bytes; copying it keeps snapshot sections fixed-width
+template<size_t N>
+struct PackedRow {
+    char bytes[N];
+};
+
 // User Class
 class User {
 public:
@@ -15,505 +613,8797 @@ public:
     string password;
     string role;
 
+    User() {}
+
     User(const string& uname, const string& pwd, const string& r)
         : username(uname), password(pwd), role(r) {}
 
+    typedef RecordSchema<User, TextField<&User::username, true>, TextField<&User::password>, TextField<&User::role>> Schema;
+
+    const string& key() const {
+        return username;
+    }
+
     string toString() const {
-        return username + "," + password + "," + role;
+        string line;
+        Schema::appendText(line, *this);
+        return line;
+    }
+
+    // Parses "username,password,role"; returns false on a malformed line
+    static bool parse(string_view line, User& user) {
+        return Schema::parseText(line, user);
     }
 
-    static User fromString(const string& str) {
-        stringstream ss(str);
-        string username, password, role;
-        getline(ss, username, ',');
-        getline(ss, password, ',');
-        getline(ss, role, ',');
-        return User(username, password, role);
+    // As parse; false, with user only partly filled in, on a malformed line
+    static bool fromString(const string& str, User& user) {
+        return parse(str, user);
     }
 };
 
-// Train Class
-class Train {
-public:
-    int id;
-    string name;
-    string source;
-    string destination;
-    int seats;
+// Booking Record
+// Fixed-size ledger entry; trains are referenced by ID and joined against the
+// live train table when displayed.
+struct BookingRecord {
+    uint64_t id;
+    uint32_t userId; // slot in RailwayManagementSystem::users
+    int32_t trainId;
+    int32_t seat;
+    uint16_t fromStop; // leg of the train's stops the seat is held for;
+    uint16_t toStop;   // toStop 0 means the whole journey
+    int64_t timestamp;
+    int32_t travelDay; // run date on a scheduled train; 0 on an undated one
+    uint32_t reserved;
 
-    Train(int id, const string& name, const string& source, const string& destination, int seats)
-        : id(id), name(name), source(source), destination(destination), seats(seats) {}
+    static constexpr int32_t SEAT_TO_ASSIGN = -1; // loaded from a file without seat numbers; rebuildSeats reserves one
 
-    string toString() const {
-        return to_string(id) + "," + name + "," + source + "," + destination + "," + to_string(seats);
+    // Text lines only; the user is looked up by name through the context
+    typedef RecordSchema<BookingRecord, NumberField<&BookingRecord::id>, UserField<&BookingRecord::userId>, NumberField<&BookingRecord::trainId>,
+        NumberField<&BookingRecord::seat>, NumberField<&BookingRecord::timestamp>, NumberField<&BookingRecord::fromStop, true>,
+        NumberField<&BookingRecord::toStop, true>, DateField<&BookingRecord::travelDay>> Schema;
+};
+
+// A request waiting for a seat; also the snapshot row
+struct WaitlistEntry {
+    uint64_t ticket;
+    uint32_t userId;   // slot in RailwayManagementSystem::users
+    int32_t trainId;
+    uint16_t fromStop;
+    uint16_t toStop;
+    uint32_t priority; // higher is served first
+    int64_t timestamp;
+    int32_t travelDay;
+    uint32_t reserved;
+
+    typedef RecordSchema<WaitlistEntry, NumberField<&WaitlistEntry::ticket>, UserField<&WaitlistEntry::userId>, NumberField<&WaitlistEntry::trainId>,
+        NumberField<&WaitlistEntry::fromStop>, NumberField<&WaitlistEntry::toStop>, NumberField<&WaitlistEntry::priority>,
+        NumberField<&WaitlistEntry::timestamp>, DateField<&WaitlistEntry::travelDay>> Schema;
+};
+
+// Seat Inventory Class
+// One free-seat bitmap per segment (the leg between two consecutive stops): bit
+// k of a segment's bitmap is set while seat k + 1 is free on that leg. A seat
+// free from stop a to stop b is a set bit in the AND of segments a .. b - 1,
+// computed a block of words at a time so the compiler can use vector registers.
+class SeatInventory {
+private:
+    static const size_t BLOCK_WORDS = 4;
+
+    mutable mutex m;
+    int capacity;
+    int segments;
+    size_t words;          // per segment, a multiple of BLOCK_WORDS
+    vector<uint64_t> bits; // segment s is bits[s * words .. (s + 1) * words)
+    atomic<int> wholeFree; // seats free on every segment
+
+    const uint64_t* segment(int s) const {
+        return bits.data() + static_cast<size_t>(s) * words;
     }
 
-    static Train fromString(const string& str) {
-        stringstream ss(str);
-        string id, name, source, destination, seats;
-        getline(ss, id, ',');
-        getline(ss, name, ',');
-        getline(ss, source, ',');
-        getline(ss, destination, ',');
-        getline(ss, seats, ',');
-        return Train(stoi(id), name, source, destination, stoi(seats));
+    uint64_t* segment(int s) {
+        return bits.data() + static_cast<size_t>(s) * words;
+    }
+
+    // ANDs segments [from, to) over words [w, w + BLOCK_WORDS)
+    void andBlock(int from, int to, size_t w, uint64_t block[BLOCK_WORDS]) const {
+        const uint64_t* first = segment(from) + w;
+        for (size_t k = 0; k < BLOCK_WORDS; k++) {
+            block[k] = first[k];
+        }
+        for (int s = from + 1; s < to; s++) {
+            const uint64_t* next = segment(s) + w;
+            for (size_t k = 0; k < BLOCK_WORDS; k++) {
+                block[k] &= next[k];
+            }
+        }
+    }
+
+    bool freeOn(int seat, int from, int to) const {
+        size_t word = static_cast<size_t>(seat - 1) / 64;
+        uint64_t bit = 1ULL << ((seat - 1) % 64);
+        for (int s = from; s < to; s++) {
+            if ((segment(s)[word] & bit) == 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Marks a seat taken on [from, to); the caller holds m
+    void occupy(int seat, int from, int to) {
+        if (freeOn(seat, 0, segments)) {
+            wholeFree.fetch_sub(1, memory_order_relaxed);
+        }
+        size_t word = static_cast<size_t>(seat - 1) / 64;
+        uint64_t bit = 1ULL << ((seat - 1) % 64);
+        for (int s = from; s < to; s++) {
+            segment(s)[word] &= ~bit;
+        }
     }
-};
 
-// Route Class
-class Route {
 public:
-    int id;
-    string source;
-    string destination;
+    SeatInventory() : capacity(0), segments(1), words(0), wholeFree(0) {}
 
-    Route(int id, const string& source, const string& destination)
-        : id(id), source(source), destination(destination) {}
+    SeatInventory(const SeatInventory& other) : wholeFree(0) {
+        *this = other;
+    }
 
-    string toString() const {
-        return to_string(id) + "," + source + "," + destination;
+    SeatInventory& operator=(const SeatInventory& other) {
+        if (this != &other) {
+            lock_guard<mutex> lock(other.m);
+            capacity = other.capacity;
+            segments = other.segments;
+            words = other.words;
+            bits = other.bits;
+            wholeFree.store(other.wholeFree.load());
+        }
+        return *this;
     }
 
-    static Route fromString(const string& str) {
-        stringstream ss(str);
-        string id, source, destination;
-        getline(ss, id, ',');
-        getline(ss, source, ',');
-        getline(ss, destination, ',');
-        return Route(stoi(id), source, destination);
+    // Frees every seat on every segment
+    void reset(int seatCount, int segmentCount) {
+        lock_guard<mutex> lock(m);
+        capacity = max(0, seatCount);
+        segments = max(1, segmentCount);
+        words = (static_cast<size_t>(capacity) + 64 * BLOCK_WORDS - 1) / (64 * BLOCK_WORDS) * BLOCK_WORDS;
+        bits.assign(words * segments, 0);
+        for (int s = 0; s < segments; s++) {
+            uint64_t* row = segment(s);
+            for (int seat = 0; seat < capacity; seat += 64) {
+                int n = min(64, capacity - seat);
+                row[seat / 64] = n == 64 ? ~0ULL : (1ULL << n) - 1;
+            }
+        }
+        wholeFree.store(capacity);
     }
-};
 
-// Node for Linked List
-template<typename T>
-struct ListNode {
-    T data;
-    ListNode* next;
+    int seatCount() const {
+        return capacity;
+    }
 
-    ListNode(const T& value) : data(value), next(nullptr) {}
-};
+    int segmentCount() const {
+        return segments;
+    }
 
-// Linked List Class
-template<typename T>
-class LinkedList {
-private:
-    ListNode<T>* head;
+    int wholeJourneyFree() const {
+        return wholeFree.load(memory_order_relaxed);
+    }
+
+    // Takes the lowest seat free on every segment in [from, to); false if none is
+    bool reserve(int from, int to, int& seat) {
+        lock_guard<mutex> lock(m);
+        uint64_t block[BLOCK_WORDS];
+        for (size_t w = 0; w < words; w += BLOCK_WORDS) {
+            andBlock(from, to, w, block);
+            for (size_t k = 0; k < BLOCK_WORDS; k++) {
+                if (block[k] != 0) {
+                    seat = static_cast<int>((w + k) * 64) + lowestBit64(block[k]) + 1;
+                    occupy(seat, from, to);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Frees a seat on [from, to), as when its booking is cancelled
+    void release(int seat, int from, int to) {
+        lock_guard<mutex> lock(m);
+        if (seat < 1 || seat > capacity) {
+            return;
+        }
+        size_t word = static_cast<size_t>(seat - 1) / 64;
+        uint64_t bit = 1ULL << ((seat - 1) % 64);
+        for (int s = from; s < to; s++) {
+            segment(s)[word] |= bit;
+        }
+        if (freeOn(seat, 0, segments)) {
+            wholeFree.fetch_add(1, memory_order_relaxed);
+        }
+    }
+
+    // Marks a known seat taken, as when replaying bookings; false if it is out of
+    // range or already taken on one of the segments
+    bool take(int seat, int from, int to) {
+        lock_guard<mutex> lock(m);
+        if (seat < 1 || seat > capacity || !freeOn(seat, from, to)) {
+            return false;
+        }
+        occupy(seat, from, to);
+        return true;
+    }
+
+    // Number of seats free on every segment in [from, to)
+    int available(int from, int to) const {
+        lock_guard<mutex> lock(m);
+        int n = 0;
+        uint64_t block[BLOCK_WORDS];
+        for (size_t w = 0; w < words; w += BLOCK_WORDS) {
+            andBlock(from, to, w, block);
+            for (size_t k = 0; k < BLOCK_WORDS; k++) {
+                n += popcount64(block[k]);
+            }
+        }
+        return n;
+    }
+
+    size_t memoryUsage() const {
+        lock_guard<mutex> lock(m);
+        return bits.capacity() * sizeof(uint64_t);
+    }
+};
+
+// Run Calendar Class
+// A scheduled train's seat maps, one per run date. The WINDOW days from the
+// calendar's first day sit in a ring indexed by day, later ones in a hash map,
+// so finding a date's seats is O(1) however far ahead bookings open. Maps are
+// made on first use; rolling the calendar forward drops the days that have
+// passed and moves the days that came into the window into the ring.
+class RunCalendar {
+public:
+    static const int32_t WINDOW = 64;
+
+private:
+    mutable mutex m;
+    int32_t firstDay; // the ring holds days [firstDay, firstDay + WINDOW)
+    vector<unique_ptr<SeatInventory>> ring; // sized on first use; empty for an undated train
+    unordered_map<int32_t, unique_ptr<SeatInventory>> later;
+
+public:
+    RunCalendar() : firstDay(currentDay()) {}
+
+    RunCalendar(const RunCalendar& other) : firstDay(0) {
+        *this = other;
+    }
+
+    RunCalendar& operator=(const RunCalendar& other) {
+        if (this != &other) {
+            lock_guard<mutex> lock(other.m);
+            firstDay = other.firstDay;
+            ring.clear();
+            ring.resize(other.ring.size());
+            for (size_t i = 0; i < ring.size(); i++) {
+                ring[i].reset(other.ring[i] ? new SeatInventory(*other.ring[i]) : nullptr);
+            }
+            later.clear();
+            for (const auto& entry : other.later) {
+                later.emplace(entry.first, unique_ptr<SeatInventory>(new SeatInventory(*entry.second)));
+            }
+        }
+        return *this;
+    }
+
+    // The seats for a day, or null if it has passed or has no map yet
+    const SeatInventory* find(int32_t day) const {
+        lock_guard<mutex> lock(m);
+        if (day < firstDay || ring.empty()) {
+            return nullptr;
+        }
+        if (day < firstDay + WINDOW) {
+            return ring[day % WINDOW].get();
+        }
+        auto it = later.find(day);
+        return it == later.end() ? nullptr : it->second.get();
+    }
+
+    // The seats for a day, made with every seat free if it has no map yet; null
+    // if the day has passed. Maps stay put until the calendar is rolled or cleared.
+    SeatInventory* at(int32_t day, int capacity, int segments) {
+        lock_guard<mutex> lock(m);
+        if (day < firstDay) {
+            return nullptr;
+        }
+        ring.resize(WINDOW);
+        unique_ptr<SeatInventory>& seats = day < firstDay + WINDOW ? ring[day % WINDOW] : later[day];
+        if (!seats) {
+            seats.reset(new SeatInventory());
+            seats->reset(capacity, segments);
+        }
+        return seats.get();
+    }
+
+    // Drops every map and starts the ring at today
+    void clear(int32_t today) {
+        lock_guard<mutex> lock(m);
+        firstDay = today;
+        ring.clear();
+        later.clear();
+    }
+
+    void roll(int32_t today) {
+        lock_guard<mutex> lock(m);
+        if (today <= firstDay || ring.empty()) {
+            firstDay = max(firstDay, today);
+            return;
+        }
+        for (int32_t day = firstDay; day < min(today, firstDay + WINDOW); day++) {
+            ring[day % WINDOW].reset();
+        }
+        firstDay = today;
+        for (auto it = later.begin(); it != later.end();) {
+            if (it->first >= firstDay + WINDOW) {
+                ++it;
+                continue;
+            }
+            if (it->first >= firstDay) {
+                ring[it->first % WINDOW] = move(it->second);
+            }
+            it = later.erase(it);
+        }
+    }
+
+    size_t materialized() const {
+        lock_guard<mutex> lock(m);
+        return later.size() + count_if(ring.begin(), ring.end(), [](const unique_ptr<SeatInventory>& seats) { return seats != nullptr; });
+    }
+
+    size_t memoryUsage() const {
+        lock_guard<mutex> lock(m);
+        size_t bytes = ring.capacity() * sizeof(void*) + later.bucket_count() * sizeof(void*);
+        for (const unique_ptr<SeatInventory>& seats : ring) {
+            bytes += seats ? sizeof(SeatInventory) + seats->memoryUsage() : 0;
+        }
+        for (const auto& entry : later) {
+            bytes += sizeof(entry) + 2 * sizeof(void*) + sizeof(SeatInventory) + entry.second->memoryUsage();
+        }
+        return bytes;
+    }
+};
+
+// Train Class
+class Train {
+public:
+    // Bookings on a scheduled train open this many days ahead, and the runs in
+    // the first MATERIALIZED_DAYS of them always have their seat maps made
+    static const int32_t BOOKING_DAYS = 365;
+    static const int32_t MATERIALIZED_DAYS = 14;
+
+    int id;
+    string name;
+    StationId source;
+    StationId destination;
+    vector<StationId> stops;  // source, any intermediate stops, destination
+    SeatInventory inventory;  // an undated train's seats; sizes the run maps of a scheduled one
+    Schedule schedule;
+    RunCalendar runs;         // a scheduled train's seats, by run date
+    bool legacySeats;         // read from a line without stops, whose seat count was seats left rather than capacity
+    bool removed;             // tombstone: the slot stays put until the table is compacted
+
+    // Sizes the seat maps for the whole journey; the stops field that follows
+    // splits them into segments
+    struct CapacityField {
+        static constexpr size_t BINARY_SIZE = sizeof(int32_t);
+
+        template<typename Context>
+        static void appendText(string& out, const Train& train, Context&) {
+            appendNumber(out, train.capacity());
+        }
+
+        template<typename Context>
+        static bool parseText(string_view text, Train& train, Context&) {
+            int seats;
+            if (!parseNumber(text, seats)) {
+                return false;
+            }
+            train.setRoute(train.source, train.destination, {}, seats);
+            return true;
+        }
+
+        static bool missing(Train&) {
+            return false;
+        }
+
+        template<typename Context>
+        static void encode(char* row, size_t& offset, const Train& train, Context&) {
+            putRaw<int32_t>(row, offset, train.capacity());
+        }
+
+        template<typename Context>
+        static bool decode(const char* row, size_t& offset, Train& train, Context&) {
+            train.setRoute(train.source, train.destination, {}, getRaw<int32_t>(row, offset));
+            return true;
+        }
+    };
+
+    // The stops from source to destination, separated by ';'. Lines written
+    // before trains had stops end at the seat count, which was seats left.
+    // Snapshots keep the stops in their own section.
+    struct StopsField {
+        static constexpr size_t BINARY_SIZE = 2 * sizeof(uint32_t);
+
+        template<typename Context>
+        static void appendText(string& out, const Train& train, Context&) {
+            for (size_t i = 0; i < train.stops.size(); i++) {
+                if (i > 0) {
+                    out += ';';
+                }
+                out += Stations::name(train.stops[i]);
+            }
+        }
+
+        template<typename Context>
+        static bool parseText(string_view text, Train& train, Context&) {
+            vector<StationId> stops;
+            FieldSplitter fields(text);
+            string_view stop;
+            while (fields.next(stop, ';')) {
+                stops.push_back(Stations::intern(stop));
+            }
+            return train.setStops(stops);
+        }
+
+        static bool missing(Train& train) {
+            train.legacySeats = true;
+            return true;
+        }
+
+        template<typename Context>
+        static void encode(char* row, size_t& offset, const Train& train, Context& context) {
+            putRaw<uint32_t>(row, offset, context.addStops(train.stops));
+            putRaw<uint32_t>(row, offset, static_cast<uint32_t>(train.stops.size()));
+        }
+
+        template<typename Context>
+        static bool decode(const char* row, size_t& offset, Train& train, Context& context) {
+            uint32_t first = getRaw<uint32_t>(row, offset);
+            uint32_t count = getRaw<uint32_t>(row, offset);
+            vector<StationId> stops;
+            return context.stops(first, count, stops) && train.setStops(stops);
+        }
+    };
+
+    // The run days, as Schedule writes them; lines from before schedules end at
+    // the stops and are undated
+    struct ScheduleField {
+        static constexpr size_t BINARY_SIZE = sizeof(Schedule);
+
+        template<typename Context>
+        static void appendText(string& out, const Train& train, Context&) {
+            train.schedule.appendText(out);
+        }
+
+        template<typename Context>
+        static bool parseText(string_view text, Train& train, Context&) {
+            return train.schedule.parse(text);
+        }
+
+        static bool missing(Train& train) {
+            train.schedule = Schedule{ 0, 0, 0 };
+            return true;
+        }
+
+        template<typename Context>
+        static void encode(char* row, size_t& offset, const Train& train, Context&) {
+            putRaw(row, offset, train.schedule);
+        }
+
+        template<typename Context>
+        static bool decode(const char* row, size_t& offset, Train& train, Context&) {
+            train.schedule = getRaw<Schedule>(row, offset);
+            return (train.schedule.weekdays & ~Schedule::DAILY) == 0;
+        }
+    };
+
+    typedef RecordSchema<Train, NumberField<&Train::id>, TextField<&Train::name>, StationField<&Train::source>,
+        StationField<&Train::destination>, CapacityField, StopsField, ScheduleField> Schema;
+    // Version 5 and 6 snapshot rows, from before schedules
+    typedef RecordSchema<Train, NumberField<&Train::id>, TextField<&Train::name>, StationField<&Train::source>,
+        StationField<&Train::destination>, CapacityField, StopsField> SchemaV6;
+
+    Train() : id(0), source(0), destination(0), stops(2, 0), schedule{ 0, 0, 0 }, legacySeats(false), removed(false) {}
+
+    Train(int id, const string& name, StationId source, StationId destination, int seats)
+        : id(id), name(name), source(source), destination(destination), stops{ source, destination }, schedule{ 0, 0, 0 }, legacySeats(false),
+          removed(false) {
+        inventory.reset(seats, 1);
+    }
+
+    Train(int id, const string& name, const string& source, const string& destination, int seats)
+        : Train(id, name, Stations::intern(source), Stations::intern(destination), seats) {}
+
+    // Replaces the stops (via lists the intermediate ones) and frees every seat
+    void setRoute(StationId from, StationId to, const vector<StationId>& via, int capacity) {
+        source = from;
+        destination = to;
+        stops.assign(1, from);
+        stops.insert(stops.end(), via.begin(), via.end());
+        stops.push_back(to);
+        inventory.reset(capacity, segmentCount());
+        runs.clear(currentDay());
+    }
+
+    // Replaces the stops with a list running from source to destination and keeps
+    // the capacity; false if the list does not run between the train's endpoints
+    bool setStops(vector<StationId>& list) {
+        if (list.size() < 2 || list.front() != source || list.back() != destination) {
+            return false;
+        }
+        list.pop_back();
+        list.erase(list.begin());
+        setRoute(source, destination, list, capacity());
+        legacySeats = false;
+        return true;
+    }
+
+    int capacity() const {
+        return inventory.seatCount();
+    }
+
+    int segmentCount() const {
+        return static_cast<int>(stops.size()) - 1;
+    }
+
+    // Seats free for the whole journey on the next run
+    int availableSeats() const {
+        return schedule.dated() ? seatsFreeOn(schedule.nextRun(currentDay())) : inventory.wholeJourneyFree();
+    }
+
+    // Seats free for the whole journey on a run date; 0 if the train does not run then
+    int seatsFreeOn(int32_t day) const {
+        if (!schedule.dated()) {
+            return inventory.wholeJourneyFree();
+        }
+        if (day < currentDay() || !schedule.runsOn(day)) {
+            return 0;
+        }
+        const SeatInventory* seats = runs.find(day);
+        return seats != nullptr ? seats->wholeJourneyFree() : capacity();
+    }
+
+    // Seats free from stop fromStop to stop toStop on a run date, as seatsFreeOn
+    int seatsFreeOn(int32_t day, int fromStop, int toStop) const {
+        if (!schedule.dated()) {
+            return inventory.available(fromStop, toStop);
+        }
+        if (day < currentDay() || !schedule.runsOn(day)) {
+            return 0;
+        }
+        const SeatInventory* seats = runs.find(day);
+        return seats != nullptr ? seats->available(fromStop, toStop) : capacity();
+    }
+
+    // Whether a booking can be made for a run date
+    bool bookable(int32_t day) const {
+        int32_t today = currentDay();
+        return schedule.runsOn(day) && day >= today && day < today + BOOKING_DAYS;
+    }
+
+    // The seats sold for a run date, made on first use; null if the date has
+    // passed. An undated train has one set of seats whatever the date.
+    SeatInventory* seatsOn(int32_t day) {
+        return schedule.dated() ? runs.at(day, capacity(), segmentCount()) : &inventory;
+    }
+
+    // Makes the seat maps for the runs in the next MATERIALIZED_DAYS days
+    void materializeRuns(int32_t today) {
+        for (int32_t day = today; schedule.dated() && day < today + MATERIALIZED_DAYS; day++) {
+            if (schedule.runsOn(day)) {
+                runs.at(day, capacity(), segmentCount());
+            }
+        }
+    }
+
+    // Position of a station among the stops, or -1
+    int stopIndex(StationId station) const {
+        for (size_t i = 0; i < stops.size(); i++) {
+            if (stops[i] == station) {
+                return static_cast<int>(i);
+            }
+        }
+        return -1;
+    }
+
+    // Takes the lowest seat free from stop fromStop to stop toStop on a run date; never oversells
+    bool reserveSeat(int32_t day, int fromStop, int toStop, int& seat) {
+        SeatInventory* seats = seatsOn(day);
+        return seats != nullptr && seats->reserve(fromStop, toStop, seat);
+    }
+
+    // The stops a booking covers; records without stops cover the whole journey
+    void legFor(const BookingRecord& booking, int& fromStop, int& toStop) const {
+        fromStop = booking.fromStop;
+        toStop = booking.toStop;
+        clampLeg(fromStop, toStop);
+    }
+
+    // Widens a leg that is unset or no longer fits the stops to the whole journey
+    void clampLeg(int& fromStop, int& toStop) const {
+        if (toStop == 0 || toStop > segmentCount() || fromStop >= toStop) {
+            fromStop = 0;
+            toStop = segmentCount();
+        }
+    }
+
+    int key() const {
+        return id;
+    }
+
+    const string& sourceName() const {
+        return Stations::name(source);
+    }
+
+    const string& destinationName() const {
+        return Stations::name(destination);
+    }
+
+    string toString() const {
+        string line;
+        Schema::appendText(line, *this);
+        return line;
+    }
+
+    // Parses "id,name,source,destination,capacity,stop;stop;...,schedule", where the
+    // stops run from source to destination, or the older "id,name,source,destination,seats";
+    // returns false on a malformed line
+    static bool parse(string_view line, Train& train) {
+        return Schema::parseText(line, train);
+    }
+
+    // As parse; false, with train only partly filled in, on a malformed line
+    static bool fromString(const string& str, Train& train) {
+        return parse(str, train);
+    }
+};
+
+// Route Class
+class Route {
+public:
+    int id;
+    StationId source;
+    StationId destination;
+    bool removed; // tombstone: the slot stays put until the table is compacted
+
+    typedef RecordSchema<Route, NumberField<&Route::id>, StationField<&Route::source>, StationField<&Route::destination>> Schema;
+
+    Route() : id(0), source(0), destination(0), removed(false) {}
+
+    Route(int id, StationId source, StationId destination)
+        : id(id), source(source), destination(destination), removed(false) {}
+
+    Route(int id, const string& source, const string& destination)
+        : id(id), source(Stations::intern(source)), destination(Stations::intern(destination)), removed(false) {}
+
+    int key() const {
+        return id;
+    }
+
+    const string& sourceName() const {
+        return Stations::name(source);
+    }
+
+    const string& destinationName() const {
+        return Stations::name(destination);
+    }
+
+    string toString() const {
+        string line;
+        Schema::appendText(line, *this);
+        return line;
+    }
+
+    // Parses "id,source,destination"; returns false on a malformed line
+    static bool parse(string_view line, Route& route) {
+        return Schema::parseText(line, route);
+    }
+
+    // As parse; false, with route only partly filled in, on a malformed line
+    static bool fromString(const string& str, Route& route) {
+        return parse(str, route);
+    }
+};
+
+// Booking Ledger Class
+// Records live in fixed-size chunks that never move, so a position handed out by
+// an index stays readable while other threads append. Appends only serialize on
+// a short critical section; the per-user and per-train indexes are lock-striped.
+class BookingLedger {
+private:
+    static const uint32_t CHUNK_BITS = 16;
+    static const uint32_t CHUNK_SIZE = 1u << CHUNK_BITS;
+    static const uint32_t MAX_CHUNKS = 1u << 16;
+    static constexpr size_t MAX_RECORDS = static_cast<size_t>(MAX_CHUNKS) * CHUNK_SIZE;
+    static const size_t STRIPES = 64;
+
+    template<typename K>
+    struct Stripe {
+        mutex m;
+        unordered_map<K, vector<uint32_t>> positions;
+    };
+
+    unique_ptr<unique_ptr<BookingRecord[]>[]> chunks;
+    uint32_t chunkCount;
+    size_t count;
+    unique_ptr<unique_ptr<uint32_t[]>[]> cancelChunks; // positions of cancelled records, in the order they were cancelled
+    size_t cancelCount;
+    atomic<uint64_t> changes; // bumped by every append and cancellation
+    mutable mutex appendMutex;
+    Stripe<uint32_t> userStripes[STRIPES];  // userId -> record positions
+    Stripe<int> trainStripes[STRIPES];      // trainId -> record positions
+
+    template<typename K>
+    static Stripe<K>& stripeFor(Stripe<K>* stripes, K key) {
+        return stripes[static_cast<uint32_t>(key) % STRIPES];
+    }
+
+    template<typename K>
+    static vector<uint32_t> positionsFor(Stripe<K>* stripes, K key) {
+        Stripe<K>& stripe = stripeFor(stripes, key);
+        lock_guard<mutex> lock(stripe.m);
+        auto it = stripe.positions.find(key);
+        return it == stripe.positions.end() ? vector<uint32_t>() : it->second;
+    }
+
+    void index(uint32_t pos, const BookingRecord& booking) {
+        {
+            Stripe<uint32_t>& stripe = stripeFor(userStripes, booking.userId);
+            lock_guard<mutex> lock(stripe.m);
+            stripe.positions[booking.userId].push_back(pos);
+        }
+        Stripe<int>& stripe = stripeFor(trainStripes, booking.trainId);
+        lock_guard<mutex> lock(stripe.m);
+        stripe.positions[booking.trainId].push_back(pos);
+    }
+
+    // The caller holds appendMutex
+    void logCancel(uint32_t pos) {
+        size_t i = cancelCount++;
+        if ((i & (CHUNK_SIZE - 1)) == 0) {
+            cancelChunks[i >> CHUNK_BITS].reset(new uint32_t[CHUNK_SIZE]);
+        }
+        cancelChunks[i >> CHUNK_BITS][i & (CHUNK_SIZE - 1)] = pos;
+    }
+
+public:
+    uint64_t nextId;
+
+    BookingLedger()
+        : chunks(new unique_ptr<BookingRecord[]>[MAX_CHUNKS]), chunkCount(0), count(0), cancelChunks(new unique_ptr<uint32_t[]>[MAX_CHUNKS]),
+          cancelCount(0), changes(0), nextId(1) {}
+
+    size_t size() const {
+        lock_guard<mutex> lock(appendMutex);
+        return count;
+    }
+
+    const BookingRecord& at(uint32_t pos) const {
+        return chunks[pos >> CHUNK_BITS][pos & (CHUNK_SIZE - 1)];
+    }
+
+    // Appends a booking and copies it to booking; id 0 assigns the next free
+    // booking id. False, with nothing added, if the ledger is full.
+    bool add(BookingRecord& booking, uint32_t userId, int trainId, int seat, int64_t timestamp, uint64_t id = 0, int fromStop = 0,
+        int toStop = 0, int32_t travelDay = 0) {
+        uint32_t pos;
+        {
+            lock_guard<mutex> lock(appendMutex);
+            if (count >= MAX_RECORDS) {
+                return false;
+            }
+            if (id == 0) {
+                id = nextId;
+            }
+            nextId = max(nextId, id + 1);
+            pos = static_cast<uint32_t>(count++);
+            if ((pos >> CHUNK_BITS) == chunkCount) {
+                chunks[chunkCount++].reset(new BookingRecord[CHUNK_SIZE]);
+            }
+            booking = BookingRecord{ id, userId, trainId, seat, static_cast<uint16_t>(fromStop), static_cast<uint16_t>(toStop), timestamp, travelDay, 0 };
+            chunks[pos >> CHUNK_BITS][pos & (CHUNK_SIZE - 1)] = booking;
+            if (seat == 0) {
+                logCancel(pos);
+            }
+            changes++;
+        }
+        index(pos, booking);
+        return true;
+    }
+
+    // Marks a booking cancelled by clearing its seat; false if it already was.
+    // The caller must keep readers of the seat out; read views use the log instead.
+    bool cancel(uint32_t pos) {
+        lock_guard<mutex> lock(appendMutex);
+        BookingRecord& booking = chunks[pos >> CHUNK_BITS][pos & (CHUNK_SIZE - 1)];
+        if (booking.seat == 0) {
+            return false;
+        }
+        booking.seat = 0;
+        logCancel(pos);
+        changes++;
+        return true;
+    }
+
+    // Gives a booking loaded without a usable seat the one reserved for it.
+    // The caller must keep readers of the seat out, as for cancel.
+    void setSeat(uint32_t pos, int seat) {
+        lock_guard<mutex> lock(appendMutex);
+        chunks[pos >> CHUNK_BITS][pos & (CHUNK_SIZE - 1)].seat = seat;
+        changes++;
+    }
+
+    // Cancellations so far. Entries never change once written, so a reader may
+    // walk any prefix it has seen counted without a lock.
+    size_t cancelledCount() const {
+        lock_guard<mutex> lock(appendMutex);
+        return cancelCount;
+    }
+
+    // Records and cancellations so far, counted together
+    void counts(size_t& records, size_t& cancelled) const {
+        lock_guard<mutex> lock(appendMutex);
+        records = count;
+        cancelled = cancelCount;
+    }
+
+    uint32_t cancelledAt(size_t i) const {
+        return cancelChunks[i >> CHUNK_BITS][i & (CHUNK_SIZE - 1)];
+    }
+
+    uint64_t version() const {
+        return changes.load();
+    }
+
+    // Adds n empty positions at the end for put to fill and returns the first.
+    // Not safe against concurrent appends.
+    uint32_t extend(size_t n) {
+        lock_guard<mutex> lock(appendMutex);
+        uint32_t first = static_cast<uint32_t>(count);
+        count += n;
+        while (static_cast<size_t>(chunkCount) * CHUNK_SIZE < count) {
+            chunks[chunkCount++].reset(new BookingRecord[CHUNK_SIZE]);
+        }
+        changes++;
+        return first;
+    }
+
+    // Fills a position made by extend with a loaded record and indexes it;
+    // threads may fill different positions at once
+    void put(uint32_t pos, const BookingRecord& booking) {
+        chunks[pos >> CHUNK_BITS][pos & (CHUNK_SIZE - 1)] = booking;
+        if (booking.seat == 0) {
+            lock_guard<mutex> lock(appendMutex);
+            logCancel(pos);
+        }
+        index(pos, booking);
+    }
+
+    // Replaces the ledger with a block of records and rebuilds the indexes.
+    // Not safe against concurrent appends.
+    // withStops is false for records written before bookings carried their leg.
+    void assign(const BookingRecord* first, size_t n, uint64_t next, bool withStops = true) {
+        clear();
+        nextId = next;
+        BookingRecord added;
+        for (size_t i = 0; i < n; i++) {
+            add(added, first[i].userId, first[i].trainId, first[i].seat, first[i].timestamp, first[i].id,
+                withStops ? first[i].fromStop : 0, withStops ? first[i].toStop : 0, first[i].travelDay);
+        }
+    }
+
+    void clear() {
+        lock_guard<mutex> lock(appendMutex);
+        for (uint32_t i = 0; i < chunkCount; i++) {
+            chunks[i].reset();
+        }
+        chunkCount = 0;
+        count = 0;
+        for (size_t i = 0; i < cancelCount; i += CHUNK_SIZE) {
+            cancelChunks[i >> CHUNK_BITS].reset();
+        }
+        cancelCount = 0;
+        changes++;
+        nextId = 1;
+        for (size_t i = 0; i < STRIPES; i++) {
+            userStripes[i].positions.clear();
+            trainStripes[i].positions.clear();
+        }
+    }
+
+    // Calls fn(records, n) for each contiguous run of records, in position order.
+    // The caller must keep appends out while this runs.
+    template<typename Fn>
+    void forEachRun(Fn fn) const {
+        for (uint32_t i = 0; i < chunkCount; i++) {
+            size_t n = min<size_t>(CHUNK_SIZE, count - static_cast<size_t>(i) * CHUNK_SIZE);
+            fn(chunks[i].get(), n);
+        }
+    }
+
+    // Approximate heap bytes held by the records and the cancel log
+    size_t recordMemory() const {
+        lock_guard<mutex> lock(appendMutex);
+        return static_cast<size_t>(chunkCount) * CHUNK_SIZE * sizeof(BookingRecord)
+            + (cancelCount + CHUNK_SIZE - 1) / CHUNK_SIZE * CHUNK_SIZE * sizeof(uint32_t);
+    }
+
+    // Approximate heap bytes held by both indexes; walks every stripe
+    size_t indexMemory() {
+        size_t bytes = 0;
+        for (size_t i = 0; i < STRIPES; i++) {
+            bytes += stripeMemory(userStripes[i]) + stripeMemory(trainStripes[i]);
+        }
+        return bytes;
+    }
+
+    template<typename K>
+    static size_t stripeMemory(Stripe<K>& stripe) {
+        lock_guard<mutex> lock(stripe.m);
+        size_t bytes = stripe.positions.bucket_count() * sizeof(void*);
+        for (const auto& entry : stripe.positions) {
+            bytes += sizeof(entry) + 2 * sizeof(void*) + entry.second.capacity() * sizeof(uint32_t);
+        }
+        return bytes;
+    }
+
+    vector<uint32_t> forUser(uint32_t userId) {
+        return positionsFor(userStripes, userId);
+    }
+
+    vector<uint32_t> forTrain(int trainId) {
+        return positionsFor(trainStripes, trainId);
+    }
+};
+
+enum BookingStatus {
+    BOOKING_OK,
+    BOOKING_NO_TRAIN,
+    BOOKING_NO_SEATS,
+    BOOKING_NO_USER,
+    BOOKING_BAD_STOPS,
+    BOOKING_WAITLISTED,
+    BOOKING_NOT_RUNNING,
+    BOOKING_LEDGER_FULL
+};
+
+// Node for Linked List
+template<typename T>
+struct ListNode {
+    T data;
+    ListNode* next;
+
+    ListNode(const T& value) : data(value), next(nullptr) {}
+};
+
+// Node Pool Class
+// Hands out nodes from blocks of BLOCK_SIZE, reusing released nodes, so a
+// container makes one allocation per block instead of one per element.
+template<typename Node>
+class NodePool {
+private:
+    static const size_t BLOCK_SIZE = 256;
+
+    union Slot {
+        Slot* nextFree;
+        alignas(Node) unsigned char storage[sizeof(Node)];
+    };
+
+    vector<unique_ptr<Slot[]>> blocks;
+    size_t usedInBlock;
+    Slot* freeList;
+
+public:
+    NodePool() : usedInBlock(BLOCK_SIZE), freeList(nullptr) {}
+
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+
+    template<typename... Args>
+    Node* create(Args&&... args) {
+        Slot* slot;
+        if (freeList != nullptr) {
+            slot = freeList;
+            freeList = freeList->nextFree;
+        }
+        else {
+            if (usedInBlock == BLOCK_SIZE) {
+                blocks.emplace_back(new Slot[BLOCK_SIZE]);
+                usedInBlock = 0;
+            }
+            slot = &blocks.back()[usedInBlock++];
+        }
+        return new (slot->storage) Node(std::forward<Args>(args)...);
+    }
+
+    void destroy(Node* node) {
+        node->~Node();
+        Slot* slot = reinterpret_cast<Slot*>(node);
+        slot->nextFree = freeList;
+        freeList = slot;
+    }
+
+    // Drops every block at once; the caller must have destroyed the nodes
+    void release() {
+        blocks.clear();
+        usedInBlock = BLOCK_SIZE;
+        freeList = nullptr;
+    }
+};
+
+// Linked List Class
+// Singly linked list with a tail pointer, so append is O(1); nodes come from a pool
+template<typename T>
+class LinkedList {
+private:
+    ListNode<T>* head;
+    ListNode<T>* tail;
+    size_t count;
+    NodePool<ListNode<T>> pool;
+
+public:
+    LinkedList() : head(nullptr), tail(nullptr), count(0) {}
+
+    ~LinkedList() {
+        clear();
+    }
+
+    void append(const T& value) {
+        ListNode<T>* newNode = pool.create(value);
+        if (!head) {
+            head = newNode;
+        }
+        else {
+            tail->next = newNode;
+        }
+        tail = newNode;
+        count++;
+    }
+
+    // Removes and returns the first element; the list must not be empty
+    T popFront() {
+        ListNode<T>* first = head;
+        T value = first->data;
+        head = first->next;
+        if (!head) {
+            tail = nullptr;
+        }
+        pool.destroy(first);
+        count--;
+        return value;
+    }
+
+    void clear() {
+        while (head) {
+            ListNode<T>* temp = head;
+            head = head->next;
+            temp->~ListNode<T>();
+        }
+        tail = nullptr;
+        count = 0;
+        pool.release();
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    ListNode<T>* getHead() const {
+        return head;
+    }
+
+    ListNode<T>* getTail() const {
+        return tail;
+    }
+};
+
+// Waitlist Class
+// Requests waiting for a seat on one train run. Higher priorities are served first
+// and each priority is first in, first out. The lists are pool-backed, so
+// queueing and promoting a request are O(1) each.
+class Waitlist {
+public:
+    static const int PRIORITIES = 3;
+
+private:
+    mutable mutex m;
+    LinkedList<WaitlistEntry> levels[PRIORITIES];
+
+public:
+    // Queues a request and calls queued(ahead) with the number of requests served
+    // before it, while no other request can queue, so callers can log in queue order
+    template<typename Fn>
+    void push(const WaitlistEntry& entry, Fn queued) {
+        lock_guard<mutex> lock(m);
+        size_t ahead = 0;
+        for (int p = static_cast<int>(entry.priority); p < PRIORITIES; p++) {
+            ahead += levels[p].size();
+        }
+        levels[entry.priority].append(entry);
+        queued(ahead);
+    }
+
+    // The request to serve next; false if none are waiting
+    bool front(WaitlistEntry& entry) const {
+        lock_guard<mutex> lock(m);
+        for (int p = PRIORITIES - 1; p >= 0; p--) {
+            if (levels[p].size() > 0) {
+                entry = levels[p].getHead()->data;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Removes the request with this ticket if it is the next one at its priority,
+    // as promotions always take; false otherwise
+    bool popTicket(uint64_t ticket) {
+        lock_guard<mutex> lock(m);
+        for (int p = PRIORITIES - 1; p >= 0; p--) {
+            if (levels[p].size() > 0 && levels[p].getHead()->data.ticket == ticket) {
+                levels[p].popFront();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    size_t size() const {
+        lock_guard<mutex> lock(m);
+        size_t n = 0;
+        for (const LinkedList<WaitlistEntry>& level : levels) {
+            n += level.size();
+        }
+        return n;
+    }
+
+    // Calls fn(entry) in the order requests will be served
+    template<typename Fn>
+    void forEach(Fn fn) const {
+        lock_guard<mutex> lock(m);
+        for (int p = PRIORITIES - 1; p >= 0; p--) {
+            for (const ListNode<WaitlistEntry>* node = levels[p].getHead(); node != nullptr; node = node->next) {
+                fn(node->data);
+            }
+        }
+    }
+};
+
+// B-Tree Class
+// Ordered map kept as a B+ tree: nodes hold up to CAPACITY sorted keys (a few
+// cache lines), values live in the leaves and leaves are chained, so lookups
+// touch O(log n) nodes and ordered scans read leaves front to back. A node
+// that erase leaves under half full borrows a key from a sibling or merges
+// with it, so the tree shrinks as keys are removed.
+template<typename K, typename V>
+class BTree {
+private:
+    static const int CAPACITY = sizeof(K) <= 8 ? 256 / static_cast<int>(sizeof(K) + sizeof(void*)) : 8;
+    static const int MIN_COUNT = CAPACITY / 2; // a split leaves both halves at least this full
+
+    struct Node {
+        bool leaf;
+        int count;
+        K keys[CAPACITY];
+
+        explicit Node(bool isLeaf) : leaf(isLeaf), count(0) {}
+    };
+
+    struct Leaf : Node {
+        V values[CAPACITY];
+        Leaf* next;
+
+        Leaf() : Node(true), next(nullptr) {}
+    };
+
+    struct Inner : Node {
+        Node* children[CAPACITY + 1]; // children[i] holds keys below keys[i]
+
+        Inner() : Node(false) {}
+    };
+
+    Node* root;
+    size_t count;
+
+    static int lowerBound(const Node* node, const K& key) {
+        return static_cast<int>(lower_bound(node->keys, node->keys + node->count, key) - node->keys);
+    }
+
+    static int childFor(const Node* node, const K& key) {
+        return static_cast<int>(upper_bound(node->keys, node->keys + node->count, key) - node->keys);
+    }
+
+    Leaf* leafFor(const K& key) const {
+        Node* node = root;
+        while (node != nullptr && !node->leaf) {
+            node = static_cast<Inner*>(node)->children[childFor(node, key)];
+        }
+        return static_cast<Leaf*>(node);
+    }
+
+    // Inserts into the subtree; on a split, returns the new right sibling and its first key
+    bool insertInto(Node* node, const K& key, const V& value, K& splitKey, Node*& splitNode) {
+        splitNode = nullptr;
+        if (node->leaf) {
+            Leaf* leaf = static_cast<Leaf*>(node);
+            int pos = lowerBound(leaf, key);
+            if (pos < leaf->count && !(key < leaf->keys[pos])) {
+                leaf->values[pos] = value;
+                return false;
+            }
+            if (leaf->count == CAPACITY) {
+                Leaf* right = new Leaf();
+                int half = CAPACITY / 2;
+                right->count = CAPACITY - half;
+                copy(leaf->keys + half, leaf->keys + CAPACITY, right->keys);
+                copy(leaf->values + half, leaf->values + CAPACITY, right->values);
+                leaf->count = half;
+                right->next = leaf->next;
+                leaf->next = right;
+                if (pos > half) {
+                    leaf = right;
+                    pos -= half;
+                }
+                splitKey = right->keys[0];
+                splitNode = right;
+            }
+            copy_backward(leaf->keys + pos, leaf->keys + leaf->count, leaf->keys + leaf->count + 1);
+            copy_backward(leaf->values + pos, leaf->values + leaf->count, leaf->values + leaf->count + 1);
+            leaf->keys[pos] = key;
+            leaf->values[pos] = value;
+            leaf->count++;
+            return true;
+        }
+        Inner* inner = static_cast<Inner*>(node);
+        int index = childFor(inner, key);
+        K childKey;
+        Node* childSplit;
+        bool inserted = insertInto(inner->children[index], key, value, childKey, childSplit);
+        if (childSplit == nullptr) {
+            return inserted;
+        }
+        if (inner->count < CAPACITY) {
+            copy_backward(inner->keys + index, inner->keys + inner->count, inner->keys + inner->count + 1);
+            copy_backward(inner->children + index + 1, inner->children + inner->count + 1, inner->children + inner->count + 2);
+            inner->keys[index] = childKey;
+            inner->children[index + 1] = childSplit;
+            inner->count++;
+            return inserted;
+        }
+        // Full: lay out the CAPACITY + 1 keys, then move the upper half to a new node
+        K keys[CAPACITY + 1];
+        Node* children[CAPACITY + 2];
+        copy(inner->keys, inner->keys + index, keys);
+        keys[index] = childKey;
+        copy(inner->keys + index, inner->keys + CAPACITY, keys + index + 1);
+        copy(inner->children, inner->children + index + 1, children);
+        children[index + 1] = childSplit;
+        copy(inner->children + index + 1, inner->children + CAPACITY + 1, children + index + 2);
+        int mid = (CAPACITY + 1) / 2;
+        Inner* right = new Inner();
+        inner->count = mid;
+        copy(keys, keys + mid, inner->keys);
+        copy(children, children + mid + 1, inner->children);
+        right->count = CAPACITY - mid;
+        copy(keys + mid + 1, keys + CAPACITY + 1, right->keys);
+        copy(children + mid + 1, children + CAPACITY + 2, right->children);
+        splitKey = keys[mid];
+        splitNode = right;
+        return inserted;
+    }
+
+    // Erases from the subtree, then refills the child it descended into if that
+    // child fell under MIN_COUNT
+    bool eraseFrom(Node* node, const K& key) {
+        if (node->leaf) {
+            Leaf* leaf = static_cast<Leaf*>(node);
+            int pos = lowerBound(leaf, key);
+            if (pos == leaf->count || key < leaf->keys[pos]) {
+                return false;
+            }
+            copy(leaf->keys + pos + 1, leaf->keys + leaf->count, leaf->keys + pos);
+            copy(leaf->values + pos + 1, leaf->values + leaf->count, leaf->values + pos);
+            leaf->count--;
+            return true;
+        }
+        Inner* inner = static_cast<Inner*>(node);
+        int index = childFor(inner, key);
+        if (!eraseFrom(inner->children[index], key)) {
+            return false;
+        }
+        if (inner->children[index]->count < MIN_COUNT) {
+            rebalance(inner, index);
+        }
+        return true;
+    }
+
+    // Refills parent->children[index] from a sibling that can spare a key, or
+    // merges it with one
+    static void rebalance(Inner* parent, int index) {
+        if (index > 0 && parent->children[index - 1]->count > MIN_COUNT) {
+            borrowFromLeft(parent, index);
+        }
+        else if (index < parent->count && parent->children[index + 1]->count > MIN_COUNT) {
+            borrowFromRight(parent, index);
+        }
+        else if (index > 0) {
+            merge(parent, index - 1);
+        }
+        else {
+            merge(parent, index);
+        }
+    }
+
+    static void borrowFromLeft(Inner* parent, int index) {
+        Node* node = parent->children[index];
+        Node* left = parent->children[index - 1];
+        copy_backward(node->keys, node->keys + node->count, node->keys + node->count + 1);
+        if (node->leaf) {
+            Leaf* leaf = static_cast<Leaf*>(node);
+            Leaf* from = static_cast<Leaf*>(left);
+            copy_backward(leaf->values, leaf->values + leaf->count, leaf->values + leaf->count + 1);
+            leaf->keys[0] = from->keys[from->count - 1];
+            leaf->values[0] = from->values[from->count - 1];
+            parent->keys[index - 1] = leaf->keys[0];
+        }
+        else {
+            Inner* inner = static_cast<Inner*>(node);
+            Inner* from = static_cast<Inner*>(left);
+            copy_backward(inner->children, inner->children + inner->count + 1, inner->children + inner->count + 2);
+            inner->keys[0] = parent->keys[index - 1];
+            inner->children[0] = from->children[from->count];
+            parent->keys[index - 1] = from->keys[from->count - 1];
+        }
+        left->count--;
+        node->count++;
+    }
+
+    static void borrowFromRight(Inner* parent, int index) {
+        Node* node = parent->children[index];
+        Node* right = parent->children[index + 1];
+        if (node->leaf) {
+            Leaf* leaf = static_cast<Leaf*>(node);
+            Leaf* from = static_cast<Leaf*>(right);
+            leaf->keys[leaf->count] = from->keys[0];
+            leaf->values[leaf->count] = from->values[0];
+            copy(from->keys + 1, from->keys + from->count, from->keys);
+            copy(from->values + 1, from->values + from->count, from->values);
+            parent->keys[index] = from->keys[0];
+        }
+        else {
+            Inner* inner = static_cast<Inner*>(node);
+            Inner* from = static_cast<Inner*>(right);
+            inner->keys[inner->count] = parent->keys[index];
+            inner->children[inner->count + 1] = from->children[0];
+            parent->keys[index] = from->keys[0];
+            copy(from->keys + 1, from->keys + from->count, from->keys);
+            copy(from->children + 1, from->children + from->count + 1, from->children);
+        }
+        right->count--;
+        node->count++;
+    }
+
+    // Moves parent->children[index + 1] into parent->children[index]; one is under
+    // MIN_COUNT and the other at most at it, so the keys fit in one node
+    static void merge(Inner* parent, int index) {
+        Node* left = parent->children[index];
+        Node* right = parent->children[index + 1];
+        if (left->leaf) {
+            Leaf* into = static_cast<Leaf*>(left);
+            Leaf* from = static_cast<Leaf*>(right);
+            copy(from->keys, from->keys + from->count, into->keys + into->count);
+            copy(from->values, from->values + from->count, into->values + into->count);
+            into->count += from->count;
+            into->next = from->next;
+            delete from;
+        }
+        else {
+            Inner* into = static_cast<Inner*>(left);
+            Inner* from = static_cast<Inner*>(right);
+            into->keys[into->count] = parent->keys[index];
+            copy(from->keys, from->keys + from->count, into->keys + into->count + 1);
+            copy(from->children, from->children + from->count + 1, into->children + into->count + 1);
+            into->count += from->count + 1;
+            delete from;
+        }
+        copy(parent->keys + index + 1, parent->keys + parent->count, parent->keys + index);
+        copy(parent->children + index + 2, parent->children + parent->count + 1, parent->children + index + 1);
+        parent->count--;
+    }
+
+    static void destroy(Node* node) {
+        if (node == nullptr) {
+            return;
+        }
+        if (node->leaf) {
+            delete static_cast<Leaf*>(node);
+            return;
+        }
+        Inner* inner = static_cast<Inner*>(node);
+        for (int i = 0; i <= inner->count; i++) {
+            destroy(inner->children[i]);
+        }
+        delete inner;
+    }
+
+public:
+    BTree() : root(nullptr), count(0) {}
+
+    BTree(const BTree&) = delete;
+    BTree& operator=(const BTree&) = delete;
+
+    ~BTree() {
+        clear();
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    // Inserts or replaces the value for key
+    void insert(const K& key, const V& value) {
+        if (root == nullptr) {
+            root = new Leaf();
+        }
+        K splitKey;
+        Node* splitNode;
+        if (insertInto(root, key, value, splitKey, splitNode)) {
+            count++;
+        }
+        if (splitNode != nullptr) {
+            Inner* newRoot = new Inner();
+            newRoot->count = 1;
+            newRoot->keys[0] = splitKey;
+            newRoot->children[0] = root;
+            newRoot->children[1] = splitNode;
+            root = newRoot;
+        }
+    }
+
+    V* search(const K& key) const {
+        Leaf* leaf = leafFor(key);
+        if (leaf == nullptr) {
+            return nullptr;
+        }
+        int pos = lowerBound(leaf, key);
+        return pos < leaf->count && !(key < leaf->keys[pos]) ? &leaf->values[pos] : nullptr;
+    }
+
+    bool erase(const K& key) {
+        if (root == nullptr || !eraseFrom(root, key)) {
+            return false;
+        }
+        count--;
+        // A root left without keys hands over to its only child, or goes if it was the last leaf
+        if (root->count == 0) {
+            Node* old = root;
+            root = root->leaf ? nullptr : static_cast<Inner*>(root)->children[0];
+            if (old->leaf) {
+                delete static_cast<Leaf*>(old);
+            }
+            else {
+                delete static_cast<Inner*>(old);
+            }
+        }
+        return true;
+    }
+
+    // Calls fn(key, value) for every key in [first, last], in key order
+    template<typename Fn>
+    void forRange(const K& first, const K& last, Fn fn) const {
+        Leaf* leaf = leafFor(first);
+        int pos = leaf == nullptr ? 0 : lowerBound(leaf, first);
+        for (; leaf != nullptr; leaf = leaf->next, pos = 0) {
+            for (; pos < leaf->count; pos++) {
+                if (last < leaf->keys[pos]) {
+                    return;
+                }
+                fn(leaf->keys[pos], leaf->values[pos]);
+            }
+        }
+    }
+
+    // Calls fn(key, value) for every key, in key order
+    template<typename Fn>
+    void forEach(Fn fn) const {
+        Node* node = root;
+        while (node != nullptr && !node->leaf) {
+            node = static_cast<Inner*>(node)->children[0];
+        }
+        for (Leaf* leaf = static_cast<Leaf*>(node); leaf != nullptr; leaf = leaf->next) {
+            for (int pos = 0; pos < leaf->count; pos++) {
+                fn(leaf->keys[pos], leaf->values[pos]);
+            }
+        }
+    }
+
+    void clear() {
+        destroy(root);
+        root = nullptr;
+        count = 0;
+    }
+};
+
+// Hash Index Class
+// Open-addressing (linear probing) primary-key index over a deque of records.
+// Entries hold only the record slot and its hash; keys are compared against
+// the record itself, so the index stays small even for string keys.
+template<typename Record>
+class HashIndex {
+private:
+    static const uint32_t EMPTY = 0xFFFFFFFFu;
+    static const uint32_t DELETED = 0xFFFFFFFEu;
+
+    struct Entry {
+        uint32_t hash;
+        uint32_t slot;
+    };
+
+    const deque<Record>& records;
+    vector<Entry> table;
+    size_t count;
+    size_t used; // live + deleted entries
+
+    template<typename K>
+    static uint32_t hashKey(const K& key) {
+        uint64_t h = static_cast<uint64_t>(std::hash<K>()(key));
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return static_cast<uint32_t>(h);
+    }
+
+    void rehash(size_t newCapacity) {
+        vector<Entry> old;
+        old.swap(table);
+        table.assign(newCapacity, Entry{ 0, EMPTY });
+        used = count;
+        size_t mask = newCapacity - 1;
+        for (const Entry& e : old) {
+            if (e.slot == EMPTY || e.slot == DELETED) {
+                continue;
+            }
+            size_t i = e.hash & mask;
+            while (table[i].slot != EMPTY) {
+                i = (i + 1) & mask;
+            }
+            table[i] = e;
+        }
+    }
+
+    void grow() {
+        if ((used + 1) * 10 <= table.size() * 7) {
+            return;
+        }
+        size_t capacity = table.empty() ? 16 : table.size();
+        while ((count + 1) * 10 > capacity * 7 / 2) {
+            capacity *= 2;
+        }
+        rehash(capacity);
+    }
+
+public:
+    explicit HashIndex(const deque<Record>& recs) : records(recs), count(0), used(0) {}
+
+    size_t size() const {
+        return count;
+    }
+
+    void clear() {
+        table.clear();
+        count = 0;
+        used = 0;
+    }
+
+    size_t memoryUsage() const {
+        return table.capacity() * sizeof(Entry);
+    }
+
+    void reserve(size_t n) {
+        size_t capacity = 16;
+        while (n * 10 > capacity * 7) {
+            capacity *= 2;
+        }
+        if (capacity > table.size()) {
+            rehash(capacity);
+        }
+    }
+
+    // Returns the slot holding key, or -1 if absent
+    template<typename K>
+    long find(const K& key) const {
+        if (table.empty()) {
+            return -1;
+        }
+        uint32_t h = hashKey(key);
+        size_t mask = table.size() - 1;
+        for (size_t i = h & mask; table[i].slot != EMPTY; i = (i + 1) & mask) {
+            const Entry& e = table[i];
+            if (e.slot != DELETED && e.hash == h && records[e.slot].key() == key) {
+                return static_cast<long>(e.slot);
+            }
+        }
+        return -1;
+    }
+
+    // Indexes records[slot]; returns false if its key is already present
+    bool insert(uint32_t slot) {
+        const auto& key = records[slot].key();
+        if (find(key) >= 0) {
+            return false;
+        }
+        grow();
+        uint32_t h = hashKey(key);
+        size_t mask = table.size() - 1;
+        size_t i = h & mask;
+        while (table[i].slot != EMPTY && table[i].slot != DELETED) {
+            i = (i + 1) & mask;
+        }
+        if (table[i].slot == EMPTY) {
+            used++;
+        }
+        table[i] = Entry{ h, slot };
+        count++;
+        return true;
+    }
+
+    template<typename K>
+    bool erase(const K& key) {
+        if (table.empty()) {
+            return false;
+        }
+        uint32_t h = hashKey(key);
+        size_t mask = table.size() - 1;
+        for (size_t i = h & mask; table[i].slot != EMPTY; i = (i + 1) & mask) {
+            Entry& e = table[i];
+            if (e.slot != DELETED && e.hash == h && records[e.slot].key() == key) {
+                e.slot = DELETED;
+                count--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Re-indexes every record, e.g. after slots have shifted
+    void rebuild() {
+        clear();
+        reserve(records.size());
+        for (size_t i = 0; i < records.size(); i++) {
+            insert(static_cast<uint32_t>(i));
+        }
+    }
+};
+
+// Mapped File Class
+// Read-only memory mapping of a whole file
+class MappedFile {
+private:
+    const char* bytes;
+    size_t length;
+    bool opened;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+
+public:
+    explicit MappedFile(const string& filename) : bytes(nullptr), length(0), opened(false) {
+#ifdef _WIN32
+        mapping = nullptr;
+        file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return;
+        }
+        LARGE_INTEGER fileSize;
+        GetFileSizeEx(file, &fileSize);
+        length = static_cast<size_t>(fileSize.QuadPart);
+        opened = true;
+        if (length == 0) {
+            return;
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping != nullptr) {
+            bytes = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        }
+        opened = bytes != nullptr;
+#else
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0) {
+            length = static_cast<size_t>(info.st_size);
+            opened = true;
+            if (length > 0) {
+                void* address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (address == MAP_FAILED) {
+                    opened = false;
+                }
+                else {
+                    bytes = static_cast<const char*>(address);
+                    madvise(address, length, MADV_SEQUENTIAL);
+                }
+            }
+        }
+        ::close(fd);
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        if (bytes != nullptr) {
+            UnmapViewOfFile(bytes);
+        }
+        if (mapping != nullptr) {
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+#else
+        if (bytes != nullptr) {
+            munmap(const_cast<char*>(bytes), length);
+        }
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool isOpen() const {
+        return opened;
+    }
+
+    string_view view() const {
+        return bytes == nullptr ? string_view() : string_view(bytes, length);
+    }
+};
+
+// Text Lines
+// Newline-terminated lines built up in one buffer, so serializing a table does
+// not allocate a string per row
+struct TextLines {
+    string text;
+    size_t count = 0;
+
+    // Appends a record's line through its schema
+    template<typename Record, typename... Context>
+    void add(const Record& record, Context&... context) {
+        Record::Schema::appendText(text, record, context...);
+        text += '\n';
+        count++;
+    }
+
+    void addLine(string_view line) {
+        text += line;
+        text += '\n';
+        count++;
+    }
+};
+
+// FileHandler Class
+class FileHandler {
+public:
+    // Never truncates the target in place; see saveToFileAtomic
+    static void saveToFile(const string& filename, const TextLines& data) {
+        if (!saveToFileAtomic(filename, data)) {
+            cout << "Error: could not write " << filename << "\n";
+        }
+    }
+
+    static vector<string> loadFromFile(const string& filename) {
+        vector<string> data;
+        ifstream inFile(filename);
+        string line;
+        while (getline(inFile, line)) {
+            data.push_back(line);
+        }
+        inFile.close();
+        return data;
+    }
+
+    // Maps the file and calls fn(line, lineNumber) for every non-empty line.
+    // Lines are views into the mapping and are only valid during the call.
+    template<typename Fn>
+    static bool forEachLine(const string& filename, Fn fn) {
+        MappedFile file(filename);
+        if (!file.isOpen()) {
+            return false;
+        }
+        string_view data = file.view();
+        size_t lineNumber = 0;
+        size_t start = 0;
+        while (start < data.size()) {
+            size_t end = data.find('\n', start);
+            if (end == string_view::npos) {
+                end = data.size();
+            }
+            string_view line = data.substr(start, end - start);
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            lineNumber++;
+            if (!line.empty()) {
+                fn(line, lineNumber);
+            }
+            start = end + 1;
+        }
+        return true;
+    }
+
+    static void reportMalformed(const string& filename, size_t lineNumber) {
+        cout << "Skipping malformed line " << filename << ":" << lineNumber << "\n";
+    }
+
+    // Flushes stdio buffers and forces the file contents to disk
+    static void syncFile(FILE* file) {
+        fflush(file);
+#ifdef _WIN32
+        _commit(_fileno(file));
+#else
+        fsync(fileno(file));
+#endif
+    }
+
+    static bool replaceFile(const string& from, const string& to) {
+#ifdef _WIN32
+        return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+        return rename(from.c_str(), to.c_str()) == 0;
+#endif
+    }
+
+    // Writes to a temporary file, syncs it and renames it over the target, so a
+    // crash leaves either the old or the new contents
+    static bool saveToFileAtomic(const string& filename, const vector<string>& data) {
+        string tempName = filename + ".tmp";
+        FILE* file = fopen(tempName.c_str(), "wb");
+        if (file == nullptr) {
+            return false;
+        }
+        for (const string& line : data) {
+            fwrite(line.data(), 1, line.size(), file);
+            fputc('\n', file);
+        }
+        syncFile(file);
+        bool ok = ferror(file) == 0;
+        fclose(file);
+        return ok && replaceFile(tempName, filename);
+    }
+
+    static bool saveToFileAtomic(const string& filename, const TextLines& data) {
+        return saveBytesAtomic(filename, { { data.text.data(), data.text.size() } });
+    }
+
+    // Appends lines to the file (creating it if needed) and syncs it. A file
+    // whose last line lacks its newline gets one first.
+    static bool appendLines(const string& filename, const TextLines& data) {
+        FILE* file = fopen(filename.c_str(), "ab+");
+        if (file == nullptr) {
+            return false;
+        }
+        if (fseek(file, -1, SEEK_END) == 0 && fgetc(file) != '\n') {
+            fseek(file, 0, SEEK_END);
+            fputc('\n', file);
+        }
+        fseek(file, 0, SEEK_END);
+        fwrite(data.text.data(), 1, data.text.size(), file);
+        syncFile(file);
+        bool ok = ferror(file) == 0;
+        fclose(file);
+        return ok;
+    }
+
+    static bool saveBytesAtomic(const string& filename, const vector<pair<const char*, size_t>>& chunks) {
+        string tempName = filename + ".tmp";
+        FILE* file = fopen(tempName.c_str(), "wb");
+        if (file == nullptr) {
+            return false;
+        }
+        for (const auto& chunk : chunks) {
+            fwrite(chunk.first, 1, chunk.second, file);
+        }
+        syncFile(file);
+        bool ok = ferror(file) == 0;
+        fclose(file);
+        return ok && replaceFile(tempName, filename);
+    }
+
+    // Streams count lines produced by fn(index, line) into filename atomically,
+    // without holding the whole file in memory
+    template<typename Fn>
+    static bool saveLinesAtomic(const string& filename, size_t count, Fn fn) {
+        string tempName = filename + ".tmp";
+        FILE* file = fopen(tempName.c_str(), "wb");
+        if (file == nullptr) {
+            return false;
+        }
+        string buffer;
+        string line;
+        for (size_t i = 0; i < count; i++) {
+            line.clear();
+            fn(i, line);
+            buffer += line;
+            buffer += '\n';
+            if (buffer.size() >= (1 << 20)) {
+                fwrite(buffer.data(), 1, buffer.size(), file);
+                buffer.clear();
+            }
+        }
+        fwrite(buffer.data(), 1, buffer.size(), file);
+        syncFile(file);
+        bool ok = ferror(file) == 0;
+        fclose(file);
+        return ok && replaceFile(tempName, filename);
+    }
+
+    // Creates a directory unless it already exists; false if neither holds
+    static bool makeDirectory(const string& path) {
+#ifdef _WIN32
+        return CreateDirectoryA(path.c_str(), nullptr) != 0 || GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+        return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+#endif
+    }
+
+    static bool fileExists(const string& filename) {
+        FILE* file = fopen(filename.c_str(), "rb");
+        if (file == nullptr) {
+            return false;
+        }
+        fclose(file);
+        return true;
+    }
+};
+
+enum MetricOp {
+    OP_REGISTER_USER,
+    OP_LOGIN_USER,
+    OP_ADD_TRAIN,
+    OP_EDIT_TRAIN,
+    OP_REMOVE_TRAIN,
+    OP_VIEW_TRAINS,
+    OP_VIEW_TRAINS_RANGE,
+    OP_SEARCH_TRAINS,
+    OP_ADD_ROUTE,
+    OP_EDIT_ROUTE,
+    OP_REMOVE_ROUTE,
+    OP_VIEW_ROUTES,
+    OP_BOOK_TICKET,
+    OP_VIEW_BOOKINGS,
+    OP_CANCEL_BOOKING,
+    OP_PLAN_JOURNEY,
+    OP_QUOTE_FARES,
+    OP_FIND_USER,
+    OP_FIND_TRAIN,
+    OP_FIND_ROUTE,
+    OP_DASHBOARD,
+    OP_GENERATE_REPORTS,
+    OP_LOAD_STATIONS,
+    OP_LOAD_USERS,
+    OP_LOAD_TRAINS,
+    OP_LOAD_ROUTES,
+    OP_LOAD_BOOKINGS,
+    OP_LOAD_SNAPSHOT,
+    OP_SAVE_STATIONS,
+    OP_SAVE_USERS,
+    OP_SAVE_TRAINS,
+    OP_SAVE_ROUTES,
+    OP_SAVE_BOOKINGS,
+    OP_SAVE_SNAPSHOT,
+    OP_JOURNAL_SYNC,
+    OP_COMPACT_TABLES,
+    METRIC_OP_COUNT
+};
+
+// Metrics Class
+// Per-thread latency histograms for every operation. Each thread writes only its
+// own counters, so recording is two relaxed stores; readers merge all threads.
+// A thread allocates an operation's histogram the first time it records it, and
+// on exit adds its counts to the totals for exited threads and frees them.
+// Buckets are log-linear: 16 per power of two, about 6% relative error.
+class Metrics {
+public:
+    static const size_t SUB_BUCKETS = 16;
+    static const size_t BUCKETS = 64 * SUB_BUCKETS;
+
+    struct Summary {
+        uint64_t count;
+        uint64_t totalNs;
+        vector<uint64_t> buckets;
+
+        Summary() : count(0), totalNs(0), buckets(BUCKETS, 0) {}
+
+        // Lower bound of the bucket holding the q-th quantile, in nanoseconds
+        uint64_t percentile(double q) const {
+            if (count == 0) {
+                return 0;
+            }
+            uint64_t rank = static_cast<uint64_t>(ceil(q * count));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < BUCKETS; i++) {
+                seen += buckets[i];
+                if (seen >= max<uint64_t>(rank, 1)) {
+                    return bucketValue(i);
+                }
+            }
+            return bucketValue(BUCKETS - 1);
+        }
+    };
+
+private:
+    struct OpCounters {
+        atomic<uint64_t> counts[BUCKETS];
+        atomic<uint64_t> totalNs;
+
+        OpCounters() : totalNs(0) {
+            for (size_t i = 0; i < BUCKETS; i++) {
+                counts[i].store(0, memory_order_relaxed);
+            }
+        }
+    };
+
+    struct ThreadCounters {
+        atomic<OpCounters*> ops[METRIC_OP_COUNT]; // null until the operation is first recorded
+
+        ThreadCounters() {
+            for (size_t op = 0; op < METRIC_OP_COUNT; op++) {
+                ops[op].store(nullptr, memory_order_relaxed);
+            }
+        }
+
+        ~ThreadCounters() {
+            for (size_t op = 0; op < METRIC_OP_COUNT; op++) {
+                delete ops[op].load(memory_order_relaxed);
+            }
+        }
+
+        // Only the owning thread calls this, except for the registry's totals under its mutex
+        OpCounters& at(size_t op) {
+            OpCounters* counters = ops[op].load(memory_order_relaxed);
+            if (counters == nullptr) {
+                counters = new OpCounters();
+                ops[op].store(counters, memory_order_release);
+            }
+            return *counters;
+        }
+    };
+
+    struct Registry {
+        mutex m;
+        vector<ThreadCounters*> threads; // of running threads
+        ThreadCounters exited;           // counts of the threads that have exited
+        chrono::steady_clock::time_point started = chrono::steady_clock::now();
+        mutex rateMutex;
+        uint64_t rateCounts[METRIC_OP_COUNT] = {}; // calls counted when the current rate interval began
+        chrono::steady_clock::time_point rateSince = started;
+    };
+
+    // Registers a thread's counters and, when the thread exits, folds them into
+    // the registry's totals and frees them
+    struct ThreadSlot {
+        ThreadCounters* counters = nullptr;
+
+        ~ThreadSlot() {
+            if (counters == nullptr) {
+                return;
+            }
+            Registry& r = registry();
+            lock_guard<mutex> lock(r.m);
+            for (size_t op = 0; op < METRIC_OP_COUNT; op++) {
+                const OpCounters* from = counters->ops[op].load(memory_order_relaxed);
+                if (from == nullptr) {
+                    continue;
+                }
+                OpCounters& to = r.exited.at(op);
+                for (size_t i = 0; i < BUCKETS; i++) {
+                    to.counts[i].store(to.counts[i].load(memory_order_relaxed) + from->counts[i].load(memory_order_relaxed), memory_order_relaxed);
+                }
+                to.totalNs.store(to.totalNs.load(memory_order_relaxed) + from->totalNs.load(memory_order_relaxed), memory_order_relaxed);
+            }
+            r.threads.erase(find(r.threads.begin(), r.threads.end(), counters));
+            delete counters;
+        }
+    };
+
+    static Registry& registry() {
+        static Registry r;
+        return r;
+    }
+
+    static ThreadCounters& local() {
+        static thread_local ThreadSlot slot;
+        if (slot.counters == nullptr) {
+            Registry& r = registry();
+            lock_guard<mutex> lock(r.m);
+            slot.counters = new ThreadCounters();
+            r.threads.push_back(slot.counters);
+        }
+        return *slot.counters;
+    }
+
+    static size_t bucketFor(uint64_t ns) {
+        if (ns < SUB_BUCKETS) {
+            return static_cast<size_t>(ns);
+        }
+        size_t msb = 63;
+        while ((ns >> msb) == 0) {
+            msb--;
+        }
+        size_t shift = msb - 4;
+        return (shift + 1) * SUB_BUCKETS + static_cast<size_t>((ns >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    static uint64_t bucketValue(size_t bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return bucket;
+        }
+        size_t shift = bucket / SUB_BUCKETS - 1;
+        return (SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    }
+
+public:
+    static const char* name(MetricOp op) {
+        static const char* const names[METRIC_OP_COUNT] = { "registerUser", "loginUser", "addTrain", "editTrain", "removeTrain",
+            "viewTrains", "viewTrainsInRange", "searchTrains", "addRoute", "editRoute", "removeRoute", "viewRoutes", "bookTicket", "viewBookings", "cancelBooking", "planJourney",
+            "quoteFares", "findUser", "findTrain", "findRoute", "dashboardOverview", "generateReports", "loadStations", "loadUsers", "loadTrains",
+            "loadRoutes", "loadBookings", "loadSnapshot", "saveStations", "saveUsers", "saveTrains", "saveRoutes", "saveBookings",
+            "saveSnapshot", "journalSync", "compactTables" };
+        return names[op];
+    }
+
+    // weight > 1 records one sample standing for that many calls
+    static void record(MetricOp op, uint64_t ns, uint64_t weight = 1) {
+        OpCounters& counters = local().at(op);
+        atomic<uint64_t>& bucket = counters.counts[bucketFor(ns)];
+        bucket.store(bucket.load(memory_order_relaxed) + weight, memory_order_relaxed);
+        counters.totalNs.store(counters.totalNs.load(memory_order_relaxed) + ns * weight, memory_order_relaxed);
+    }
+
+    static Summary summary(MetricOp op) {
+        Summary result;
+        Registry& r = registry();
+        lock_guard<mutex> lock(r.m);
+        auto add = [&](const ThreadCounters& counters) {
+            const OpCounters* opCounters = counters.ops[op].load(memory_order_acquire);
+            if (opCounters == nullptr) {
+                return;
+            }
+            for (size_t i = 0; i < BUCKETS; i++) {
+                uint64_t n = opCounters->counts[i].load(memory_order_relaxed);
+                result.buckets[i] += n;
+                result.count += n;
+            }
+            result.totalNs += opCounters->totalNs.load(memory_order_relaxed);
+        };
+        for (const ThreadCounters* counters : r.threads) {
+            add(*counters);
+        }
+        add(r.exited);
+        return result;
+    }
+
+    static double uptimeSeconds() {
+        return chrono::duration<double>(chrono::steady_clock::now() - registry().started).count();
+    }
+
+    // Calls per second of each operation since the previous call (or since
+    // start), which then begins a new interval
+    static vector<double> intervalRates() {
+        Registry& r = registry();
+        lock_guard<mutex> lock(r.rateMutex);
+        auto now = chrono::steady_clock::now();
+        double seconds = max(chrono::duration<double>(now - r.rateSince).count(), 1e-9);
+        vector<double> rates(METRIC_OP_COUNT);
+        for (size_t op = 0; op < METRIC_OP_COUNT; op++) {
+            uint64_t count = summary(static_cast<MetricOp>(op)).count;
+            rates[op] = (count - r.rateCounts[op]) / seconds;
+            r.rateCounts[op] = count;
+        }
+        r.rateSince = now;
+        return rates;
+    }
+
+    // Formats a nanosecond latency for people, e.g. 850ns, 2.1us, 3.4ms
+    static string formatLatency(uint64_t ns) {
+        char text[32];
+        if (ns < 1000) {
+            snprintf(text, sizeof(text), "%lluns", static_cast<unsigned long long>(ns));
+        }
+        else if (ns < 1000000) {
+            snprintf(text, sizeof(text), "%.1fus", ns / 1e3);
+        }
+        else if (ns < 1000000000) {
+            snprintf(text, sizeof(text), "%.1fms", ns / 1e6);
+        }
+        else {
+            snprintf(text, sizeof(text), "%.2fs", ns / 1e9);
+        }
+        return text;
+    }
+
+    // Latency summaries in the Prometheus text exposition format
+    static string prometheusText() {
+        string text = "# HELP rms_operation_latency_seconds Operation latency.\n# TYPE rms_operation_latency_seconds summary\n";
+        char line[256];
+        for (size_t op = 0; op < METRIC_OP_COUNT; op++) {
+            Summary s = summary(static_cast<MetricOp>(op));
+            const char* opName = name(static_cast<MetricOp>(op));
+            for (double q : { 0.5, 0.99, 0.999 }) {
+                snprintf(line, sizeof(line), "rms_operation_latency_seconds{op=\"%s\",quantile=\"%g\"} %.9f\n", opName, q, s.percentile(q) / 1e9);
+                text += line;
+            }
+            snprintf(line, sizeof(line), "rms_operation_latency_seconds_sum{op=\"%s\"} %.9f\nrms_operation_latency_seconds_count{op=\"%s\"} %llu\n",
+                opName, s.totalNs / 1e9, opName, static_cast<unsigned long long>(s.count));
+            text += line;
+        }
+        snprintf(line, sizeof(line), "# TYPE rms_uptime_seconds gauge\nrms_uptime_seconds %.3f\n", uptimeSeconds());
+        text += line;
+        return text;
+    }
+};
+
+// Operation Timer
+// Records the time from construction to destruction under one operation.
+// Lookups that take less time than reading the clock pass a sample rate, so
+// only one call in that many is timed and it is recorded with that weight.
+class OperationTimer {
+private:
+    MetricOp op;
+    uint32_t weight;
+    chrono::steady_clock::time_point started;
+
+    static uint32_t& tick() {
+        static thread_local uint32_t calls = 0;
+        return calls;
+    }
+
+public:
+    explicit OperationTimer(MetricOp op, uint32_t sampleRate = 1)
+        : op(op), weight(sampleRate == 1 || ++tick() % sampleRate == 0 ? sampleRate : 0) {
+        if (weight != 0) {
+            started = chrono::steady_clock::now();
+        }
+    }
+
+    ~OperationTimer() {
+        if (weight != 0) {
+            Metrics::record(op, static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count()), weight);
+        }
+    }
+};
+
+// Stream Format Guard
+// Restores a stream's format flags and precision when it goes out of scope
+class StreamFormatGuard {
+private:
+    ostream& stream;
+    ios_base::fmtflags flags;
+    streamsize precision;
+
+public:
+    explicit StreamFormatGuard(ostream& stream) : stream(stream), flags(stream.flags()), precision(stream.precision()) {}
+
+    ~StreamFormatGuard() {
+        stream.flags(flags);
+        stream.precision(precision);
+    }
+};
+
+// Storage Options
+struct StorageOptions {
+    size_t syncEveryRecords;    // group-commit size; 1 syncs every record before returning
+    int syncIntervalMs;         // longest a record waits for its fsync
+    int checkpointIntervalSec;  // background checkpoint period
+    size_t checkpointBytes;     // checkpoint early once the journal grows past this
+    bool importText;            // load the .txt files even if a snapshot exists
+    bool mirrorText;            // keep the .txt files current: updated after every checkpoint and on shutdown
+    bool persistent;            // false keeps everything in memory (no files are read or written)
+    string metricsFile;         // if set, rewritten with the metrics in Prometheus text format
+    int metricsIntervalSec;
+    size_t snapshotShards;      // files the snapshot's users, trains and bookings are split across; 1 keeps one file
+    int archiveAfterDays;       // at startup, bookings older than this move to bookings.archive; 0 never
+    bool verbose;               // report recovery and snapshot progress on stderr
+
+    StorageOptions()
+        : syncEveryRecords(64), syncIntervalMs(20), checkpointIntervalSec(300), checkpointBytes(64u << 20),
+          importText(false), mirrorText(false), persistent(true), metricsIntervalSec(10),
+          snapshotShards(min<size_t>(max(1u, thread::hardware_concurrency()), 16)), archiveAfterDays(0),
+          verbose(false) {}
+};
+
+// Text Files State
+// How far the .txt files lag behind memory. Stations, users and bookings are
+// only ever appended to, so their files are extended by the rows past the
+// count they already hold until a cancellation marks bookings stale; trains,
+// routes and the waitlist are rewritten when they change.
+struct TextFilesState {
+    enum Table { STATIONS, USERS, TRAINS, ROUTES, BOOKINGS, WAITLIST, TABLES };
+
+    size_t rows[TABLES];  // rows already in the file, for the append-only tables
+    bool stale[TABLES];   // the file must be rewritten in full
+    size_t cancellations; // entries of the ledger's cancel log already in bookings.txt
+
+    TextFilesState() : cancellations(0) {
+        for (int i = 0; i < TABLES; i++) {
+            rows[i] = 0;
+            stale[i] = true;
+        }
+    }
+};
+
+// Journal Meta
+// Checkpoint state: the first live journal segment and, for every base file,
+// the LSN of the last journal record it already contains.
+struct JournalMeta {
+    uint64_t segment;
+    unordered_map<string, uint64_t> tableLsn;
+
+    JournalMeta() : segment(1) {}
+
+    static const char* fileName() {
+        return "journal.meta";
+    }
+
+    uint64_t lsnFor(const string& table) const {
+        auto it = tableLsn.find(table);
+        return it == tableLsn.end() ? 0 : it->second;
+    }
+
+    uint64_t maxLsn() const {
+        uint64_t lsn = 0;
+        for (const auto& entry : tableLsn) {
+            lsn = max(lsn, entry.second);
+        }
+        return lsn;
+    }
+
+    void load() {
+        for (const string& line : FileHandler::loadFromFile(fileName())) {
+            stringstream ss(line);
+            string key;
+            uint64_t value;
+            if (!(ss >> key >> value)) {
+                continue;
+            }
+            if (key == "segment") {
+                segment = value;
+            }
+            else {
+                tableLsn[key] = value;
+            }
+        }
+    }
+
+    bool save() const {
+        vector<string> data;
+        data.push_back("segment " + to_string(segment));
+        for (const auto& entry : tableLsn) {
+            data.push_back(entry.first + " " + to_string(entry.second));
+        }
+        return FileHandler::saveToFileAtomic(fileName(), data);
+    }
+};
+
+// Write-Ahead Log Class
+// Appends one "<lsn> <op> <payload>" line per mutation to journal.<segment>.log.
+// Records are fsynced in groups: when syncEveryRecords are pending or after
+// syncIntervalMs, whichever comes first.
+class WriteAheadLog {
+private:
+    StorageOptions options;
+    FILE* file;
+    uint64_t segment;
+    uint64_t lastLsn;
+    size_t pending;
+    size_t bytes;
+    bool stopping;
+    mutex m;
+    condition_variable wake;
+    thread flusher;
+
+    void syncLocked() {
+        if (file != nullptr && pending > 0) {
+            OperationTimer timer(OP_JOURNAL_SYNC);
+            FileHandler::syncFile(file);
+            pending = 0;
+        }
+    }
+
+    void flushLoop() {
+        unique_lock<mutex> lock(m);
+        while (!stopping) {
+            wake.wait_for(lock, chrono::milliseconds(options.syncIntervalMs));
+            syncLocked();
+        }
+    }
+
+public:
+    explicit WriteAheadLog(const StorageOptions& opts)
+        : options(opts), file(nullptr), segment(0), lastLsn(0), pending(0), bytes(0), stopping(false) {}
+
+    ~WriteAheadLog() {
+        close();
+    }
+
+    static string segmentName(uint64_t segment) {
+        return "journal." + to_string(segment) + ".log";
+    }
+
+    // Starts appending to a fresh segment; records continue after lsn
+    void open(uint64_t newSegment, uint64_t lsn) {
+        lock_guard<mutex> lock(m);
+        segment = newSegment;
+        lastLsn = lsn;
+        file = fopen(segmentName(segment).c_str(), "wb");
+        bytes = 0;
+        if (file == nullptr) {
+            cout << "Warning: cannot open " << segmentName(segment) << ", changes will not be journaled!\n";
+        }
+        if (!flusher.joinable() && options.syncEveryRecords != 1) {
+            flusher = thread(&WriteAheadLog::flushLoop, this);
+        }
+    }
+
+    void close() {
+        {
+            lock_guard<mutex> lock(m);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (flusher.joinable()) {
+            flusher.join();
+        }
+        lock_guard<mutex> lock(m);
+        syncLocked();
+        if (file != nullptr) {
+            fclose(file);
+            file = nullptr;
+        }
+    }
+
+    uint64_t append(const char* op, const string& payload) {
+        lock_guard<mutex> lock(m);
+        uint64_t lsn = ++lastLsn;
+        if (file == nullptr) {
+            return lsn;
+        }
+        string record = to_string(lsn) + " " + op + " " + payload + "\n";
+        fwrite(record.data(), 1, record.size(), file);
+        bytes += record.size();
+        if (++pending >= options.syncEveryRecords) {
+            syncLocked();
+        }
+        return lsn;
+    }
+
+    // Closes the current segment and continues in the next one.
+    // Returns the LSN of the last record in the closed segment.
+    uint64_t rotate() {
+        lock_guard<mutex> lock(m);
+        syncLocked();
+        if (file != nullptr) {
+            fclose(file);
+        }
+        segment++;
+        file = fopen(segmentName(segment).c_str(), "wb");
+        bytes = 0;
+        return lastLsn;
+    }
+
+    uint64_t currentSegment() {
+        lock_guard<mutex> lock(m);
+        return segment;
+    }
+
+    uint64_t lastLsnWritten() {
+        lock_guard<mutex> lock(m);
+        return lastLsn;
+    }
+
+    size_t size() {
+        lock_guard<mutex> lock(m);
+        return bytes;
+    }
+};
+
+// CRC-32 (IEEE), used to checksum snapshot sections
+inline uint32_t crc32(const char* data, size_t size) {
+    static const vector<uint32_t> table = [] {
+        vector<uint32_t> t(256);
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Snapshot Format
+// railway.snap holds a SnapshotHeader, a SnapshotSection table, then the section
+// payloads at 8-byte aligned offsets. Every string is stored once in the string
+// pool section and records refer to it by offset and length, so all record
+// sections are fixed-width arrays that can be used straight from the mapping.
+// Integers are stored in host (little-endian) byte order.
+enum SnapshotSectionType : uint32_t {
+    SECTION_STRINGS = 1,
+    SECTION_USERS = 2,
+    SECTION_TRAINS = 3,
+    SECTION_ROUTES = 4,
+    SECTION_BOOKINGS = 5,
+    SECTION_STATIONS = 6,
+    SECTION_TRAIN_STOPS = 7,
+    SECTION_WAITLIST = 8,
+    SECTION_SHARDS = 9,
+    SECTION_USER_ROWS = 10,    // in a shard file, the position of each user row in the table
+    SECTION_TRAIN_ROWS = 11,
+    SECTION_BOOKING_ROWS = 12
+};
+
+// Version 2 stores stations once in a dictionary section and refers to them by ID.
+// Version 3 stores train capacity and stops, and the leg of every booking.
+// Version 4 adds the waitlists.
+// Version 5 lays out user, train and route rows from the records' schemas.
+// Version 6 may move users, trains and bookings out into shard files.
+// Version 7 adds train schedules and the run date of bookings and waitlist entries.
+const uint32_t SNAPSHOT_VERSION = 7;
+const size_t MAX_SNAPSHOT_SHARDS = 64;
+
+struct SnapshotHeader {
+    char magic[8];          // "RMSSNAP"
+    uint32_t version;
+    uint32_t sectionCount;
+    uint64_t lsn;           // last journal record contained in the snapshot
+    uint64_t nextBookingId;
+};
+
+struct SnapshotSection {
+    uint32_t type;
+    uint32_t recordSize;
+    uint64_t offset;
+    uint64_t count;
+    uint64_t bytes;
+    uint32_t checksum;
+    uint32_t reserved;
+};
+
+// The single row of a sharded snapshot's shards section. Users, with their
+// bookings, are split by username hash and trains by ID across the files
+// <snapshot>.<generation>.<shard>; stations, routes and waitlists stay in the
+// main file, which is written last.
+struct ShardsRow {
+    uint64_t generation;
+    uint32_t shardCount;
+    uint32_t reserved;
+    uint64_t users;       // rows across all shards
+    uint64_t trains;
+    uint64_t bookings;
+};
+
+// User rows have kept the same layout since version 1
+typedef PackedRow<User::Schema::binarySize()> UserRow;
+typedef PackedRow<Train::Schema::binarySize()> TrainRow;
+typedef PackedRow<Route::Schema::binarySize()> RouteRow;
+
+// Version 5 and 6 train rows
+typedef PackedRow<Train::SchemaV6::binarySize()> TrainRowV6;
+
+// Booking and waitlist rows before version 7, which had no run date
+struct BookingRecordV6 {
+    uint64_t id;
+    uint32_t userId;
+    int32_t trainId;
+    int32_t seat;
+    uint16_t fromStop;
+    uint16_t toStop;
+    int64_t timestamp;
+
+    BookingRecord widen() const {
+        return BookingRecord{ id, userId, trainId, seat, fromStop, toStop, timestamp, 0, 0 };
+    }
+};
+
+struct WaitlistEntryV6 {
+    uint64_t ticket;
+    uint32_t userId;
+    int32_t trainId;
+    uint16_t fromStop;
+    uint16_t toStop;
+    uint32_t priority;
+    int64_t timestamp;
+
+    WaitlistEntry widen() const {
+        return WaitlistEntry{ ticket, userId, trainId, fromStop, toStop, priority, timestamp, 0, 0 };
+    }
+};
+
+// Version 3 and 4 rows
+struct TrainRowV4 {
+    int32_t id;
+    int32_t capacity;
+    StringRef name;
+    uint32_t source;      // index into the stations section
+    uint32_t destination;
+    uint32_t firstStop;   // the train's stops are train-stops entries [firstStop, firstStop + stopCount)
+    uint32_t stopCount;
+};
+
+struct RouteRowV4 {
+    int32_t id;
+    uint32_t source;
+    uint32_t destination;
+    int32_t reserved;
+};
+
+// Version 2 rows, which held the seats left instead of capacity and stops
+struct TrainRowV2 {
+    int32_t id;
+    int32_t seats;
+    StringRef name;
+    uint32_t source;
+    uint32_t destination;
+};
+
+// Version 1 rows, which spelled out station names
+struct TrainRowV1 {
+    int32_t id;
+    int32_t seats;
+    StringRef name;
+    StringRef source;
+    StringRef destination;
+};
+
+struct RouteRowV1 {
+    int32_t id;
+    int32_t reserved;
+    StringRef source;
+    StringRef destination;
+};
+
+static_assert(sizeof(SnapshotHeader) == 32 && sizeof(SnapshotSection) == 40 && sizeof(ShardsRow) == 40, "snapshot header layout changed");
+static_assert(sizeof(UserRow) == 24 && sizeof(TrainRow) == 44 && sizeof(RouteRow) == 12 && sizeof(WaitlistEntry) == 40 && sizeof(BookingRecord) == 40
+    && sizeof(TrainRowV6) == 32 && sizeof(BookingRecordV6) == 32 && sizeof(WaitlistEntryV6) == 32 && sizeof(TrainRowV4) == 32 && sizeof(RouteRowV4) == 16,
+    "snapshot record layout changed; bump SNAPSHOT_VERSION");
+
+// Runs fn(i) for i in [0, n), each on its own thread; a single task runs inline
+template<typename Fn>
+void runOnThreads(size_t n, Fn fn) {
+    if (n == 1) {
+        fn(0);
+        return;
+    }
+    vector<thread> pool;
+    for (size_t i = 0; i < n; i++) {
+        pool.emplace_back(fn, i);
+    }
+    for (thread& t : pool) {
+        t.join();
+    }
+}
+
+// Snapshot Writer Class
+class SnapshotWriter {
+private:
+    struct PendingSection {
+        uint32_t type;
+        uint32_t recordSize;
+        uint64_t count;
+        vector<char> bytes;
+    };
+
+    vector<char> pool;
+    unordered_map<string_view, StringRef> interned; // views into the caller's strings
+    vector<PendingSection> sections;
+
+public:
+    // The caller's strings must stay alive and unchanged until the sections are added
+    StringRef intern(const string& text) {
+        auto it = interned.find(text);
+        if (it != interned.end()) {
+            return it->second;
+        }
+        StringRef ref{ static_cast<uint32_t>(pool.size()), static_cast<uint32_t>(text.size()) };
+        pool.insert(pool.end(), text.begin(), text.end());
+        interned.emplace(string_view(text), ref);
+        return ref;
+    }
+
+    template<typename Row>
+    void addSection(uint32_t type, const Row* rows, size_t count) {
+        static_assert(has_unique_object_representations_v<Row>, "rows are written byte for byte, so they must have no padding");
+        PendingSection section{ type, static_cast<uint32_t>(sizeof(Row)), count, vector<char>() };
+        const char* first = reinterpret_cast<const char*>(rows);
+        section.bytes.assign(first, first + count * sizeof(Row));
+        sections.push_back(move(section));
+    }
+
+    // Extends the most recently added section
+    template<typename Row>
+    void appendRows(const Row* rows, size_t count) {
+        static_assert(has_unique_object_representations_v<Row>, "rows are written byte for byte, so they must have no padding");
+        PendingSection& section = sections.back();
+        const char* first = reinterpret_cast<const char*>(rows);
+        section.bytes.insert(section.bytes.end(), first, first + count * sizeof(Row));
+        section.count += count;
+    }
+
+    // Releases the intern table once the caller's strings may change again
+    void sealStrings() {
+        unordered_map<string_view, StringRef>().swap(interned);
+    }
+
+    bool writeTo(const string& filename, uint64_t lsn, uint64_t nextBookingId) {
+        sections.insert(sections.begin(), PendingSection{ SECTION_STRINGS, 1, pool.size(), move(pool) });
+        SnapshotHeader header = {};
+        memcpy(header.magic, "RMSSNAP", 8);
+        header.version = SNAPSHOT_VERSION;
+        header.sectionCount = static_cast<uint32_t>(sections.size());
+        header.lsn = lsn;
+        header.nextBookingId = nextBookingId;
+
+        static const char padding[8] = {};
+        vector<SnapshotSection> table(sections.size());
+        vector<pair<const char*, size_t>> chunks;
+        chunks.emplace_back(reinterpret_cast<const char*>(&header), sizeof(header));
+        chunks.emplace_back(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(SnapshotSection));
+        uint64_t offset = sizeof(header) + table.size() * sizeof(SnapshotSection);
+        for (size_t i = 0; i < sections.size(); i++) {
+            const PendingSection& section = sections[i];
+            table[i] = SnapshotSection{ section.type, section.recordSize, offset, section.count, section.bytes.size(),
+                crc32(section.bytes.data(), section.bytes.size()), 0 };
+            chunks.emplace_back(section.bytes.data(), section.bytes.size());
+            offset += section.bytes.size();
+            size_t pad = (8 - offset % 8) % 8;
+            chunks.emplace_back(padding, pad);
+            offset += pad;
+        }
+        return FileHandler::saveBytesAtomic(filename, chunks);
+    }
+};
+
+// Snapshot Reader Class
+// Maps a snapshot and validates its header and section checksums up front
+class SnapshotReader {
+private:
+    MappedFile file;
+    string_view data;
+    const SnapshotHeader* header;
+    const SnapshotSection* sections;
+    string_view pool;
+    string error;
+
+public:
+    explicit SnapshotReader(const string& filename) : file(filename), header(nullptr), sections(nullptr) {
+        data = file.view();
+        if (data.size() < sizeof(SnapshotHeader)) {
+            error = "file too short";
+            return;
+        }
+        header = reinterpret_cast<const SnapshotHeader*>(data.data());
+        if (memcmp(header->magic, "RMSSNAP", 8) != 0) {
+            error = "bad magic";
+            return;
+        }
+        if (header->version == 0 || header->version > SNAPSHOT_VERSION) {
+            error = "unsupported version " + to_string(header->version);
+            return;
+        }
+        if (header->sectionCount > (data.size() - sizeof(SnapshotHeader)) / sizeof(SnapshotSection)) {
+            error = "truncated section table";
+            return;
+        }
+        sections = reinterpret_cast<const SnapshotSection*>(data.data() + sizeof(SnapshotHeader));
+        for (uint32_t i = 0; i < header->sectionCount; i++) {
+            const SnapshotSection& section = sections[i];
+            if (section.offset % 8 != 0 || section.offset > data.size() || section.bytes > data.size() - section.offset
+                || section.count * section.recordSize != section.bytes) {
+                error = "section " + to_string(i) + " out of bounds";
+                return;
+            }
+            if (crc32(data.data() + section.offset, section.bytes) != section.checksum) {
+                error = "checksum mismatch in section " + to_string(i);
+                return;
+            }
+            if (section.type == SECTION_STRINGS) {
+                pool = data.substr(section.offset, section.bytes);
+            }
+        }
+    }
+
+    bool valid() const {
+        return error.empty();
+    }
+
+    const string& errorMessage() const {
+        return error;
+    }
+
+    uint32_t version() const {
+        return header->version;
+    }
+
+    uint64_t lsn() const {
+        return header->lsn;
+    }
+
+    uint64_t nextBookingId() const {
+        return header->nextBookingId;
+    }
+
+    template<typename Row>
+    bool rows(uint32_t type, const Row*& first, size_t& count) const {
+        for (uint32_t i = 0; i < header->sectionCount; i++) {
+            if (sections[i].type == type && sections[i].recordSize == sizeof(Row)) {
+                first = reinterpret_cast<const Row*>(data.data() + sections[i].offset);
+                count = static_cast<size_t>(sections[i].count);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool text(StringRef ref, string_view& out) const {
+        if (ref.offset > pool.size() || ref.length > pool.size() - ref.offset) {
+            return false;
+        }
+        out = pool.substr(ref.offset, ref.length);
+        return true;
+    }
+};
+
+// Context for schema-encoded snapshot rows: interns their strings and gathers
+// the trains' stops into the train-stops section
+struct SnapshotEncoder {
+    SnapshotWriter& writer;
+    vector<uint32_t>& stopRows;
+
+    StringRef intern(const string& text) {
+        return writer.intern(text);
+    }
+
+    // Returns where the stops start in the section
+    uint32_t addStops(const vector<StationId>& stops) {
+        uint32_t first = static_cast<uint32_t>(stopRows.size());
+        stopRows.insert(stopRows.end(), stops.begin(), stops.end());
+        return first;
+    }
+};
+
+// Context for decoding snapshot rows, which checks every reference
+struct SnapshotDecoder {
+    const SnapshotReader& snapshot;
+    vector<StationId> stationIds; // snapshot station number -> dictionary ID
+    const uint32_t* stopRows;
+    size_t stopCount;
+
+    explicit SnapshotDecoder(const SnapshotReader& snapshot) : snapshot(snapshot), stopRows(nullptr), stopCount(0) {}
+
+    bool text(StringRef ref, string_view& out) const {
+        return snapshot.text(ref, out);
+    }
+
+    bool station(uint32_t index, StationId& id) const {
+        if (index >= stationIds.size()) {
+            return false;
+        }
+        id = stationIds[index];
+        return true;
+    }
+
+    bool stops(uint32_t first, uint32_t count, vector<StationId>& out) const {
+        if (first > stopCount || count > stopCount - first) {
+            return false;
+        }
+        out.resize(count);
+        for (uint32_t k = 0; k < count; k++) {
+            if (!station(stopRows[first + k], out[k])) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Booking Archive
+// bookings.archive holds the bookings aged out of the ledger. After the block
+// directory it lists the archived IDs as sorted ranges, so a booking archived
+// before a crash is recognised when the ledger still holds it; version 1 files
+// had no list and archived every ID below a floor instead. Each archiving run
+// sorts its bookings by user and cuts them into blocks of up to BLOCK_RECORDS,
+// each in ID order.
+// A block stores its fields column by column as varints: users, IDs, trains and
+// timestamps as deltas from the previous record, stations by dictionary ID. The directory after the header
+// keeps each block's key ranges, so a query decodes only blocks that can match.
+// Blocks written since bookings had a run date carry it as an eighth column.
+struct ArchiveHeader {
+    char magic[8];        // "RMSARCH"
+    uint32_t version;
+    uint32_t blockCount;
+    uint64_t ranges;      // archived ID ranges after the directory; in version 1, every ID below this is archived
+    uint64_t bookings;
+};
+
+// The archived IDs from first up to but not including end
+struct ArchiveRange {
+    uint64_t first;
+    uint64_t end;
+};
+
+struct ArchiveBlock {
+    uint64_t offset;
+    uint32_t bytes;
+    uint32_t count;
+    uint32_t checksum;
+    uint32_t minUser;
+    uint32_t maxUser;
+    int32_t minTrain;
+    int32_t maxTrain;
+    uint32_t columns;     // 0 in blocks from before the run-date column, which have 7
+    uint64_t minId;
+    uint64_t maxId;
+    int64_t minTime;
+    int64_t maxTime;
+};
+
+static_assert(sizeof(ArchiveHeader) == 32 && sizeof(ArchiveBlock) == 72 && sizeof(ArchiveRange) == 16, "archive layout changed; bump BookingArchive::VERSION");
+
+// A booking as the archive keeps it: its leg by station, since the train may change later
+struct ArchivedBooking {
+    uint64_t id;
+    uint32_t userId;
+    int32_t trainId;
+    int32_t seat;       // 0 if it was cancelled
+    StationId from;
+    StationId to;
+    int64_t timestamp;
+    int32_t travelDay;
+};
+
+inline void appendVarint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+inline bool readVarint(const char*& p, const char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(*p++);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Maps a wrapped difference to a small unsigned number: 0, -1, 1, -2, ... become 0, 1, 2, 3, ...
+inline uint64_t zigzag(uint64_t delta) {
+    return (delta << 1) ^ (0 - (delta >> 63));
+}
+
+inline uint64_t unzigzag(uint64_t value) {
+    return (value >> 1) ^ (0 - (value & 1));
+}
+
+// Booking Archive Class
+class BookingArchive {
+private:
+    string fileName;
+    unique_ptr<MappedFile> file;
+    string_view data;
+    const ArchiveHeader* header; // null while the archive is empty
+    const ArchiveBlock* blocks;
+    vector<ArchiveRange> ranges;
+    size_t payloadStart;
+    string error;
+
+    static void encodeBlock(const ArchivedBooking* rows, size_t n, string& payload, ArchiveBlock& block) {
+        block = ArchiveBlock{ 0, 0, static_cast<uint32_t>(n), 0, rows[0].userId, rows[0].userId, rows[0].trainId, rows[0].trainId, COLUMNS,
+            rows[0].id, rows[0].id, rows[0].timestamp, rows[0].timestamp };
+        for (size_t i = 1; i < n; i++) {
+            block.minUser = min(block.minUser, rows[i].userId);
+            block.maxUser = max(block.maxUser, rows[i].userId);
+            block.minTrain = min(block.minTrain, rows[i].trainId);
+            block.maxTrain = max(block.maxTrain, rows[i].trainId);
+            block.minId = min(block.minId, rows[i].id);
+            block.maxId = max(block.maxId, rows[i].id);
+            block.minTime = min(block.minTime, rows[i].timestamp);
+            block.maxTime = max(block.maxTime, rows[i].timestamp);
+        }
+        size_t start = payload.size();
+        uint64_t user = block.minUser, id = block.minId, train = static_cast<uint64_t>(block.minTrain), time = static_cast<uint64_t>(block.minTime);
+        for (size_t i = 0; i < n; i++) {
+            appendVarint(payload, zigzag(rows[i].userId - user));
+            user = rows[i].userId;
+        }
+        for (size_t i = 0; i < n; i++) {
+            appendVarint(payload, zigzag(rows[i].id - id));
+            id = rows[i].id;
+        }
+        for (size_t i = 0; i < n; i++) {
+            appendVarint(payload, zigzag(static_cast<uint64_t>(rows[i].trainId) - train));
+            train = static_cast<uint64_t>(rows[i].trainId);
+        }
+        for (size_t i = 0; i < n; i++) {
+            appendVarint(payload, static_cast<uint32_t>(rows[i].seat));
+        }
+        for (size_t i = 0; i < n; i++) {
+            appendVarint(payload, rows[i].from);
+        }
+        for (size_t i = 0; i < n; i++) {
+            appendVarint(payload, rows[i].to);
+        }
+        for (size_t i = 0; i < n; i++) {
+            appendVarint(payload, zigzag(static_cast<uint64_t>(rows[i].timestamp) - time));
+            time = static_cast<uint64_t>(rows[i].timestamp);
+        }
+        for (size_t i = 0; i < n; i++) {
+            appendVarint(payload, static_cast<uint32_t>(rows[i].travelDay));
+        }
+        block.bytes = static_cast<uint32_t>(payload.size() - start);
+        block.checksum = crc32(payload.data() + start, block.bytes);
+    }
+
+    // Reads one column, handing each value to set(row, value)
+    template<typename Set>
+    static bool readColumn(const char*& p, const char* end, vector<ArchivedBooking>& rows, Set set) {
+        uint64_t value;
+        for (ArchivedBooking& row : rows) {
+            if (!readVarint(p, end, value)) {
+                return false;
+            }
+            set(row, value);
+        }
+        return true;
+    }
+
+    bool decodeBlock(const ArchiveBlock& block, vector<ArchivedBooking>& rows) const {
+        rows.resize(block.count);
+        const char* p = data.data() + block.offset;
+        const char* end = p + block.bytes;
+        uint64_t user = block.minUser, id = block.minId, train = static_cast<uint64_t>(block.minTrain), time = static_cast<uint64_t>(block.minTime);
+        bool ok = readColumn(p, end, rows, [&](ArchivedBooking& row, uint64_t value) { row.userId = static_cast<uint32_t>(user += unzigzag(value)); })
+            && readColumn(p, end, rows, [&](ArchivedBooking& row, uint64_t value) { row.id = id += unzigzag(value); })
+            && readColumn(p, end, rows, [&](ArchivedBooking& row, uint64_t value) { row.trainId = static_cast<int32_t>(train += unzigzag(value)); })
+            && readColumn(p, end, rows, [](ArchivedBooking& row, uint64_t value) { row.seat = static_cast<int32_t>(value); })
+            && readColumn(p, end, rows, [](ArchivedBooking& row, uint64_t value) { row.from = static_cast<StationId>(value); })
+            && readColumn(p, end, rows, [](ArchivedBooking& row, uint64_t value) { row.to = static_cast<StationId>(value); })
+            && readColumn(p, end, rows, [&](ArchivedBooking& row, uint64_t value) { row.timestamp = static_cast<int64_t>(time += unzigzag(value)); });
+        if (block.columns < COLUMNS) {
+            for (ArchivedBooking& row : rows) {
+                row.travelDay = 0;
+            }
+        }
+        else {
+            ok = ok && readColumn(p, end, rows, [](ArchivedBooking& row, uint64_t value) { row.travelDay = static_cast<int32_t>(value); });
+        }
+        return ok && p == end;
+    }
+
+    bool fail(const string& message) {
+        error = message;
+        header = nullptr;
+        blocks = nullptr;
+        ranges.clear();
+        return false;
+    }
+
+public:
+    static constexpr uint32_t VERSION = 2;
+    static constexpr size_t BLOCK_RECORDS = 512;
+    static constexpr StationId NO_STATION = UINT32_MAX; // the train was gone when the booking was archived
+    static constexpr uint32_t COLUMNS = 8;
+
+    BookingArchive() : header(nullptr), blocks(nullptr), payloadStart(0) {}
+
+    // Maps the archive and checks every block; a missing file is an empty archive
+    bool open(const string& name) {
+        fileName = name;
+        file.reset();
+        data = string_view();
+        header = nullptr;
+        blocks = nullptr;
+        ranges.clear();
+        payloadStart = 0;
+        error.clear();
+        if (!FileHandler::fileExists(name)) {
+            return true;
+        }
+        file.reset(new MappedFile(name));
+        data = file->view();
+        if (data.size() < sizeof(ArchiveHeader)) {
+            return fail("file too short");
+        }
+        header = reinterpret_cast<const ArchiveHeader*>(data.data());
+        if (memcmp(header->magic, "RMSARCH", 8) != 0 || header->version == 0 || header->version > VERSION) {
+            return fail("bad header");
+        }
+        if (header->blockCount > (data.size() - sizeof(ArchiveHeader)) / sizeof(ArchiveBlock)) {
+            return fail("truncated directory");
+        }
+        blocks = reinterpret_cast<const ArchiveBlock*>(data.data() + sizeof(ArchiveHeader));
+        payloadStart = sizeof(ArchiveHeader) + header->blockCount * sizeof(ArchiveBlock);
+        if (header->version == 1) {
+            if (header->ranges > 0) {
+                ranges.push_back(ArchiveRange{ 0, header->ranges });
+            }
+        }
+        else {
+            if (header->ranges > (data.size() - payloadStart) / sizeof(ArchiveRange)) {
+                return fail("truncated ID ranges");
+            }
+            ranges.resize(header->ranges);
+            memcpy(ranges.data(), data.data() + payloadStart, ranges.size() * sizeof(ArchiveRange));
+            payloadStart += ranges.size() * sizeof(ArchiveRange);
+            for (size_t i = 0; i < ranges.size(); i++) {
+                if (ranges[i].first >= ranges[i].end || (i > 0 && ranges[i].first <= ranges[i - 1].end)) {
+                    return fail("ID ranges out of order");
+                }
+            }
+        }
+        for (uint32_t i = 0; i < header->blockCount; i++) {
+            const ArchiveBlock& block = blocks[i];
+            if (block.offset < payloadStart || block.offset > data.size() || block.bytes > data.size() - block.offset || block.count == 0
+                || block.count > BLOCK_RECORDS) {
+                return fail("block " + to_string(i) + " out of bounds");
+            }
+            if (crc32(data.data() + block.offset, block.bytes) != block.checksum) {
+                return fail("checksum mismatch in block " + to_string(i));
+            }
+        }
+        return true;
+    }
+
+    bool usable() const {
+        return !fileName.empty() && error.empty();
+    }
+
+    const string& errorMessage() const {
+        return error;
+    }
+
+    // Whether the booking with this ID is in the archive
+    bool holds(uint64_t id) const {
+        auto it = upper_bound(ranges.begin(), ranges.end(), id, [](uint64_t value, const ArchiveRange& range) {
+            return value < range.first;
+        });
+        return it != ranges.begin() && id < prev(it)->end;
+    }
+
+    uint64_t bookingCount() const {
+        return header == nullptr ? 0 : header->bookings;
+    }
+
+    size_t fileBytes() const {
+        return data.size();
+    }
+
+    // Adds bookings the archive does not hold yet and their IDs to its ranges.
+    // The file is rewritten through a temporary file, so a crash keeps the old one.
+    bool append(vector<ArchivedBooking>& rows) {
+        vector<ArchiveRange> newRanges = ranges;
+        for (const ArchivedBooking& row : rows) {
+            newRanges.push_back(ArchiveRange{ row.id, row.id + 1 });
+        }
+        sort(newRanges.begin(), newRanges.end(), [](const ArchiveRange& a, const ArchiveRange& b) {
+            return a.first < b.first;
+        });
+        size_t merged = 0;
+        for (size_t i = 1; i < newRanges.size(); i++) {
+            if (newRanges[i].first <= newRanges[merged].end) {
+                newRanges[merged].end = max(newRanges[merged].end, newRanges[i].end);
+            }
+            else {
+                newRanges[++merged] = newRanges[i];
+            }
+        }
+        newRanges.resize(newRanges.empty() ? 0 : merged + 1);
+        sort(rows.begin(), rows.end(), [](const ArchivedBooking& a, const ArchivedBooking& b) {
+            return a.userId != b.userId ? a.userId < b.userId : a.id < b.id;
+        });
+        vector<ArchiveBlock> directory(blocks, blocks + (header == nullptr ? 0 : header->blockCount));
+        string payload(header == nullptr ? string_view() : data.substr(payloadStart));
+        for (size_t first = 0; first < rows.size(); first += BLOCK_RECORDS) {
+            // Users pick the block; within it, ID order keeps the ID and time deltas small
+            size_t n = min(BLOCK_RECORDS, rows.size() - first);
+            sort(rows.begin() + first, rows.begin() + first + n, [](const ArchivedBooking& a, const ArchivedBooking& b) {
+                return a.id < b.id;
+            });
+            directory.emplace_back();
+            encodeBlock(rows.data() + first, n, payload, directory.back());
+        }
+        // Offsets so far are relative to the payload; the directory and ranges now sit before it
+        size_t start = sizeof(ArchiveHeader) + directory.size() * sizeof(ArchiveBlock) + newRanges.size() * sizeof(ArchiveRange);
+        uint64_t offset = start;
+        for (ArchiveBlock& block : directory) {
+            block.offset = offset;
+            offset += block.bytes;
+        }
+        ArchiveHeader newHeader = {};
+        memcpy(newHeader.magic, "RMSARCH", 8);
+        newHeader.version = VERSION;
+        newHeader.blockCount = static_cast<uint32_t>(directory.size());
+        newHeader.ranges = newRanges.size();
+        newHeader.bookings = bookingCount() + rows.size();
+        vector<pair<const char*, size_t>> chunks = { { reinterpret_cast<const char*>(&newHeader), sizeof(newHeader) },
+            { reinterpret_cast<const char*>(directory.data()), directory.size() * sizeof(ArchiveBlock) },
+            { reinterpret_cast<const char*>(newRanges.data()), newRanges.size() * sizeof(ArchiveRange) }, { payload.data(), payload.size() } };
+        file.reset(); // Windows cannot replace a mapped file
+        bool written = FileHandler::saveBytesAtomic(fileName, chunks);
+        return open(fileName) && written;
+    }
+
+    // Calls fn for every booking in the blocks where test(block) holds and
+    // returns how many blocks were decoded
+    template<typename Test, typename Fn>
+    size_t scan(Test test, Fn fn) const {
+        size_t decoded = 0;
+        vector<ArchivedBooking> rows;
+        for (uint32_t i = 0; header != nullptr && i < header->blockCount; i++) {
+            if (!test(blocks[i])) {
+                continue;
+            }
+            decoded++;
+            if (decodeBlock(blocks[i], rows)) {
+                for (const ArchivedBooking& row : rows) {
+                    fn(row);
+                }
+            }
+        }
+        return decoded;
+    }
+
+    template<typename Fn>
+    size_t forUser(uint32_t userId, Fn fn) const {
+        return scan([&](const ArchiveBlock& block) { return block.minUser <= userId && userId <= block.maxUser; },
+            [&](const ArchivedBooking& booking) {
+                if (booking.userId == userId) {
+                    fn(booking);
+                }
+            });
+    }
+
+    template<typename Fn>
+    size_t forTrain(int trainId, Fn fn) const {
+        return scan([&](const ArchiveBlock& block) { return block.minTrain <= trainId && trainId <= block.maxTrain; },
+            [&](const ArchivedBooking& booking) {
+                if (booking.trainId == trainId) {
+                    fn(booking);
+                }
+            });
+    }
+};
+
+// Station Index Class
+// Posting lists from each station to the sorted IDs of the trains stopping
+// there. Queries on two stations intersect two lists instead of scanning trains.
+// Removed trains stay listed until compaction rebuilds the lists, so callers
+// check each ID against the live train.
+class StationIndex {
+public:
+    vector<vector<int>> postings; // by StationId
+
+    void add(const Train& train) {
+        for (StationId stop : train.stops) {
+            if (stop >= postings.size()) {
+                postings.resize(stop + 1);
+            }
+            vector<int>& ids = postings[stop];
+            // Loaders add trains in ID order, so this is almost always an append
+            if (ids.empty() || ids.back() < train.id) {
+                ids.push_back(train.id);
+                continue;
+            }
+            auto it = lower_bound(ids.begin(), ids.end(), train.id);
+            if (*it != train.id) {
+                ids.insert(it, train.id);
+            }
+        }
+    }
+
+    void remove(const Train& train) {
+        for (StationId stop : train.stops) {
+            if (stop >= postings.size()) {
+                continue;
+            }
+            vector<int>& ids = postings[stop];
+            auto it = lower_bound(ids.begin(), ids.end(), train.id);
+            if (it != ids.end() && *it == train.id) {
+                ids.erase(it);
+            }
+        }
+    }
+
+    void clear() {
+        postings.clear();
+    }
+
+    const vector<int>& trainsAt(StationId station) const {
+        static const vector<int> none;
+        return station < postings.size() ? postings[station] : none;
+    }
+
+    // Appends the IDs found in both sorted lists; each ID of the shorter list is
+    // looked up by galloping through the longer one, so skewed sizes stay cheap
+    static void intersect(const vector<int>& a, const vector<int>& b, vector<int>& result) {
+        const vector<int>& shorter = a.size() <= b.size() ? a : b;
+        const vector<int>& longer = a.size() <= b.size() ? b : a;
+        size_t low = 0;
+        for (int id : shorter) {
+            size_t step = 1, high = low;
+            while (high < longer.size() && longer[high] < id) {
+                low = high + 1;
+                high += step;
+                step *= 2;
+            }
+            low = lower_bound(longer.begin() + low, longer.begin() + min(high + 1, longer.size()), id) - longer.begin();
+            if (low == longer.size()) {
+                return;
+            }
+            if (longer[low] == id) {
+                result.push_back(id);
+            }
+        }
+    }
+
+    size_t memoryUsage() const {
+        size_t bytes = postings.capacity() * sizeof(vector<int>);
+        for (const vector<int>& ids : postings) {
+            bytes += ids.capacity() * sizeof(int);
+        }
+        return bytes;
+    }
+};
+
+// Fare Class
+enum FareClass {
+    FARE_ECONOMY,
+    FARE_BUSINESS,
+    FARE_FIRST,
+    FARE_CLASSES
+};
+
+// Fare Quote
+struct FareQuote {
+    int trainId;
+    int32_t travelDay; // the run priced; 0 for an undated train
+    int seatsFree;     // on the leg quoted
+    int32_t fare;
+};
+
+// Fare Engine Class
+// Prices a leg from its length in segments, the class, the share of the leg's
+// seats already sold and how many days ahead the journey is. A train's fare
+// table (the fare for each leg length, and its inverse capacity) is built on
+// first quote and cached until its seats or stops change. Quotes are priced in
+// batches held as parallel arrays padded to whole blocks of LANES; inputs are
+// clamped as they are added, so the pricing loop is straight arithmetic that
+// the compiler vectorizes.
+class FareEngine {
+public:
+    static constexpr size_t LANES = 8;
+    static constexpr float BASE_FARE = 150.0f;
+    static constexpr float SEGMENT_FARE = 400.0f;
+    static constexpr float TAPER = 0.85f;           // a leg of n segments costs n^TAPER segment fares
+    static constexpr float LOAD_SURGE = 0.75f;      // a sold-out leg costs 1 + LOAD_SURGE times an empty one
+    static constexpr float LATE_PREMIUM = 1.25f;    // for travel today
+    static constexpr float ADVANCE_STEP = 0.015f;   // off the premium per day ahead, up to ADVANCE_DAYS
+    static constexpr int32_t ADVANCE_DAYS = 30;
+    static constexpr int32_t UNDATED = INT32_MIN;    // days ahead of a quote with no travel date
+    static constexpr float NEUTRAL_DAYS = (LATE_PREMIUM - 1.0f) / ADVANCE_STEP; // where the advance factor is 1
+    static constexpr const char* CLASS_NAMES[FARE_CLASSES] = { "economy", "business", "first" };
+    static constexpr float CLASS_MULTIPLIERS[FARE_CLASSES] = { 1.0f, 1.8f, 3.0f };
+
+    struct Table {
+        vector<float> legFares; // by leg length in segments
+        float inverseCapacity;
+    };
+
+    // One element per quote; add() pads every array to a whole block
+    struct Batch {
+        vector<float> legFares;
+        vector<float> seatsFree;
+        vector<float> inverseCapacity;
+        vector<float> daysAhead;
+        vector<int32_t> fares;
+        size_t count = 0;
+
+        void clear() {
+            legFares.clear();
+            seatsFree.clear();
+            inverseCapacity.clear();
+            daysAhead.clear();
+            fares.clear();
+            count = 0;
+        }
+
+        // seats is at most the train's capacity; an UNDATED quote is priced with
+        // neither the late premium nor an advance discount
+        void add(const Table& table, int segments, int seats, int32_t days) {
+            if (count % LANES == 0) {
+                size_t padded = count + LANES;
+                legFares.resize(padded, 0.0f);
+                seatsFree.resize(padded, 0.0f);
+                inverseCapacity.resize(padded, 0.0f);
+                daysAhead.resize(padded, 0.0f);
+                fares.resize(padded, 0);
+            }
+            legFares[count] = table.legFares[segments];
+            seatsFree[count] = static_cast<float>(seats);
+            inverseCapacity[count] = table.inverseCapacity;
+            daysAhead[count] = days == UNDATED ? NEUTRAL_DAYS : static_cast<float>(min(max(days, 0), ADVANCE_DAYS));
+            count++;
+        }
+    };
+
+private:
+    mutex m;
+    unordered_map<int, Table> tables; // by train ID
+
+    static void build(const Train& train, Table& table) {
+        table.legFares.resize(train.segmentCount() + 1);
+        for (int segments = 0; segments <= train.segmentCount(); segments++) {
+            table.legFares[segments] = BASE_FARE + SEGMENT_FARE * pow(static_cast<float>(segments), TAPER);
+        }
+        table.inverseCapacity = train.capacity() > 0 ? 1.0f / train.capacity() : 0.0f;
+    }
+
+public:
+    static bool parseClass(string_view text, FareClass& fareClass) {
+        for (int c = 0; c < FARE_CLASSES; c++) {
+            if (text == CLASS_NAMES[c]) {
+                fareClass = static_cast<FareClass>(c);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The table of each train, building any not cached; the caller holds
+    // stateMutex, which keeps the tables from being invalidated while it uses them
+    void lookup(const vector<const Train*>& trains, vector<const Table*>& result) {
+        lock_guard<mutex> lock(m);
+        result.resize(trains.size());
+        for (size_t i = 0; i < trains.size(); i++) {
+            auto found = tables.try_emplace(trains[i]->id);
+            if (found.second) {
+                build(*trains[i], found.first->second);
+            }
+            result[i] = &found.first->second;
+        }
+    }
+
+    // Drops a train's table; the caller holds stateMutex exclusively
+    void invalidate(int trainId) {
+        lock_guard<mutex> lock(m);
+        tables.erase(trainId);
+    }
+
+    size_t cachedTables() {
+        lock_guard<mutex> lock(m);
+        return tables.size();
+    }
+
+    // Fills batch.fares for every element
+    static void price(Batch& batch, FareClass fareClass) {
+        const float* __restrict legFares = batch.legFares.data();
+        const float* __restrict seatsFree = batch.seatsFree.data();
+        const float* __restrict inverseCapacity = batch.inverseCapacity.data();
+        const float* __restrict daysAhead = batch.daysAhead.data();
+        int32_t* __restrict fares = batch.fares.data();
+        float multiplier = CLASS_MULTIPLIERS[fareClass];
+        size_t n = batch.fares.size() & ~(LANES - 1); // already whole blocks; the mask lets the compiler see it
+        for (size_t i = 0; i < n; i++) {
+            float load = 1.0f - seatsFree[i] * inverseCapacity[i];
+            float advance = LATE_PREMIUM - ADVANCE_STEP * daysAhead[i];
+            fares[i] = static_cast<int32_t>(legFares[i] * multiplier * (1.0f + LOAD_SURGE * load * load) * advance + 0.5f);
+        }
+    }
+};
+
+// Search Page
+struct TrainPage {
+    vector<int> trainIds; // this page, ascending
+    size_t total = 0;     // matches over all pages
+    int nextAfterId = 0;  // pass as afterId for the next page; 0 when this is the last
+};
+
+// Journey Leg
+struct JourneyLeg {
+    bool byTrain; // otherwise a route
+    int id;
+    StationId from;
+    StationId to;
+};
+
+// Journey Planner Class
+// Station graph over every train and route: per station, the legs leaving it.
+// Adding, editing or removing a train or route only rewrites the lists of the
+// stations it stops at; the whole graph is built once, on the first query after
+// loading. Journeys have the fewest legs, which is the fewest changes; trains
+// carry run days but no times, so there is no travel time to minimise.
+// Fewest-leg trees are computed per origin on first use and cached until the
+// graph changes.
+class JourneyPlanner {
+private:
+    static constexpr uint32_t NONE = 0xFFFFFFFFu;
+    static const size_t MAX_CACHED_TREES = 1024;
+
+    struct Edge {
+        uint32_t to;
+        int32_t id;
+    };
+
+    // Trains' legs are searched first so that, between equally short journeys, bookable legs win
+    struct StationEdges {
+        vector<Edge> trains;
+        vector<Edge> routes;
+    };
+
+    // The leg that first reached a station
+    struct Step {
+        uint32_t from;
+        int32_t id;
+        bool byTrain;
+    };
+
+    const deque<Train>& trains;
+    const deque<Route>& routes;
+    mutex m;
+    bool stale;                                       // the graph is built on the next query
+    vector<StationEdges> graph;                       // by station
+    unordered_map<int, vector<StationId>> trainStops; // each train's stops as the graph holds them
+    unordered_map<int, StationId> routeSources;       // each route's source as the graph holds it
+    unordered_map<uint32_t, vector<Step>> trees;      // origin -> step that reached each station
+    deque<uint32_t> treeOrder;
+
+    void clearTrees() {
+        trees.clear();
+        treeOrder.clear();
+    }
+
+    // A train links every stop to every later one, since any such leg can be booked
+    void addTrainEdges(const Train& train) {
+        if (graph.size() < Stations::count()) {
+            graph.resize(Stations::count());
+        }
+        for (size_t from = 0; from + 1 < train.stops.size(); from++) {
+            for (size_t to = from + 1; to < train.stops.size(); to++) {
+                graph[train.stops[from]].trains.push_back(Edge{ train.stops[to], train.id });
+            }
+        }
+        trainStops[train.id] = train.stops;
+    }
+
+    void dropTrainEdges(int id) {
+        auto found = trainStops.find(id);
+        if (found == trainStops.end()) {
+            return;
+        }
+        for (StationId stop : found->second) {
+            vector<Edge>& edges = graph[stop].trains;
+            edges.erase(remove_if(edges.begin(), edges.end(), [&](const Edge& edge) { return edge.id == id; }), edges.end());
+        }
+        trainStops.erase(found);
+    }
+
+    void addRouteEdge(const Route& route) {
+        if (graph.size() < Stations::count()) {
+            graph.resize(Stations::count());
+        }
+        graph[route.source].routes.push_back(Edge{ route.destination, route.id });
+        routeSources[route.id] = route.source;
+    }
+
+    void dropRouteEdge(int id) {
+        auto found = routeSources.find(id);
+        if (found == routeSources.end()) {
+            return;
+        }
+        vector<Edge>& edges = graph[found->second].routes;
+        edges.erase(remove_if(edges.begin(), edges.end(), [&](const Edge& edge) { return edge.id == id; }), edges.end());
+        routeSources.erase(found);
+    }
+
+    void rebuild() {
+        clearTrees();
+        graph.assign(Stations::count(), StationEdges());
+        trainStops.clear();
+        routeSources.clear();
+        for (const Train& train : trains) {
+            if (!train.removed) {
+                addTrainEdges(train);
+            }
+        }
+        for (const Route& route : routes) {
+            if (!route.removed) {
+                addRouteEdge(route);
+            }
+        }
+        stale = false;
+    }
+
+    // Breadth-first search from origin; returns the step that first reached each station
+    const vector<Step>& treeFrom(uint32_t origin) {
+        auto cached = trees.find(origin);
+        if (cached != trees.end()) {
+            return cached->second;
+        }
+        if (treeOrder.size() >= MAX_CACHED_TREES) {
+            trees.erase(treeOrder.front());
+            treeOrder.pop_front();
+        }
+        vector<Step>& parent = trees[origin];
+        treeOrder.push_back(origin);
+        parent.assign(graph.size(), Step{ NONE, 0, false });
+        vector<uint32_t> frontier(1, origin);
+        vector<char> seen(graph.size(), 0);
+        seen[origin] = 1;
+        for (size_t head = 0; head < frontier.size(); head++) {
+            uint32_t from = frontier[head];
+            for (int byTrain = 1; byTrain >= 0; byTrain--) {
+                for (const Edge& edge : byTrain ? graph[from].trains : graph[from].routes) {
+                    if (!seen[edge.to]) {
+                        seen[edge.to] = 1;
+                        parent[edge.to] = Step{ from, edge.id, byTrain != 0 };
+                        frontier.push_back(edge.to);
+                    }
+                }
+            }
+        }
+        return parent;
+    }
+
+public:
+    JourneyPlanner(const deque<Train>& trainTable, const deque<Route>& routeTable)
+        : trains(trainTable), routes(routeTable), stale(true) {}
+
+    // Builds the whole graph again on the next query, as after loading the tables
+    void invalidate() {
+        lock_guard<mutex> lock(m);
+        stale = true;
+    }
+
+    // The train was added or edited; the caller holds stateMutex exclusively
+    void trainChanged(const Train& train) {
+        lock_guard<mutex> lock(m);
+        if (stale) {
+            return;
+        }
+        dropTrainEdges(train.id);
+        if (!train.removed) {
+            addTrainEdges(train);
+        }
+        clearTrees();
+    }
+
+    void trainRemoved(int id) {
+        lock_guard<mutex> lock(m);
+        if (!stale) {
+            dropTrainEdges(id);
+            clearTrees();
+        }
+    }
+
+    void routeChanged(const Route& route) {
+        lock_guard<mutex> lock(m);
+        if (stale) {
+            return;
+        }
+        dropRouteEdge(route.id);
+        if (!route.removed) {
+            addRouteEdge(route);
+        }
+        clearTrees();
+    }
+
+    void routeRemoved(int id) {
+        lock_guard<mutex> lock(m);
+        if (!stale) {
+            dropRouteEdge(id);
+            clearTrees();
+        }
+    }
+
+    // Finds the journey with the fewest legs; the caller must keep trains and routes unchanged
+    bool plan(const string& from, const string& to, vector<JourneyLeg>& legs) {
+        lock_guard<mutex> lock(m);
+        if (stale) {
+            rebuild();
+        }
+        legs.clear();
+        StationId origin, target;
+        if (!Stations::find(from, origin) || !Stations::find(to, target) || origin == target || origin >= graph.size() || target >= graph.size()) {
+            return false;
+        }
+        const vector<Step>& parent = treeFrom(origin);
+        if (parent[target].from == NONE) {
+            return false;
+        }
+        for (uint32_t at = target; at != origin; at = parent[at].from) {
+            const Step& step = parent[at];
+            legs.push_back(JourneyLeg{ step.byTrain, step.id, step.from, at });
+        }
+        reverse(legs.begin(), legs.end());
+        return true;
+    }
+};
+
+// Appends text as a quoted JSON string
+void appendJsonString(string& out, string_view text) {
+    static const char hex[] = "0123456789abcdef";
+    out += '"';
+    for (char c : text) {
+        switch (c) {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                out += "\\u00";
+                out += hex[(c >> 4) & 0xF];
+                out += hex[c & 0xF];
+            }
+            else {
+                out += c;
+            }
+        }
+    }
+    out += '"';
+}
+
+// Epoch Manager Class
+// Epoch-based reclamation. A reader pins the current epoch in a slot while it
+// uses shared objects. A writer that unpublishes an object retires it at the
+// current epoch and advances the epoch; the object is freed once no slot is
+// pinned at or before that epoch, so readers take no lock and never see it freed.
+class EpochManager {
+private:
+    static const size_t SLOTS = 128;
+
+    struct alignas(64) Slot {
+        atomic<uint64_t> epoch; // 0 while free
+    };
+
+    struct Retired {
+        uint64_t epoch;
+        void* object;
+        void (*destroy)(void*);
+    };
+
+    Slot slots[SLOTS];
+    atomic<uint64_t> current;
+    mutex retiredMutex;
+    vector<Retired> retired;
+
+    size_t pin() {
+        size_t start = hash<thread::id>()(this_thread::get_id());
+        for (size_t i = 0;; i++) {
+            size_t slot = (start + i) % SLOTS;
+            uint64_t idle = 0;
+            if (slots[slot].epoch.load(memory_order_relaxed) == 0 && slots[slot].epoch.compare_exchange_strong(idle, current.load())) {
+                return slot;
+            }
+            if (i % SLOTS == SLOTS - 1) {
+                this_thread::yield();
+            }
+        }
+    }
+
+    // Frees what no pinned reader can still hold; the caller holds retiredMutex
+    void collect() {
+        uint64_t oldest = UINT64_MAX;
+        for (Slot& slot : slots) {
+            uint64_t epoch = slot.epoch.load();
+            if (epoch != 0) {
+                oldest = min(oldest, epoch);
+            }
+        }
+        size_t kept = 0;
+        for (const Retired& entry : retired) {
+            if (entry.epoch < oldest) {
+                entry.destroy(entry.object);
+            }
+            else {
+                retired[kept++] = entry;
+            }
+        }
+        retired.resize(kept);
+    }
+
+public:
+    // Keeps everything published when it was taken alive until it is destroyed
+    class Pin {
+    private:
+        EpochManager& epochs;
+        size_t slot;
+
+    public:
+        explicit Pin(EpochManager& owner) : epochs(owner), slot(owner.pin()) {}
+
+        ~Pin() {
+            epochs.slots[slot].epoch.store(0);
+        }
+    };
+
+    EpochManager() : current(1) {
+        for (Slot& slot : slots) {
+            slot.epoch.store(0);
+        }
+    }
+
+    // No reader may be pinned any more
+    ~EpochManager() {
+        for (const Retired& entry : retired) {
+            entry.destroy(entry.object);
+        }
+    }
+
+    // Frees object once the readers that might hold it are gone; it must already
+    // be unreachable for new readers
+    template<typename T>
+    void retire(const T* object) {
+        lock_guard<mutex> lock(retiredMutex);
+        retired.push_back(Retired{ current.fetch_add(1), const_cast<T*>(object), [](void* p) { delete static_cast<T*>(p); } });
+        collect();
+    }
+};
+
+// Read Views
+// Immutable copies of the tables for readers that must not hold the state lock.
+// A layout copies the live trains and routes and is only rebuilt when they
+// change; a view adds the seat counts and row totals at one moment and shares
+// its layout with the views before it. Views are taken without the state lock:
+// writers bracket their changes (see WriteScope) and publish seat counts
+// through the inventories' atomics, and a view that overlapped a write is retaken.
+struct TrainInfo {
+    const SeatInventory* seats; // next run's seats, null if none; valid while the layout is current
+    int id;
+    string name;
+    StationId source;
+    StationId destination;
+    vector<StationId> stops;
+    int capacity;
+    Schedule schedule;
+};
+
+struct TableLayout {
+    uint64_t version;
+    vector<TrainInfo> trains;               // live trains, in table order
+    vector<uint32_t> byId;                  // positions in trains, in ID order
+    unordered_map<int, int32_t> positionOf; // train ID -> position in trains
+    vector<Route> routes;                   // live routes, in table order
+    size_t userCount;
+    size_t bookingCount;                    // ledger size when built
+    size_t memory[5];                       // heap bytes per table when built, as tableMemory
+};
+
+struct ReadView {
+    const TableLayout* layout;
+    uint64_t stateVersion;  // of the tables and the ledger when the view was taken
+    uint64_t ledgerVersion;
+    vector<int> available;  // per layout train, seats free for the whole journey
+    size_t userCount;
+    size_t bookingCount;    // ledger positions [0, bookingCount) existed
+    size_t cancelledCount;  // and so did the first cancelledCount cancellations
+    long long capacity;     // summed over the trains
+    long long remaining;
+    size_t memory[5];       // heap bytes per table, as tableMemory
+};
+
+// Report Engine
+// Answers the reports from a columnar copy of a read view and the ledger prefix
+// it counts, taken without the state lock; the scans run afterwards on all
+// cores, each worker over its own contiguous range, on a pool of threads kept
+// between reports. The report files are written by a background thread.
+class ReportEngine {
+public:
+    static constexpr size_t TOP_ROUTES = 10;
+    static constexpr uint32_t CANCELLED = UINT32_MAX; // user column marker, dropped after projection
+
+    struct StationPair {
+        StationId source;
+        StationId destination;
+        uint32_t trains;
+        uint64_t bookings;
+    };
+
+    struct Result {
+        // Per train, in train-table order
+        vector<int32_t> trainId;
+        vector<string> trainName;
+        vector<StationId> source;
+        vector<StationId> destination;
+        vector<int32_t> capacity;
+        vector<int32_t> remaining;       // seats free for the whole journey
+        vector<uint64_t> sold;
+        vector<StationPair> pairs;       // by bookings, descending
+        vector<pair<string, uint32_t>> userBookings; // users with at least one booking, filled in by resolveUsers
+        vector<pair<string, uint64_t>> monthly;      // "YYYY-MM" -> bookings
+        uint64_t bookingCount = 0;
+        uint64_t orphanBookings = 0;     // on trains no longer in service
+        uint64_t seatsSold = 0;
+        uint64_t seatsRemaining = 0;
+        double seconds = 0;
+    };
+
+private:
+    const deque<User>& users;
+    const BookingLedger& bookings;
+    mutex writerMutex;
+    thread writer;
+
+    // Columnar projection, rebuilt for every report
+    vector<uint32_t> userColumn;
+    vector<int32_t> trainColumn; // row in the result's per-train columns, or -1
+    vector<int32_t> dayColumn;   // days since 1970-01-01
+    vector<uint32_t> perUser;
+    vector<vector<uint32_t>> userHistograms; // per worker, kept between reports
+    size_t userCount;
+
+    // Threads for parallelFor, started by the first report large enough to split;
+    // the calling thread is worker 0
+    vector<thread> pool;
+    mutex poolMutex;
+    condition_variable poolWake;
+    condition_variable poolDone;
+    function<void(size_t, size_t, size_t)> job;
+    size_t jobSize;
+    size_t jobWorkers;
+    uint64_t jobGeneration;
+    size_t jobsPending;
+    bool closing;
+
+    static size_t workerCount(size_t n) {
+        size_t hardware = max(1u, thread::hardware_concurrency());
+        return n < (1u << 16) ? 1 : min<size_t>(hardware, 16);
+    }
+
+    void poolLoop(size_t w, uint64_t seen) {
+        unique_lock<mutex> lock(poolMutex);
+        while (true) {
+            poolWake.wait(lock, [&] { return closing || jobGeneration != seen; });
+            if (closing) {
+                return;
+            }
+            seen = jobGeneration;
+            size_t n = jobSize, workers = jobWorkers;
+            lock.unlock();
+            if (w < workers) {
+                job(n * w / workers, n * (w + 1) / workers, w);
+            }
+            lock.lock();
+            if (--jobsPending == 0) {
+                poolDone.notify_one();
+            }
+        }
+    }
+
+    // Runs fn(begin, end, worker) over [0, n) split into one contiguous range per
+    // worker. Reports hold scanMutex, so one job runs at a time.
+    template<typename Fn>
+    void parallelFor(size_t n, size_t workers, Fn fn) {
+        if (workers <= 1) {
+            fn(0, n, 0);
+            return;
+        }
+        unique_lock<mutex> lock(poolMutex);
+        while (pool.size() + 1 < workers) {
+            pool.emplace_back(&ReportEngine::poolLoop, this, pool.size() + 1, jobGeneration);
+        }
+        job = fn;
+        jobSize = n;
+        jobWorkers = workers;
+        jobsPending = pool.size();
+        jobGeneration++;
+        lock.unlock();
+        poolWake.notify_all();
+        fn(0, n / workers, 0);
+        lock.lock();
+        poolDone.wait(lock, [&] { return jobsPending == 0; });
+        job = nullptr;
+    }
+
+    // Days since 1970-01-01 to "YYYY-MM" (proleptic Gregorian calendar)
+    static string monthName(int64_t days) {
+        int64_t year, month, day;
+        civilFromDays(days, year, month, day);
+        char text[32];
+        snprintf(text, sizeof(text), "%04lld-%02lld", static_cast<long long>(year), static_cast<long long>(month));
+        return text;
+    }
+
+public:
+    mutex scanMutex; // held by a report from projection to resolveUsers, as the columns are shared
+
+    ReportEngine(const deque<User>& userTable, const BookingLedger& ledger)
+        : users(userTable), bookings(ledger), userCount(0), jobSize(0), jobWorkers(0), jobGeneration(0), jobsPending(0), closing(false) {}
+
+    ~ReportEngine() {
+        wait();
+        {
+            lock_guard<mutex> lock(poolMutex);
+            closing = true;
+        }
+        poolWake.notify_all();
+        for (thread& t : pool) {
+            t.join();
+        }
+    }
+
+    // Copies the columns the reports need as of the view, which the caller keeps
+    // pinned. Seats may be cleared by later cancellations, so the view's prefix of
+    // the cancellation log decides which bookings count.
+    void project(const ReadView& view, Result& result) {
+        const TableLayout& layout = *view.layout;
+        size_t trainCount = layout.trains.size();
+        size_t n = view.bookingCount;
+        userColumn.resize(n);
+        trainColumn.resize(n);
+        dayColumn.resize(n);
+        parallelFor(n, workerCount(n), [&](size_t begin, size_t end, size_t) {
+            for (size_t i = begin; i < end; i++) {
+                const BookingRecord& booking = bookings.at(static_cast<uint32_t>(i));
+                auto row = layout.positionOf.find(booking.trainId);
+                userColumn[i] = booking.userId;
+                trainColumn[i] = row == layout.positionOf.end() ? -1 : row->second;
+                dayColumn[i] = static_cast<int32_t>(booking.timestamp / 86400);
+            }
+        });
+        for (size_t c = 0; c < view.cancelledCount; c++) {
+            userColumn[bookings.cancelledAt(c)] = CANCELLED;
+        }
+        // Cancelled bookings are dropped in one pass, keeping the rest in order
+        size_t kept = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (userColumn[i] != CANCELLED) {
+                userColumn[kept] = userColumn[i];
+                trainColumn[kept] = trainColumn[i];
+                dayColumn[kept] = dayColumn[i];
+                kept++;
+            }
+        }
+        userColumn.resize(kept);
+        trainColumn.resize(kept);
+        dayColumn.resize(kept);
+        result.trainId.resize(trainCount);
+        result.trainName.resize(trainCount);
+        result.source.resize(trainCount);
+        result.destination.resize(trainCount);
+        result.capacity.resize(trainCount);
+        result.remaining.resize(trainCount);
+        for (size_t t = 0; t < trainCount; t++) {
+            const TrainInfo& train = layout.trains[t];
+            result.trainId[t] = train.id;
+            result.trainName[t] = train.name;
+            result.source[t] = train.source;
+            result.destination[t] = train.destination;
+            result.capacity[t] = train.capacity;
+            result.remaining[t] = view.available[t];
+        }
+        userCount = view.userCount;
+    }
+
+    // Runs the group-by kernels over the projection; no locks are needed
+    void aggregate(Result& result) {
+        auto started = chrono::steady_clock::now();
+        size_t n = userColumn.size();
+        size_t trainCount = result.trainId.size();
+        size_t workers = workerCount(n);
+
+        int32_t firstDay = 0, lastDay = 0;
+        if (n > 0) {
+            auto range = minmax_element(dayColumn.begin(), dayColumn.end());
+            firstDay = *range.first;
+            lastDay = min(*range.second, firstDay + (1 << 20)); // later days are clamped into the last bucket
+        }
+        size_t dayCount = static_cast<size_t>(lastDay - firstDay) + 1;
+
+        // Bookings per train and per day: one private histogram per worker, summed afterwards
+        vector<vector<uint64_t>> trainCounts(workers, vector<uint64_t>(trainCount + 1, 0));
+        vector<vector<uint64_t>> dayCounts(workers, vector<uint64_t>(dayCount, 0));
+        parallelFor(n, workers, [&](size_t begin, size_t end, size_t w) {
+            uint64_t* perTrain = trainCounts[w].data() + 1; // slot -1 counts bookings on removed trains
+            uint64_t* perDay = dayCounts[w].data();
+            const int32_t* trainSlots = trainColumn.data();
+            const int32_t* days = dayColumn.data();
+            for (size_t i = begin; i < end; i++) {
+                perTrain[trainSlots[i]]++;
+                perDay[min(days[i], lastDay) - firstDay]++;
+            }
+        });
+        result.sold.assign(trainCount, 0);
+        vector<uint64_t> perDay(dayCount, 0);
+        for (size_t w = 0; w < workers; w++) {
+            result.orphanBookings += trainCounts[w][0];
+            for (size_t t = 0; t < trainCount; t++) {
+                result.sold[t] += trainCounts[w][t + 1];
+            }
+            for (size_t d = 0; d < dayCount; d++) {
+                perDay[d] += dayCounts[w][d];
+            }
+        }
+
+        // Bookings per user: each worker counts its range of the column into its own
+        // histogram, then sums one range of users across all of them
+        perUser.assign(userCount, 0);
+        if (workers <= 1) {
+            for (size_t i = 0; i < n; i++) {
+                if (userColumn[i] < userCount) {
+                    perUser[userColumn[i]]++;
+                }
+            }
+        }
+        else {
+            userHistograms.resize(workers);
+            parallelFor(n, workers, [&](size_t begin, size_t end, size_t w) {
+                userHistograms[w].assign(userCount, 0);
+                uint32_t* counts = userHistograms[w].data();
+                const uint32_t* column = userColumn.data();
+                for (size_t i = begin; i < end; i++) {
+                    if (column[i] < userCount) {
+                        counts[column[i]]++;
+                    }
+                }
+            });
+            parallelFor(userCount, workers, [&](size_t begin, size_t end, size_t) {
+                for (const vector<uint32_t>& counts : userHistograms) {
+                    for (size_t u = begin; u < end; u++) {
+                        perUser[u] += counts[u];
+                    }
+                }
+            });
+        }
+
+        result.bookingCount = n;
+        for (size_t t = 0; t < trainCount; t++) {
+            result.seatsSold += result.sold[t];
+            result.seatsRemaining += static_cast<uint64_t>(max(0, result.remaining[t]));
+        }
+        unordered_map<uint64_t, size_t> pairSlots;
+        for (size_t t = 0; t < trainCount; t++) {
+            uint64_t key = (static_cast<uint64_t>(result.source[t]) << 32) | result.destination[t];
+            auto inserted = pairSlots.emplace(key, result.pairs.size());
+            if (inserted.second) {
+                result.pairs.push_back(StationPair{ result.source[t], result.destination[t], 0, 0 });
+            }
+            StationPair& stationPair = result.pairs[inserted.first->second];
+            stationPair.trains++;
+            stationPair.bookings += result.sold[t];
+        }
+        sort(result.pairs.begin(), result.pairs.end(), [](const StationPair& a, const StationPair& b) {
+            return a.bookings != b.bookings ? a.bookings > b.bookings : a.trains > b.trains;
+        });
+        for (size_t d = 0; d < dayCount; d++) {
+            if (perDay[d] == 0) {
+                continue;
+            }
+            string month = monthName(firstDay + static_cast<int64_t>(d));
+            if (result.monthly.empty() || result.monthly.back().first != month) {
+                result.monthly.emplace_back(month, 0);
+            }
+            result.monthly.back().second += perDay[d];
+        }
+        result.seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    }
+
+    // Names the users counted by aggregate; the caller holds the state lock (shared is enough)
+    void resolveUsers(Result& result) {
+        for (size_t u = 0; u < userCount; u++) {
+            if (perUser[u] > 0) {
+                result.userBookings.emplace_back(users[u].username, perUser[u]);
+            }
+        }
+    }
+
+    // Writes the report files on a background thread, after any earlier write finishes
+    void writeAsync(shared_ptr<Result> result) {
+        lock_guard<mutex> lock(writerMutex);
+        if (writer.joinable()) {
+            writer.join();
+        }
+        writer = thread([result] {
+            if (!writeFiles(*result)) {
+                cerr << "Error: could not write the report files\n";
+            }
+        });
+    }
+
+    void wait() {
+        lock_guard<mutex> lock(writerMutex);
+        if (writer.joinable()) {
+            writer.join();
+        }
+    }
+
+    static bool writeFiles(const Result& result) {
+        size_t trainCount = result.trainId.size();
+        bool ok = FileHandler::saveLinesAtomic("report_occupancy.csv", trainCount + 1, [&](size_t i, string& line) {
+            if (i == 0) {
+                line = "train_id,name,source,destination,capacity,sold,remaining,occupancy_pct";
+                return;
+            }
+            size_t t = i - 1;
+            int32_t capacity = result.capacity[t];
+            char pct[32];
+            snprintf(pct, sizeof(pct), "%.2f", capacity == 0 ? 0.0 : 100.0 * (capacity - result.remaining[t]) / capacity);
+            line = to_string(result.trainId[t]) + "," + result.trainName[t] + "," + Stations::name(result.source[t]) + ","
+                + Stations::name(result.destination[t]) + "," + to_string(capacity) + "," + to_string(result.sold[t]) + ","
+                + to_string(result.remaining[t]) + "," + pct;
+        });
+        ok = ok && FileHandler::saveLinesAtomic("report_station_pairs.csv", result.pairs.size() + 1, [&](size_t i, string& line) {
+            if (i == 0) {
+                line = "source,destination,trains,bookings";
+                return;
+            }
+            const StationPair& stationPair = result.pairs[i - 1];
+            line = Stations::name(stationPair.source) + "," + Stations::name(stationPair.destination) + "," + to_string(stationPair.trains) + ","
+                + to_string(stationPair.bookings);
+        });
+        ok = ok && FileHandler::saveLinesAtomic("report_users.csv", result.userBookings.size() + 1, [&](size_t i, string& line) {
+            line = i == 0 ? "username,bookings" : result.userBookings[i - 1].first + "," + to_string(result.userBookings[i - 1].second);
+        });
+        ok = ok && FileHandler::saveLinesAtomic("report_monthly.csv", result.monthly.size() + 1, [&](size_t i, string& line) {
+            line = i == 0 ? "month,bookings" : result.monthly[i - 1].first + "," + to_string(result.monthly[i - 1].second);
+        });
+        string json = "{\"bookings\":" + to_string(result.bookingCount) + ",\"orphanBookings\":" + to_string(result.orphanBookings)
+            + ",\"seatsSold\":" + to_string(result.seatsSold) + ",\"seatsRemaining\":" + to_string(result.seatsRemaining)
+            + ",\"trains\":" + to_string(trainCount) + ",\"activeUsers\":" + to_string(result.userBookings.size()) + ",\"topRoutes\":[";
+        for (size_t i = 0; i < min(TOP_ROUTES, result.pairs.size()); i++) {
+            json += i == 0 ? "{\"source\":" : ",{\"source\":";
+            appendJsonString(json, Stations::name(result.pairs[i].source));
+            json += ",\"destination\":";
+            appendJsonString(json, Stations::name(result.pairs[i].destination));
+            json += ",\"trains\":" + to_string(result.pairs[i].trains) + ",\"bookings\":" + to_string(result.pairs[i].bookings) + "}";
+        }
+        json += "]}\n";
+        return ok && FileHandler::saveBytesAtomic("report_summary.json", { { json.data(), json.size() } });
+    }
+};
+
+// Railway Management System Class
+class RailwayManagementSystem {
+public:
+    // Deques keep pointers handed out by the find functions valid as tables grow
+    deque<User> users;
+    deque<Train> trains;
+    deque<Route> routes;
+    BookingLedger bookings;
+    BookingArchive archive;          // bookings aged out of the ledger
+
+    HashIndex<User> userIndex;
+    HashIndex<Train> trainIndex;
+    HashIndex<Route> routeIndex;
+    BTree<int, uint32_t> trainOrder; // train id -> slot, for listings in id order
+    StationIndex stationIndex;       // station -> trains stopping there, for searches
+    FareEngine fares;                // fare tables by train, for quotes
+    size_t removedTrains;            // tombstoned slots awaiting compaction
+    size_t removedRoutes;
+    TextFilesState textFiles;        // guarded by stateMutex
+    unordered_map<uint64_t, unique_ptr<Waitlist>> waitlists; // by train run (see waitlistKey), created on first use
+    mutex waitlistsMutex;            // guards the map; each waitlist locks itself
+    atomic<uint64_t> nextTicket;
+    JourneyPlanner planner;
+    ReportEngine reports;
+    EpochManager epochs;
+    atomic<const ReadView*> view;  // the latest read view; reclaimed through epochs
+    atomic<uint64_t> stateVersion; // bumped by changes to users, trains and routes
+    atomic<uint64_t> layoutVersion; // bumped by changes to the tables and by seat maps moving
+    mutex viewMutex;               // one view refresh at a time
+    atomic<uint64_t> writesBegun;  // see WriteScope
+    atomic<uint64_t> writesEnded;
+    atomic<bool> viewGate;         // a refresh is holding new writes back; see readView
+    atomic<bool> seatsInUse;       // a refresh is reading seat maps through its layout; see retireSeatMaps
+
+    StorageOptions storageOptions;
+    JournalMeta journalMeta;
+    unordered_map<string, uint64_t> baseLsn; // per table, last journal record already loaded
+    uint64_t replayFloor;                    // bookings with lower IDs were loaded before journal replay
+    uint64_t snapshotGeneration;             // of the last snapshot written or loaded; names its shard files
+    size_t snapshotShards;                   // 0 when that snapshot is a single file
+    WriteAheadLog journal;
+    // Exclusive for table changes and checkpoints; shared for bookings and searches,
+    // which synchronize among themselves through seat atomics and the ledger.
+    // Read views never wait for it.
+    shared_mutex stateMutex;
+    mutex checkpointMutex;
+    mutex wakeMutex;
+    condition_variable checkpointWake;
+    bool stopping;
+    thread checkpointer;
+    thread metricsWriter;
+
+    RailwayManagementSystem(const StorageOptions& options = StorageOptions())
+        : userIndex(users), trainIndex(trains), routeIndex(routes), removedTrains(0), removedRoutes(0), nextTicket(1), planner(trains, routes),
+          reports(users, bookings), view(nullptr), stateVersion(0), layoutVersion(0), writesBegun(0), writesEnded(0), viewGate(false),
+          seatsInUse(false),
+          storageOptions(options), replayFloor(0), snapshotGeneration(0),
+          snapshotShards(0), journal(options), stopping(false) {
+        // A refresh starts from the last view, so there is always one
+        ReadView* first = new ReadView();
+        takeView(buildLayout(), *first);
+        view.store(first);
+        if (!options.metricsFile.empty()) {
+            metricsWriter = thread(&RailwayManagementSystem::metricsLoop, this);
+        }
+        if (!options.persistent) {
+            return;
+        }
+        journalMeta.load();
+        if (options.importText || !loadSnapshot()) {
+            // The loaders flag any file that still needs converting to the current format
+            fill(textFiles.stale, textFiles.stale + TextFilesState::TABLES, false);
+            loadStations();
+            loadUsers();
+            loadTrains();
+            loadRoutes();
+            loadBookings();
+            loadWaitlist();
+            textFilesHoldTables();
+            baseLsn = journalMeta.tableLsn;
+            if (journalMeta.lsnFor("snapshot") > min(min(baseLsn["users"], baseLsn["trains"]), min(baseLsn["routes"], baseLsn["bookings"]))) {
+                cout << "Warning: the text files are older than the last snapshot; changes since they were exported are lost.\n";
+            }
+        }
+        else if (journalMeta.lsnFor("users") == baseLsn["users"] && journalMeta.lsnFor("trains") == baseLsn["trains"]
+            && journalMeta.lsnFor("routes") == baseLsn["routes"] && journalMeta.lsnFor("bookings") == baseLsn["bookings"]
+            && journalMeta.lsnFor("waitlist") == baseLsn["waitlist"]) {
+            // The last export saw exactly what the snapshot holds; only the station
+            // dictionary, which has no LSN, is rewritten to be safe
+            textFilesHoldTables();
+            fill(textFiles.stale, textFiles.stale + TextFilesState::TABLES, false);
+            textFiles.stale[TextFilesState::STATIONS] = true;
+        }
+        rebuildAllSeats();
+        recoverJournal();
+        rollCalendars(currentDay());
+        if (!archive.open(archiveFile())) {
+            cout << "Warning: " << archiveFile() << " unusable (" << archive.errorMessage() << "); archived bookings are not shown.\n";
+        }
+        else {
+            archiveBookings(options.archiveAfterDays > 0 ? static_cast<int64_t>(time(nullptr)) - options.archiveAfterDays * 86400LL : INT64_MIN);
+        }
+        checkpointer = thread(&RailwayManagementSystem::checkpointLoop, this);
+    }
+
+    ~RailwayManagementSystem() {
+        {
+            lock_guard<mutex> lock(wakeMutex);
+            stopping = true;
+        }
+        checkpointWake.notify_all();
+        if (metricsWriter.joinable()) {
+            metricsWriter.join();
+        }
+        if (storageOptions.persistent) {
+            checkpointer.join();
+            checkpoint(storageOptions.verbose);
+            if (storageOptions.mirrorText) {
+                exportText(storageOptions.verbose);
+            }
+            journal.close();
+        }
+        if (!storageOptions.metricsFile.empty()) {
+            writeMetrics(storageOptions.metricsFile);
+        }
+        const ReadView* last = view.load();
+        delete last->layout;
+        delete last;
+    }
+
+    static const char* snapshotFile() {
+        return "railway.snap";
+    }
+
+    static const char* archiveFile() {
+        return "bookings.archive";
+    }
+
+    bool loadSnapshot(const char* fileName = snapshotFile()) {
+        OperationTimer timer(OP_LOAD_SNAPSHOT);
+        if (!FileHandler::fileExists(fileName)) {
+            return false;
+        }
+        if (storageOptions.verbose) {
+            cerr << "Loading snapshot...\n";
+        }
+        SnapshotReader snapshot(fileName);
+        bool ok = snapshot.valid();
+        SnapshotDecoder decoder(snapshot);
+        const ShardsRow* shards = nullptr;
+        const BookingRecord* bookingRows = nullptr;
+        vector<BookingRecord> widenedBookings;
+        size_t shardCount = 0, bookingCount = 0;
+        if (ok && snapshot.rows(SECTION_SHARDS, shards, shardCount)) {
+            ok = shardCount == 1 && loadShards(decoder, shards[0], fileName);
+        }
+        else {
+            const UserRow* userRows = nullptr;
+            size_t userCount = 0;
+            ok = ok && snapshot.rows(SECTION_USERS, userRows, userCount)
+                && readRows<BookingRecordV6>(snapshot, SECTION_BOOKINGS, widenedBookings, bookingRows, bookingCount);
+            for (size_t i = 0; ok && i < userCount; i++) {
+                users.emplace_back();
+                ok = User::Schema::decode(userRows[i].bytes, users.back(), decoder);
+                if (ok) {
+                    userIndex.insert(static_cast<uint32_t>(users.size() - 1));
+                }
+            }
+            ok = ok && (snapshot.version() == 1 ? loadSnapshotTablesV1(snapshot) : loadSnapshotTables(decoder));
+            for (size_t i = 0; ok && i < bookingCount; i++) {
+                ok = bookingRows[i].userId < users.size();
+            }
+        }
+        const WaitlistEntry* waitRows = nullptr;
+        vector<WaitlistEntry> widenedWaits;
+        size_t waitCount = 0;
+        if (ok && snapshot.version() >= 4) {
+            ok = readRows<WaitlistEntryV6>(snapshot, SECTION_WAITLIST, widenedWaits, waitRows, waitCount);
+        }
+        for (size_t i = 0; ok && i < waitCount; i++) {
+            ok = waitRows[i].userId < users.size() && waitRows[i].priority < Waitlist::PRIORITIES;
+        }
+        if (!ok) {
+            cout << "Snapshot unusable (" << (snapshot.valid() ? string("bad record") : snapshot.errorMessage())
+                << "), importing text files instead.\n";
+            users.clear();
+            trains.clear();
+            routes.clear();
+            userIndex.clear();
+            trainIndex.clear();
+            trainOrder.clear();
+            stationIndex.clear();
+            routeIndex.clear();
+            bookings.clear();
+            return false;
+        }
+        vector<BookingRecord> remappedBookings;
+        vector<WaitlistEntry> remappedWaits;
+        if (userIndex.size() != users.size()) {
+            // Bookings and waiting requests name their user by slot, and the slots move
+            vector<uint32_t> slotOf = dropDuplicateUsers(fileName);
+            if (shardCount == 0) {
+                remappedBookings.assign(bookingRows, bookingRows + bookingCount);
+            }
+            else {
+                bookings.forEachRun([&](const BookingRecord* rows, size_t n) {
+                    remappedBookings.insert(remappedBookings.end(), rows, rows + n);
+                });
+            }
+            for (BookingRecord& booking : remappedBookings) {
+                booking.userId = slotOf[booking.userId];
+            }
+            remappedWaits.assign(waitRows, waitRows + waitCount);
+            for (WaitlistEntry& entry : remappedWaits) {
+                entry.userId = slotOf[entry.userId];
+            }
+            waitRows = remappedWaits.data();
+            if (shardCount == 0) {
+                bookingRows = remappedBookings.data();
+            }
+            else {
+                bookings.assign(remappedBookings.data(), remappedBookings.size(), bookings.nextId);
+            }
+        }
+        if (shardCount == 0) {
+            bookings.assign(bookingRows, bookingCount, snapshot.nextBookingId(), snapshot.version() >= 3);
+        }
+        for (size_t i = 0; i < waitCount; i++) {
+            queueWaiting(waitRows[i]);
+        }
+        for (const char* table : { "users", "trains", "routes", "bookings", "waitlist" }) {
+            baseLsn[table] = snapshot.lsn();
+        }
+        if (storageOptions.verbose) {
+            cerr << "Snapshot loaded: " << users.size() << " users, " << trains.size() << " trains, " << routes.size() << " routes, "
+                << bookings.size() << " bookings.\n";
+        }
+        return true;
+    }
+
+    // Drops the user rows whose username an earlier row already has, reporting
+    // each as malformed, and rebuilds the user index. Returns the new slot of
+    // every old one; a dropped row maps to the earlier row with its name.
+    vector<uint32_t> dropDuplicateUsers(const string& fileName) {
+        vector<uint32_t> slotOf(users.size());
+        deque<User> kept;
+        for (uint32_t slot = 0; slot < users.size(); slot++) {
+            long first = userIndex.find(users[slot].username);
+            if (first >= 0 && static_cast<uint32_t>(first) != slot) {
+                cout << "Skipping malformed user row " << slot + 1 << " in " << fileName << " (duplicate username)\n";
+                slotOf[slot] = slotOf[first];
+                continue;
+            }
+            slotOf[slot] = static_cast<uint32_t>(kept.size());
+            kept.push_back(users[slot]);
+        }
+        users.swap(kept);
+        userIndex.clear();
+        for (uint32_t slot = 0; slot < users.size(); slot++) {
+            userIndex.insert(slot);
+        }
+        return slotOf;
+    }
+
+    // Finds a section of booking or waitlist rows; ones from before version 7 are
+    // widened into scratch
+    template<typename OldRow, typename Row>
+    static bool readRows(const SnapshotReader& snapshot, uint32_t type, vector<Row>& scratch, const Row*& rows, size_t& count) {
+        if (snapshot.version() >= 7) {
+            return snapshot.rows(type, rows, count);
+        }
+        const OldRow* oldRows = nullptr;
+        if (!snapshot.rows(type, oldRows, count)) {
+            return false;
+        }
+        scratch.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            scratch[i] = oldRows[i].widen();
+        }
+        rows = scratch.data();
+        return true;
+    }
+
+    static string shardFileName(const string& fileName, uint64_t generation, size_t shard) {
+        return fileName + "." + to_string(generation) + "." + to_string(shard);
+    }
+
+    // Loads the users, trains and bookings of a sharded snapshot with one thread
+    // per shard file while this thread loads the routes. Every row goes back to
+    // the position it was saved from, so the tables come back in the same order.
+    bool loadShards(SnapshotDecoder& decoder, const ShardsRow& shards, const string& fileName) {
+        if (shards.shardCount == 0 || shards.shardCount > MAX_SNAPSHOT_SHARDS || shards.users > UINT32_MAX || shards.trains > INT32_MAX
+            || shards.bookings > UINT32_MAX || !loadSnapshotStations(decoder)) {
+            return false;
+        }
+        users.resize(static_cast<size_t>(shards.users));
+        trains.resize(static_cast<size_t>(shards.trains));
+        bookings.clear();
+        bookings.extend(static_cast<size_t>(shards.bookings));
+        vector<string> errors(shards.shardCount + 1);
+        vector<array<uint64_t, 3>> rows(shards.shardCount, array<uint64_t, 3>());
+        runOnThreads(shards.shardCount + 1, [&](size_t k) {
+            if (k == shards.shardCount) {
+                errors[k] = loadSnapshotRoutes(decoder) ? "" : "bad route";
+            }
+            else {
+                errors[k] = loadShard(shardFileName(fileName, shards.generation, k), decoder, shards, rows[k]);
+            }
+        });
+        array<uint64_t, 3> total = {};
+        for (size_t k = 0; k < errors.size(); k++) {
+            if (!errors[k].empty()) {
+                cout << "Snapshot shard " << k << ": " << errors[k] << "\n";
+                return false;
+            }
+            for (size_t table = 0; k < rows.size() && table < total.size(); table++) {
+                total[table] += rows[k][table];
+            }
+        }
+        if (total[0] != shards.users || total[1] != shards.trains || total[2] != shards.bookings) {
+            return false;
+        }
+        for (uint32_t slot = 0; slot < users.size(); slot++) {
+            userIndex.insert(slot);
+        }
+        for (uint32_t slot = 0; slot < trains.size(); slot++) {
+            indexTrain(slot);
+        }
+        bookings.nextId = decoder.snapshot.nextBookingId();
+        snapshotGeneration = shards.generation;
+        snapshotShards = shards.shardCount;
+        return true;
+    }
+
+    // Decodes one shard file into the slots made for it; returns what was wrong, if anything
+    string loadShard(const string& fileName, const SnapshotDecoder& main, const ShardsRow& shards, array<uint64_t, 3>& rows) {
+        SnapshotReader shard(fileName);
+        if (!shard.valid()) {
+            return fileName + ": " + shard.errorMessage();
+        }
+        if (shard.lsn() != main.snapshot.lsn()) {
+            return fileName + " belongs to another snapshot";
+        }
+        SnapshotDecoder decoder(shard);
+        decoder.stationIds = main.stationIds;
+        const UserRow* userRows = nullptr;
+        const BookingRecord* bookingRows = nullptr;
+        vector<BookingRecord> widenedBookings;
+        const uint32_t* userPositions = nullptr;
+        const uint32_t* bookingPositions = nullptr;
+        size_t userCount = 0, trainCount = 0, bookingCount = 0, userPositionCount = 0, bookingPositionCount = 0;
+        if (!shard.rows(SECTION_USERS, userRows, userCount) || !shard.rows(SECTION_USER_ROWS, userPositions, userPositionCount)
+            || !shard.rows(SECTION_TRAIN_STOPS, decoder.stopRows, decoder.stopCount)
+            || !readRows<BookingRecordV6>(shard, SECTION_BOOKINGS, widenedBookings, bookingRows, bookingCount)
+            || !shard.rows(SECTION_BOOKING_ROWS, bookingPositions, bookingPositionCount)
+            || userCount != userPositionCount || bookingCount != bookingPositionCount) {
+            return fileName + ": missing section";
+        }
+        for (size_t i = 0; i < userCount; i++) {
+            if (userPositions[i] >= shards.users || !User::Schema::decode(userRows[i].bytes, users[userPositions[i]], decoder)) {
+                return fileName + ": bad user";
+            }
+        }
+        string error = shard.version() >= 7 ? loadShardTrains<TrainRow, Train::Schema>(decoder, shards, trainCount)
+            : loadShardTrains<TrainRowV6, Train::SchemaV6>(decoder, shards, trainCount);
+        if (!error.empty()) {
+            return fileName + ": " + error;
+        }
+        for (size_t i = 0; i < bookingCount; i++) {
+            if (bookingPositions[i] >= shards.bookings || bookingRows[i].userId >= shards.users) {
+                return fileName + ": bad booking";
+            }
+            bookings.put(bookingPositions[i], bookingRows[i]);
+        }
+        rows = { userCount, trainCount, bookingCount };
+        return string();
+    }
+
+    // Decodes a shard's train rows into the slots its train-rows section names;
+    // returns what was wrong, if anything
+    template<typename Row, typename Schema>
+    string loadShardTrains(SnapshotDecoder& decoder, const ShardsRow& shards, size_t& trainCount) {
+        const Row* trainRows = nullptr;
+        const uint32_t* trainPositions = nullptr;
+        size_t positionCount = 0;
+        if (!decoder.snapshot.rows(SECTION_TRAINS, trainRows, trainCount) || !decoder.snapshot.rows(SECTION_TRAIN_ROWS, trainPositions, positionCount)
+            || trainCount != positionCount) {
+            return "missing section";
+        }
+        for (size_t i = 0; i < trainCount; i++) {
+            if (trainPositions[i] >= shards.trains || !Schema::decode(trainRows[i].bytes, trains[trainPositions[i]], decoder)) {
+                return "bad train";
+            }
+        }
+        return string();
+    }
+
+    // Loads trains and routes, translating the snapshot's station numbers into dictionary IDs
+    bool loadSnapshotTables(SnapshotDecoder& decoder) {
+        const SnapshotReader& snapshot = decoder.snapshot;
+        if (!loadSnapshotStations(decoder)) {
+            return false;
+        }
+        if (snapshot.version() < 5) {
+            return (snapshot.version() == 2 ? loadSnapshotTrainsV2(snapshot, decoder.stationIds) : loadSnapshotTrainsV4(snapshot, decoder.stationIds))
+                && loadSnapshotRoutesV4(snapshot, decoder.stationIds);
+        }
+        return (snapshot.version() >= 7 ? loadSnapshotTrains<TrainRow, Train::Schema>(decoder) : loadSnapshotTrains<TrainRowV6, Train::SchemaV6>(decoder))
+            && loadSnapshotRoutes(decoder);
+    }
+
+    template<typename Row, typename Schema>
+    bool loadSnapshotTrains(SnapshotDecoder& decoder) {
+        const Row* trainRows = nullptr;
+        size_t trainCount = 0;
+        if (!decoder.snapshot.rows(SECTION_TRAINS, trainRows, trainCount)
+            || !decoder.snapshot.rows(SECTION_TRAIN_STOPS, decoder.stopRows, decoder.stopCount)) {
+            return false;
+        }
+        for (size_t i = 0; i < trainCount; i++) {
+            trains.emplace_back();
+            if (!Schema::decode(trainRows[i].bytes, trains.back(), decoder)) {
+                return false;
+            }
+            indexTrain(static_cast<uint32_t>(trains.size() - 1));
+        }
+        return true;
+    }
+
+    bool loadSnapshotStations(SnapshotDecoder& decoder) {
+        const StringRef* stationRows = nullptr;
+        size_t stationCount = 0;
+        if (!decoder.snapshot.rows(SECTION_STATIONS, stationRows, stationCount)) {
+            return false;
+        }
+        decoder.stationIds.resize(stationCount);
+        string_view text;
+        for (size_t i = 0; i < stationCount; i++) {
+            if (!decoder.snapshot.text(stationRows[i], text)) {
+                return false;
+            }
+            decoder.stationIds[i] = Stations::intern(text);
+        }
+        return true;
+    }
+
+    bool loadSnapshotRoutes(const SnapshotDecoder& decoder) {
+        const RouteRow* routeRows = nullptr;
+        size_t routeCount = 0;
+        if (!decoder.snapshot.rows(SECTION_ROUTES, routeRows, routeCount)) {
+            return false;
+        }
+        for (size_t i = 0; i < routeCount; i++) {
+            routes.emplace_back();
+            if (!Route::Schema::decode(routeRows[i].bytes, routes.back(), decoder)) {
+                return false;
+            }
+            routeIndex.insert(static_cast<uint32_t>(routes.size() - 1));
+        }
+        return true;
+    }
+
+    bool loadSnapshotRoutesV4(const SnapshotReader& snapshot, const vector<StationId>& stationIds) {
+        const RouteRowV4* routeRows = nullptr;
+        size_t routeCount = 0;
+        if (!snapshot.rows(SECTION_ROUTES, routeRows, routeCount)) {
+            return false;
+        }
+        for (size_t i = 0; i < routeCount; i++) {
+            const RouteRowV4& row = routeRows[i];
+            if (row.source >= stationIds.size() || row.destination >= stationIds.size()) {
+                return false;
+            }
+            routes.emplace_back(row.id, stationIds[row.source], stationIds[row.destination]);
+            routeIndex.insert(static_cast<uint32_t>(routes.size() - 1));
+        }
+        return true;
+    }
+
+    bool loadSnapshotTrainsV4(const SnapshotReader& snapshot, const vector<StationId>& stationIds) {
+        const TrainRowV4* trainRows = nullptr;
+        const uint32_t* stopRows = nullptr;
+        size_t trainCount = 0, stopCount = 0;
+        if (!snapshot.rows(SECTION_TRAINS, trainRows, trainCount) || !snapshot.rows(SECTION_TRAIN_STOPS, stopRows, stopCount)) {
+            return false;
+        }
+        string_view text;
+        vector<StationId> via;
+        for (size_t i = 0; i < trainCount; i++) {
+            const TrainRowV4& row = trainRows[i];
+            if (!snapshot.text(row.name, text) || row.source >= stationIds.size() || row.destination >= stationIds.size() || row.stopCount < 2
+                || row.firstStop > stopCount || row.stopCount > stopCount - row.firstStop) {
+                return false;
+            }
+            via.clear();
+            for (uint32_t k = row.firstStop + 1; k + 1 < row.firstStop + row.stopCount; k++) {
+                if (stopRows[k] >= stationIds.size()) {
+                    return false;
+                }
+                via.push_back(stationIds[stopRows[k]]);
+            }
+            trains.emplace_back();
+            trains.back().id = row.id;
+            trains.back().name.assign(text);
+            trains.back().setRoute(stationIds[row.source], stationIds[row.destination], via, row.capacity);
+            indexTrain(static_cast<uint32_t>(trains.size() - 1));
+        }
+        return true;
+    }
+
+    bool loadSnapshotTrainsV2(const SnapshotReader& snapshot, const vector<StationId>& stationIds) {
+        const TrainRowV2* trainRows = nullptr;
+        size_t trainCount = 0;
+        if (!snapshot.rows(SECTION_TRAINS, trainRows, trainCount)) {
+            return false;
+        }
+        string_view text;
+        for (size_t i = 0; i < trainCount; i++) {
+            const TrainRowV2& row = trainRows[i];
+            if (!snapshot.text(row.name, text) || row.source >= stationIds.size() || row.destination >= stationIds.size()) {
+                return false;
+            }
+            trains.emplace_back(row.id, string(text), stationIds[row.source], stationIds[row.destination], row.seats);
+            trains.back().legacySeats = true;
+            indexTrain(static_cast<uint32_t>(trains.size() - 1));
+        }
+        return true;
+    }
+
+    bool loadSnapshotTablesV1(const SnapshotReader& snapshot) {
+        const TrainRowV1* trainRows = nullptr;
+        const RouteRowV1* routeRows = nullptr;
+        size_t trainCount = 0, routeCount = 0;
+        if (!snapshot.rows(SECTION_TRAINS, trainRows, trainCount) || !snapshot.rows(SECTION_ROUTES, routeRows, routeCount)) {
+            return false;
+        }
+        string_view a, b, c;
+        for (size_t i = 0; i < trainCount; i++) {
+            const TrainRowV1& row = trainRows[i];
+            if (!snapshot.text(row.name, a) || !snapshot.text(row.source, b) || !snapshot.text(row.destination, c)) {
+                return false;
+            }
+            trains.emplace_back(row.id, string(a), Stations::intern(b), Stations::intern(c), row.seats);
+            trains.back().legacySeats = true;
+            indexTrain(static_cast<uint32_t>(trains.size() - 1));
+        }
+        for (size_t i = 0; i < routeCount; i++) {
+            const RouteRowV1& row = routeRows[i];
+            if (!snapshot.text(row.source, a) || !snapshot.text(row.destination, b)) {
+                return false;
+            }
+            routes.emplace_back(row.id, Stations::intern(a), Stations::intern(b));
+            routeIndex.insert(static_cast<uint32_t>(routes.size() - 1));
+        }
+        return true;
+    }
+
+    // Captures every table in a snapshot writer; the caller holds stateMutex exclusively
+    void buildSnapshot(SnapshotWriter& writer) {
+        vector<uint32_t> stopRows;
+        SnapshotEncoder encoder{ writer, stopRows };
+        vector<UserRow> userRows(users.size());
+        for (size_t i = 0; i < users.size(); i++) {
+            User::Schema::encode(userRows[i].bytes, users[i], encoder);
+        }
+        vector<TrainRow> trainRows;
+        trainRows.reserve(trainCount());
+        for (const Train& train : trains) {
+            if (!train.removed) {
+                trainRows.emplace_back();
+                Train::Schema::encode(trainRows.back().bytes, train, encoder);
+            }
+        }
+        addMainSections(writer, encoder);
+        writer.sealStrings();
+        writer.addSection(SECTION_USERS, userRows.data(), userRows.size());
+        writer.addSection(SECTION_TRAINS, trainRows.data(), trainRows.size());
+        writer.addSection(SECTION_TRAIN_STOPS, stopRows.data(), stopRows.size());
+        writer.addSection<BookingRecord>(SECTION_BOOKINGS, nullptr, 0);
+        bookings.forEachRun([&](const BookingRecord* rows, size_t n) {
+            writer.appendRows(rows, n);
+        });
+    }
+
+    // As above, but users with their bookings and trains go to the shard writers,
+    // which are filled in parallel, and writer gets the shards section
+    void buildSnapshot(SnapshotWriter& writer, vector<SnapshotWriter>& shards, uint64_t generation) {
+        if (shards.empty()) {
+            buildSnapshot(writer);
+            return;
+        }
+        vector<uint32_t> noStops;
+        SnapshotEncoder encoder{ writer, noStops };
+        addMainSections(writer, encoder);
+        writer.sealStrings();
+
+        // Positions of the rows each shard holds: user slots, live trains' rows and ledger positions
+        size_t n = shards.size();
+        vector<uint32_t> userShard(users.size());
+        vector<vector<uint32_t>> userPositions(n), trainSlots(n), trainPositions(n), bookingPositions(n);
+        hash<string> hasher;
+        for (uint32_t slot = 0; slot < users.size(); slot++) {
+            userShard[slot] = static_cast<uint32_t>(hasher(users[slot].username) % n);
+            userPositions[userShard[slot]].push_back(slot);
+        }
+        uint32_t trainRows = 0;
+        for (uint32_t slot = 0; slot < trains.size(); slot++) {
+            if (!trains[slot].removed) {
+                size_t k = static_cast<uint32_t>(trains[slot].id) % n;
+                trainSlots[k].push_back(slot);
+                trainPositions[k].push_back(trainRows++);
+            }
+        }
+        uint32_t pos = 0;
+        bookings.forEachRun([&](const BookingRecord* rows, size_t count) {
+            for (size_t i = 0; i < count; i++) {
+                bookingPositions[userShard[rows[i].userId]].push_back(pos++);
+            }
+        });
+        ShardsRow shardsRow = { generation, static_cast<uint32_t>(n), 0, users.size(), trainRows, pos };
+        writer.addSection(SECTION_SHARDS, &shardsRow, 1);
+
+        runOnThreads(n, [&](size_t k) {
+            SnapshotWriter& shard = shards[k];
+            vector<uint32_t> stopRows;
+            SnapshotEncoder shardEncoder{ shard, stopRows };
+            vector<UserRow> userRows(userPositions[k].size());
+            for (size_t i = 0; i < userRows.size(); i++) {
+                User::Schema::encode(userRows[i].bytes, users[userPositions[k][i]], shardEncoder);
+            }
+            vector<TrainRow> trainRows(trainSlots[k].size());
+            for (size_t i = 0; i < trainRows.size(); i++) {
+                Train::Schema::encode(trainRows[i].bytes, trains[trainSlots[k][i]], shardEncoder);
+            }
+            shard.sealStrings();
+            shard.addSection(SECTION_USERS, userRows.data(), userRows.size());
+            shard.addSection(SECTION_USER_ROWS, userPositions[k].data(), userPositions[k].size());
+            shard.addSection(SECTION_TRAINS, trainRows.data(), trainRows.size());
+            shard.addSection(SECTION_TRAIN_ROWS, trainPositions[k].data(), trainPositions[k].size());
+            shard.addSection(SECTION_TRAIN_STOPS, stopRows.data(), stopRows.size());
+            shard.addSection<BookingRecord>(SECTION_BOOKINGS, nullptr, 0);
+            for (uint32_t position : bookingPositions[k]) {
+                shard.appendRows(&bookings.at(position), 1);
+            }
+            shard.addSection(SECTION_BOOKING_ROWS, bookingPositions[k].data(), bookingPositions[k].size());
+        });
+    }
+
+    // The sections that stay in the main file of a sharded snapshot: the station dictionary, routes and waitlists
+    void addMainSections(SnapshotWriter& writer, SnapshotEncoder& encoder) {
+        vector<StringRef> stationRows(Stations::count());
+        for (StationId id = 0; id < stationRows.size(); id++) {
+            stationRows[id] = writer.intern(Stations::name(id));
+        }
+        vector<RouteRow> routeRows;
+        routeRows.reserve(routeCount());
+        for (const Route& route : routes) {
+            if (!route.removed) {
+                routeRows.emplace_back();
+                Route::Schema::encode(routeRows.back().bytes, route, encoder);
+            }
+        }
+        vector<WaitlistEntry> waitRows;
+        forEachWaiting([&](const WaitlistEntry& entry) {
+            waitRows.push_back(entry);
+            waitRows.back().reserved = 0;
+        });
+        writer.addSection(SECTION_STATIONS, stationRows.data(), stationRows.size());
+        writer.addSection(SECTION_ROUTES, routeRows.data(), routeRows.size());
+        writer.addSection(SECTION_WAITLIST, waitRows.data(), waitRows.size());
+    }
+
+    // Writes the shard files in parallel, then the main file that names them, so
+    // a crash part-way still leaves the previous snapshot whole
+    static bool writeSnapshot(const string& fileName, SnapshotWriter& writer, vector<SnapshotWriter>& shards, uint64_t generation,
+        uint64_t lsn, uint64_t nextBookingId) {
+        vector<char> written(shards.size(), 0);
+        runOnThreads(shards.size(), [&](size_t k) {
+            written[k] = shards[k].writeTo(shardFileName(fileName, generation, k), lsn, nextBookingId);
+        });
+        return find(written.begin(), written.end(), 0) == written.end() && writer.writeTo(fileName, lsn, nextBookingId);
+    }
+
+    // Brings the .txt files up to date and records which journal records they contain.
+    // Only what changed since the last export is written: new rows are appended and
+    // synced, and a changed trains or routes table is rewritten through a temporary file.
+    void exportText(bool verbose) {
+        lock_guard<mutex> checkpointLock(checkpointMutex);
+        TextLines data[TextFilesState::TABLES];
+        bool rewrite[TextFilesState::TABLES];
+        uint64_t lsn;
+        {
+            unique_lock<shared_mutex> lock(stateMutex);
+            for (int i = 0; i < TextFilesState::TABLES; i++) {
+                rewrite[i] = textFiles.stale[i];
+                size_t from = rewrite[i] ? 0 : textFiles.rows[i];
+                switch (i) {
+                case TextFilesState::STATIONS:
+                    data[i] = serializeStations(from);
+                    break;
+                case TextFilesState::USERS:
+                    data[i] = serializeUsers(from);
+                    break;
+                case TextFilesState::TRAINS:
+                    data[i] = rewrite[i] ? serializeTrains() : TextLines();
+                    break;
+                case TextFilesState::ROUTES:
+                    data[i] = rewrite[i] ? serializeRoutes() : TextLines();
+                    break;
+                case TextFilesState::BOOKINGS:
+                    data[i] = serializeBookings(from);
+                    break;
+                case TextFilesState::WAITLIST:
+                    data[i] = rewrite[i] ? serializeWaitlist() : TextLines();
+                    break;
+                }
+                textFiles.rows[i] = from + data[i].count;
+                textFiles.stale[i] = false;
+                if (i == TextFilesState::BOOKINGS) {
+                    // A rewrite shows cancellations as seat 0; an append adds a line for each
+                    if (!rewrite[i]) {
+                        serializeCancellations(data[i], textFiles.cancellations);
+                    }
+                    textFiles.cancellations = bookings.cancelledCount();
+                }
+            }
+            lsn = journal.lastLsnWritten();
+        }
+        // The station dictionary comes first, since the other files name its stations
+        static const char* const tables[TextFilesState::TABLES] = { "stations", "users", "trains", "routes", "bookings", "waitlist" };
+        static const MetricOp saveOps[TextFilesState::TABLES] = { OP_SAVE_STATIONS, OP_SAVE_USERS, OP_SAVE_TRAINS, OP_SAVE_ROUTES,
+            OP_SAVE_BOOKINGS, OP_SAVE_BOOKINGS };
+        for (int i = 0; i < TextFilesState::TABLES; i++) {
+            string fileName = string(tables[i]) + ".txt";
+            if (rewrite[i] || data[i].count > 0) {
+                if (verbose) {
+                    cerr << (rewrite[i] ? "Exporting " : "Appending to ") << fileName << "...\n";
+                }
+                OperationTimer timer(saveOps[i]);
+                if (!(rewrite[i] ? FileHandler::saveToFileAtomic(fileName, data[i]) : FileHandler::appendLines(fileName, data[i]))) {
+                    cout << "Error: could not write " << fileName << "\n";
+                    // This file may hold part of an append and the later ones were never written
+                    unique_lock<shared_mutex> lock(stateMutex);
+                    for (int j = i; j < TextFilesState::TABLES; j++) {
+                        textFiles.stale[j] = true;
+                    }
+                    return;
+                }
+            }
+            // The dictionary needs no LSN; for the rest, record progress per file
+            // so a crash part-way replays as little as possible
+            if (i != TextFilesState::STATIONS && journalMeta.lsnFor(tables[i]) != lsn) {
+                journalMeta.tableLsn[tables[i]] = lsn;
+                journalMeta.save();
+            }
+        }
+    }
+
+    // Records that the .txt files hold every row currently in memory
+    void textFilesHoldTables() {
+        size_t rows[TextFilesState::TABLES] = { Stations::count(), users.size(), trains.size(), routes.size(), bookings.size(), 0 };
+        copy(rows, rows + TextFilesState::TABLES, textFiles.rows);
+        textFiles.cancellations = bookings.cancelledCount();
+    }
+
+    // Replays journal records newer than the base files, then starts a new segment
+    void recoverJournal() {
+        replayFloor = bookings.nextId;
+        uint64_t lastLsn = journalMeta.maxLsn();
+        for (const auto& entry : baseLsn) {
+            lastLsn = max(lastLsn, entry.second);
+        }
+        uint64_t segment = journalMeta.segment;
+        size_t replayed = 0;
+        for (; FileHandler::fileExists(WriteAheadLog::segmentName(segment)); segment++) {
+            ifstream inFile(WriteAheadLog::segmentName(segment), ios::binary);
+            string contents((istreambuf_iterator<char>(inFile)), istreambuf_iterator<char>());
+            size_t start = 0;
+            size_t end;
+            size_t lineNumber = 0;
+            // A record without its trailing newline was torn by a crash and is ignored
+            while ((end = contents.find('\n', start)) != string::npos) {
+                string record = contents.substr(start, end - start);
+                start = end + 1;
+                lineNumber++;
+                size_t opStart = record.find(' ');
+                size_t payloadStart = opStart == string::npos ? string::npos : record.find(' ', opStart + 1);
+                if (payloadStart == string::npos) {
+                    continue;
+                }
+                uint64_t lsn = 0;
+                if (!parseNumber(string_view(record).substr(0, opStart), lsn)) {
+                    continue;
+                }
+                if (!applyJournalRecord(lsn, record.substr(opStart + 1, payloadStart - opStart - 1), record.substr(payloadStart + 1))) {
+                    FileHandler::reportMalformed(WriteAheadLog::segmentName(segment), lineNumber);
+                }
+                lastLsn = max(lastLsn, lsn);
+                replayed++;
+            }
+        }
+        if (replayed > 0 && storageOptions.verbose) {
+            cerr << "Replayed " << replayed << " journal records.\n";
+        }
+        journal.open(segment, lastLsn);
+    }
+
+    // Applies one journal record unless the base files already hold it; false if
+    // its user, train or route does not parse
+    bool applyJournalRecord(uint64_t lsn, const string& op, const string& payload) {
+        if (op == "U") {
+            User user;
+            if (!User::fromString(payload, user)) {
+                return false;
+            }
+            if (lsn > baseLsn["users"]) {
+                insertUser(user);
+            }
+        }
+        else if (op == "T+" || op == "T=") {
+            Train train;
+            if (!Train::fromString(payload, train)) {
+                return false;
+            }
+            if (lsn > baseLsn["trains"]) {
+                putTrain(train);
+            }
+        }
+        else if (op == "T-") {
+            int id;
+            if (!parseNumber(payload, id)) {
+                return false;
+            }
+            if (lsn > baseLsn["trains"]) {
+                eraseTrain(id);
+            }
+        }
+        else if (op == "R+" || op == "R=") {
+            Route route;
+            if (!Route::fromString(payload, route)) {
+                return false;
+            }
+            if (lsn > baseLsn["routes"]) {
+                putRoute(route);
+            }
+        }
+        else if (op == "R-") {
+            int id;
+            if (!parseNumber(payload, id)) {
+                return false;
+            }
+            if (lsn > baseLsn["routes"]) {
+                eraseRoute(id);
+            }
+        }
+        else if (op == "B") {
+            replayBooking(lsn, payload);
+        }
+        else if (op == "W") {
+            WaitlistEntry entry;
+            if (!addWaitlistFromString(payload, entry)) {
+                return false;
+            }
+            if (lsn > baseLsn["waitlist"]) {
+                queueWaiting(entry);
+            }
+        }
+        else if (op == "P") {
+            // A promotion: the waiting request's ticket, then the booking it became
+            size_t comma = payload.find(',');
+            uint64_t ticket = 0;
+            if (comma == string::npos || !parseNumber(string_view(payload).substr(0, comma), ticket)) {
+                return false;
+            }
+            BookingRecord booking = {};
+            if (lsn > baseLsn["waitlist"] && addBookingFromString(payload.substr(comma + 1), &booking, true)) {
+                Waitlist* waitlist = findWaitlist(booking.trainId, booking.travelDay);
+                if (waitlist != nullptr) {
+                    waitlist->popTicket(ticket);
+                }
+            }
+            replayBooking(lsn, payload.substr(comma + 1));
+        }
+        else if (op == "X") {
+            FieldSplitter fields(payload);
+            string_view username, id;
+            uint64_t bookingId;
+            uint32_t pos;
+            if (!fields.next(username) || !fields.next(id) || !parseNumber(id, bookingId)) {
+                return false;
+            }
+            if (lsn > baseLsn["bookings"] && findBooking(username, bookingId, pos)) {
+                releaseBooking(pos);
+            }
+        }
+        return true;
+    }
+
+    void checkpointLoop() {
+        auto last = chrono::steady_clock::now();
+        int32_t calendarDay = currentDay();
+        unique_lock<mutex> lock(wakeMutex);
+        while (!stopping) {
+            checkpointWake.wait_for(lock, chrono::seconds(1));
+            if (stopping) {
+                break;
+            }
+            lock.unlock();
+            compactTables();
+            if (currentDay() != calendarDay) {
+                calendarDay = currentDay();
+                rollCalendars(calendarDay);
+            }
+            lock.lock();
+            bool due = chrono::steady_clock::now() - last >= chrono::seconds(storageOptions.checkpointIntervalSec);
+            size_t journalBytes = journal.size();
+            if (journalBytes > 0 && (due || journalBytes >= storageOptions.checkpointBytes)) {
+                lock.unlock();
+                checkpoint(false);
+                if (storageOptions.mirrorText) {
+                    exportText(false);
+                }
+                last = chrono::steady_clock::now();
+                lock.lock();
+            }
+        }
+    }
+
+    // Writes a snapshot of every table and drops the journal segments it now covers.
+    // Only capturing the tables runs under the state lock; file I/O happens outside it.
+    void checkpoint(bool verbose) {
+        lock_guard<mutex> checkpointLock(checkpointMutex);
+        SnapshotWriter writer;
+        vector<SnapshotWriter> shards(storageOptions.snapshotShards > 1 ? storageOptions.snapshotShards : 0);
+        uint64_t generation = snapshotGeneration + 1;
+        uint64_t lsn;
+        uint64_t nextBookingId;
+        {
+            unique_lock<shared_mutex> lock(stateMutex);
+            buildSnapshot(writer, shards, generation);
+            nextBookingId = bookings.nextId;
+            lsn = journal.rotate();
+        }
+        if (verbose) {
+            cerr << "Saving snapshot...\n";
+        }
+        OperationTimer timer(OP_SAVE_SNAPSHOT);
+        if (!writeSnapshot(snapshotFile(), writer, shards, generation, lsn, nextBookingId)) {
+            cout << "Error: could not write " << snapshotFile() << ", keeping journal.\n";
+            return;
+        }
+        for (size_t k = 0; k < snapshotShards; k++) {
+            remove(shardFileName(snapshotFile(), snapshotGeneration, k).c_str());
+        }
+        snapshotGeneration = generation;
+        snapshotShards = shards.size();
+        journalMeta.tableLsn["snapshot"] = lsn;
+        uint64_t oldSegment = journalMeta.segment;
+        journalMeta.segment = journal.currentSegment();
+        journalMeta.save();
+        for (uint64_t segment = oldSegment; segment < journalMeta.segment; segment++) {
+            remove(WriteAheadLog::segmentName(segment).c_str());
+        }
+        if (verbose) {
+            cerr << "Data saved successfully.\n";
+        }
+    }
+
+    // stations.txt lists one name per line in ID order, so reloading it reproduces the same IDs
+    void loadStations() {
+        OperationTimer timer(OP_LOAD_STATIONS);
+        FileHandler::forEachLine("stations.txt", [&](string_view line, size_t) {
+            Stations::intern(line);
+        });
+    }
+
+    TextLines serializeStations(size_t from = 0) const {
+        TextLines data;
+        for (size_t id = from; id < Stations::count(); id++) {
+            data.addLine(Stations::name(static_cast<StationId>(id)));
+        }
+        return data;
+    }
+
+    void loadUsers() {
+        OperationTimer timer(OP_LOAD_USERS);
+        cout << "Loading user data...\n"; // Debug output
+        User user;
+        FileHandler::forEachLine("users.txt", [&](string_view line, size_t lineNumber) {
+            if (!User::parse(line, user) || findUser(user.username) != nullptr) {
+                FileHandler::reportMalformed("users.txt", lineNumber);
+                return;
+            }
+            users.push_back(user);
+            userIndex.insert(static_cast<uint32_t>(users.size() - 1));
+        });
+        cout << "Number of users loaded: " << users.size() << "\n"; // Debug output
+    }
+
+    TextLines serializeUsers(size_t from = 0) const {
+        TextLines data;
+        for (size_t slot = from; slot < users.size(); slot++) {
+            data.add(users[slot]);
+        }
+        return data;
+    }
+
+    void saveUsers() {
+        OperationTimer timer(OP_SAVE_USERS);
+        TextLines data = serializeUsers();
+        cout << "Saving user data...\n"; // Debug output
+        FileHandler::saveToFile("users.txt", data);
+        cout << "User data saved successfully.\n"; // Debug output
+    }
+    void loadTrains() {
+        OperationTimer timer(OP_LOAD_TRAINS);
+        cout << "Loading train data...\n"; // Debug output
+        Train train;
+        FileHandler::forEachLine("trains.txt", [&](string_view line, size_t lineNumber) {
+            if (!Train::parse(line, train)) {
+                FileHandler::reportMalformed("trains.txt", lineNumber);
+                return;
+            }
+            trains.push_back(train);
+            indexTrain(static_cast<uint32_t>(trains.size() - 1));
+        });
+        cout << "Number of trains loaded: " << trains.size() << "\n"; // Debug output
+    }
+
+    TextLines serializeTrains() const {
+        TextLines data;
+        for (const Train& train : trains) {
+            if (!train.removed) {
+                data.add(train);
+            }
+        }
+        return data;
+    }
+
+    void saveTrains() {
+        OperationTimer timer(OP_SAVE_TRAINS);
+        TextLines data = serializeTrains();
+        cout << "Saving train data...\n"; // Debug output
+        FileHandler::saveToFile("trains.txt", data);
+        cout << "Train data saved successfully.\n"; // Debug output
+    }
+
+    void loadRoutes() {
+        OperationTimer timer(OP_LOAD_ROUTES);
+        cout << "Loading route data...\n"; // Debug output
+        Route route;
+        FileHandler::forEachLine("routes.txt", [&](string_view line, size_t lineNumber) {
+            if (!Route::parse(line, route)) {
+                FileHandler::reportMalformed("routes.txt", lineNumber);
+                return;
+            }
+            routes.push_back(route);
+            routeIndex.insert(static_cast<uint32_t>(routes.size() - 1));
+        });
+        cout << "Number of routes loaded: " << routes.size() << "\n"; // Debug output
+    }
+
+    TextLines serializeRoutes() const {
+        TextLines data;
+        for (const Route& route : routes) {
+            if (!route.removed) {
+                data.add(route);
+            }
+        }
+        return data;
+    }
+
+    void saveRoutes() {
+        OperationTimer timer(OP_SAVE_ROUTES);
+        TextLines data = serializeRoutes();
+        cout << "Saving route data...\n"; // Debug output
+        FileHandler::saveToFile("routes.txt", data);
+        cout << "Route data saved successfully.\n"; // Debug output
+    }
+
+    // Reads one booking per line: bookingId,username,trainId,seat,timestamp.
+    // Lines in the old "username:train;train;..." format are still accepted.
+    void loadBookings() {
+        OperationTimer timer(OP_LOAD_BOOKINGS);
+        cout << "Loading booking data...\n"; // Debug output
+        Train train;
+        FileHandler::forEachLine("bookings.txt", [&](string_view line, size_t lineNumber) {
+            if (line.substr(0, 2) == "X,") {
+                if (!cancelFromText(line.substr(2))) {
+                    FileHandler::reportMalformed("bookings.txt", lineNumber);
+                }
+                return;
+            }
+            if (line.find(':') == string_view::npos) {
+                if (!addBookingFromString(line)) {
+                    FileHandler::reportMalformed("bookings.txt", lineNumber);
+                }
+                return;
+            }
+            textFiles.stale[TextFilesState::BOOKINGS] = true; // rewrite in the current format
+            FieldSplitter entries(line);
+            string_view username, trainStr;
+            entries.next(username, ':');
+            long userId = userIndex.find(username);
+            if (userId < 0) {
+                FileHandler::reportMalformed("bookings.txt", lineNumber);
+                return;
+            }
+            while (entries.next(trainStr, ';')) {
+                if (trainStr.empty()) {
+                    continue;
+                }
+                if (!Train::parse(trainStr, train)) {
+                    FileHandler::reportMalformed("bookings.txt", lineNumber);
+                    continue;
+                }
+                // The copy's seat count was a running count, which repeats after
+                // cancellations, so the seat is reserved when the seats are rebuilt
+                BookingRecord booking;
+                if (!bookings.add(booking, static_cast<uint32_t>(userId), train.id, BookingRecord::SEAT_TO_ASSIGN, 0)) {
+                    FileHandler::reportMalformed("bookings.txt", lineNumber);
+                }
+            }
+        });
+        cout << "Number of bookings loaded: " << bookings.size() << "\n"; // Debug output
+    }
+
+    // Adds a journaled booking and takes its seat. An export that crashed before
+    // moving the LSN may have appended it already.
+    void replayBooking(uint64_t lsn, string_view payload) {
+        uint64_t id = 0;
+        parseNumber(payload.substr(0, payload.find(',')), id);
+        BookingRecord booking = {};
+        if (lsn <= baseLsn["bookings"] || id < replayFloor || !addBookingFromString(payload, &booking)) {
+            return;
+        }
+        Train* train = findTrain(booking.trainId);
+        SeatInventory* seats = train != nullptr && booking.seat != 0 ? train->seatsOn(booking.travelDay) : nullptr;
+        if (seats != nullptr) {
+            int fromStop, toStop;
+            train->legFor(booking, fromStop, toStop);
+            seats->take(booking.seat, fromStop, toStop);
+        }
+    }
+
+    // Parses bookingId,username,trainId,seat,timestamp[,fromStop,toStop[,date]] into the
+    // ledger, or only into *added if parseOnly; false if the line is malformed or
+    // names an unknown user. Seat 0 marks a cancelled booking.
+    // Older lines end at the timestamp and cover the whole journey.
+    bool addBookingFromString(string_view line, BookingRecord* added = nullptr, bool parseOnly = false) {
+        BookingRecord booking = {};
+        if (!BookingRecord::Schema::parseText(line, booking, *this)) {
+            return false;
+        }
+        if (!parseOnly && !bookings.add(booking, booking.userId, booking.trainId, booking.seat, booking.timestamp, booking.id, booking.fromStop,
+            booking.toStop, booking.travelDay)) {
+            return false;
+        }
+        if (added != nullptr) {
+            *added = booking;
+        }
+        return true;
+    }
+
+    // Rebuilds a train's seat maps from its bookings in the ledger and returns how
+    // many bookings did not fit (seat out of range or already taken on that leg).
+    // Seat numbers from old files came from a running count, so a booking without
+    // one, or one whose seat is taken on a train from an old file, gets the seat
+    // the inventory reserves for it once every other seat is held.
+    size_t rebuildSeats(Train& train) {
+        vector<uint32_t> positions = bookings.forTrain(train.id);
+        vector<uint32_t> unseated;
+        bool legacy = train.legacySeats;
+        int capacity = train.capacity();
+        if (train.legacySeats) {
+            capacity += static_cast<int>(positions.size()); // the count was seats left after these bookings
+            train.legacySeats = false;
+            textFiles.stale[TextFilesState::TRAINS] = true;
+        }
+        train.inventory.reset(capacity, train.segmentCount());
+        train.runs.clear(currentDay());
+        size_t conflicts = 0;
+        for (uint32_t pos : positions) {
+            const BookingRecord& booking = bookings.at(pos);
+            SeatInventory* seats = booking.seat != 0 ? train.seatsOn(booking.travelDay) : nullptr;
+            if (seats == nullptr) {
+                continue; // cancelled, for a run that has passed, or made before the train had a schedule
+            }
+            int fromStop, toStop;
+            train.legFor(booking, fromStop, toStop);
+            if (booking.seat != BookingRecord::SEAT_TO_ASSIGN && seats->take(booking.seat, fromStop, toStop)) {
+                continue;
+            }
+            if (booking.seat == BookingRecord::SEAT_TO_ASSIGN || legacy) {
+                unseated.push_back(pos);
+            }
+            else {
+                conflicts++;
+            }
+        }
+        for (uint32_t pos : unseated) {
+            const BookingRecord& booking = bookings.at(pos);
+            int fromStop, toStop, seat;
+            train.legFor(booking, fromStop, toStop);
+            if (train.seatsOn(booking.travelDay)->reserve(fromStop, toStop, seat)) {
+                bookings.setSeat(pos, seat);
+                textFiles.stale[TextFilesState::BOOKINGS] = true;
+            }
+            else {
+                conflicts++;
+            }
+        }
+        train.materializeRuns(currentDay());
+        return conflicts;
+    }
+
+    // Trains are split across threads unless some come from old files, whose
+    // fix-up marks the trains file stale
+    void rebuildAllSeats() {
+        retireSeatMaps();
+        bool legacy = any_of(trains.begin(), trains.end(), [](const Train& train) { return train.legacySeats; });
+        size_t workers = legacy || trains.size() < 64 ? 1 : min<size_t>(max(1u, thread::hardware_concurrency()), 16);
+        vector<size_t> workerConflicts(workers, 0);
+        runOnThreads(workers, [&](size_t w) {
+            for (size_t slot = w; slot < trains.size(); slot += workers) {
+                workerConflicts[w] += trains[slot].removed ? 0 : rebuildSeats(trains[slot]);
+            }
+        });
+        size_t conflicts = accumulate(workerConflicts.begin(), workerConflicts.end(), size_t(0));
+        if (conflicts > 0) {
+            cout << "Warning: " << conflicts << " booking(s) do not fit their train's seats.\n";
+        }
+    }
+
+    // Schema context for bookings and waitlist entries, which name their user
+    const string& userName(uint32_t slot) const {
+        return users[slot].username;
+    }
+
+    long userSlot(string_view username) const {
+        return userIndex.find(username);
+    }
+
+    string bookingToString(const BookingRecord& booking) const {
+        string line;
+        BookingRecord::Schema::appendText(line, booking, *this);
+        return line;
+    }
+
+    // Bookings from ledger position from onward
+    // Folds in an appended "X,username,bookingId" line, which follows its booking;
+    // seats are built after loading, so only the ledger changes
+    bool cancelFromText(string_view payload) {
+        FieldSplitter fields(payload);
+        string_view username, id;
+        uint64_t bookingId;
+        uint32_t pos;
+        if (!fields.next(username) || !fields.next(id) || !parseNumber(id, bookingId) || !findBooking(username, bookingId, pos)) {
+            return false;
+        }
+        bookings.cancel(pos);
+        return true;
+    }
+
+    // Adds the cancellations from position from of the ledger's cancel log as
+    // "X,username,bookingId" lines, so an export need not rewrite bookings.txt
+    void serializeCancellations(TextLines& data, size_t from) const {
+        string line;
+        for (size_t i = from; i < bookings.cancelledCount(); i++) {
+            const BookingRecord& booking = bookings.at(bookings.cancelledAt(i));
+            line = "X," + users[booking.userId].username + "," + to_string(booking.id);
+            data.addLine(line);
+        }
+    }
+
+    TextLines serializeBookings(size_t from = 0) const {
+        TextLines data;
+        if (from == 0) {
+            data.text.reserve(bookings.size() * 48);
+            bookings.forEachRun([&](const BookingRecord* rows, size_t n) {
+                for (size_t i = 0; i < n; i++) {
+                    data.add(rows[i], *this);
+                }
+            });
+            return data;
+        }
+        for (size_t pos = from; pos < bookings.size(); pos++) {
+            data.add(bookings.at(static_cast<uint32_t>(pos)), *this);
+        }
+        return data;
+    }
+
+    // waitlist.txt holds ticket,username,trainId,fromStop,toStop,priority,timestamp
+    // per line, in the order the requests will be served
+    string waitlistEntryToString(const WaitlistEntry& entry) const {
+        string line;
+        WaitlistEntry::Schema::appendText(line, entry, *this);
+        return line;
+    }
+
+    bool addWaitlistFromString(string_view line, WaitlistEntry& entry) {
+        return WaitlistEntry::Schema::parseText(line, entry, *this) && entry.priority < Waitlist::PRIORITIES;
+    }
+
+    void loadWaitlist() {
+        OperationTimer timer(OP_LOAD_BOOKINGS);
+        WaitlistEntry entry;
+        FileHandler::forEachLine("waitlist.txt", [&](string_view line, size_t lineNumber) {
+            if (!addWaitlistFromString(line, entry)) {
+                FileHandler::reportMalformed("waitlist.txt", lineNumber);
+                return;
+            }
+            queueWaiting(entry);
+        });
+    }
+
+    TextLines serializeWaitlist() {
+        TextLines data;
+        forEachWaiting([&](const WaitlistEntry& entry) {
+            data.add(entry, *this);
+        });
+        return data;
+    }
+
+    void saveBookings() {
+        OperationTimer timer(OP_SAVE_BOOKINGS);
+        TextLines data = serializeBookings();
+        cout << "Saving booking data...\n"; // Debug output
+        FileHandler::saveToFile("bookings.txt", data);
+        cout << "Booking data saved successfully.\n"; // Debug output
+    }
+
+
+    User* findUser(const string& username) {
+        OperationTimer timer(OP_FIND_USER, 64);
+        long slot = userIndex.find(username);
+        return slot < 0 ? nullptr : &users[slot];
+    }
+
+    Train* findTrain(int trainId) {
+        OperationTimer timer(OP_FIND_TRAIN, 64);
+        long slot = trainIndex.find(trainId);
+        return slot < 0 ? nullptr : &trains[slot];
+    }
+
+    Route* findRoute(int routeId) {
+        OperationTimer timer(OP_FIND_ROUTE, 64);
+        long slot = routeIndex.find(routeId);
+        return slot < 0 ? nullptr : &routes[slot];
+    }
+
+    bool insertUser(const User& user) {
+        if (findUser(user.username) != nullptr) {
+            return false;
+        }
+        users.push_back(user);
+        userIndex.insert(static_cast<uint32_t>(users.size() - 1));
+        layoutVersion++;
+        stateVersion++;
+        return true;
+    }
+
+    // Trains or routes changed, so the read views' layout is stale; callers
+    // that change a train's stops or a route also tell the planner
+    void tablesChanged() {
+        layoutVersion++;
+        stateVersion++;
+    }
+
+    // Seat maps are about to be reset, dropped or moved: stale the layout that
+    // points at them and wait out a refresh that may still be reading them. The
+    // caller holds stateMutex exclusively.
+    void retireSeatMaps() {
+        layoutVersion++;
+        stateVersion++;
+        while (seatsInUse.load()) {
+            this_thread::yield();
+        }
+    }
+
+    // Marks a change to seats, the ledger or the tables for read views, which
+    // retake any view taken while one was in progress. While a refresh holds the
+    // gate, a new change backs out and waits for it.
+    class WriteScope {
+    private:
+        RailwayManagementSystem& rms;
+
+    public:
+        explicit WriteScope(RailwayManagementSystem& owner) : rms(owner) {
+            while (true) {
+                rms.writesBegun.fetch_add(1); // acquire: the change cannot start before it
+                if (!rms.viewGate.load()) {
+                    return;
+                }
+                rms.writesEnded.fetch_add(1);
+                while (rms.viewGate.load()) {
+                    this_thread::yield();
+                }
+            }
+        }
+
+        ~WriteScope() {
+            rms.writesEnded.fetch_add(1);
+        }
+    };
+
+    bool viewIsCurrent(const ReadView* current) const {
+        return current->stateVersion == stateVersion.load() && current->ledgerVersion == bookings.version();
+    }
+
+    // Copies the live trains and routes and sizes the tables; the caller holds
+    // stateMutex, or is the constructor
+    TableLayout* buildLayout() {
+        TableLayout* layout = new TableLayout();
+        layout->version = layoutVersion.load();
+        vector<int32_t> positionOfSlot(trains.size(), -1);
+        layout->trains.reserve(trainCount());
+        for (size_t slot = 0; slot < trains.size(); slot++) {
+            const Train& train = trains[slot];
+            if (!train.removed) {
+                positionOfSlot[slot] = static_cast<int32_t>(layout->trains.size());
+                layout->positionOf.emplace(train.id, positionOfSlot[slot]);
+                int32_t nextRun = train.schedule.nextRun(currentDay());
+                const SeatInventory* seats = !train.schedule.dated() ? &train.inventory : nextRun >= 0 ? trains[slot].seatsOn(nextRun) : nullptr;
+                layout->trains.push_back(TrainInfo{ seats, train.id, train.name, train.source, train.destination, train.stops, train.capacity(),
+                    train.schedule });
+            }
+        }
+        layout->byId.reserve(layout->trains.size());
+        trainOrder.forRange(INT32_MIN, INT32_MAX, [&](int, uint32_t slot) {
+            layout->byId.push_back(static_cast<uint32_t>(positionOfSlot[slot]));
+        });
+        layout->routes.reserve(routeCount());
+        for (const Route& route : routes) {
+            if (!route.removed) {
+                layout->routes.push_back(route);
+            }
+        }
+        layout->userCount = users.size();
+        layout->bookingCount = bookings.size();
+        tableMemory(layout->memory);
+        return layout;
+    }
+
+    // Fills next from a layout and the live seat counts; false if the layout is
+    // stale or a write overlapped, in which case next is not a consistent cut
+    bool takeView(const TableLayout* layout, ReadView& next) {
+        uint64_t ended = writesEnded.load();
+        if (writesBegun.load() != ended) {
+            return false; // a write is under way; no use starting
+        }
+        seatsInUse.store(true);
+        if (layout->version != layoutVersion.load()) {
+            seatsInUse.store(false);
+            return false;
+        }
+        next.layout = layout;
+        next.stateVersion = stateVersion.load();
+        next.ledgerVersion = bookings.version();
+        next.userCount = layout->userCount;
+        bookings.counts(next.bookingCount, next.cancelledCount);
+        next.available.resize(layout->trains.size());
+        next.capacity = next.remaining = 0;
+        for (size_t i = 0; i < layout->trains.size(); i++) {
+            const TrainInfo& train = layout->trains[i];
+            next.available[i] = train.seats != nullptr ? train.seats->wholeJourneyFree() : 0;
+            next.capacity += train.capacity;
+            next.remaining += next.available[i];
+        }
+        seatsInUse.store(false);
+        // A read-modify-write rather than a load, so the reads above cannot move past it
+        if (writesBegun.fetch_add(0) != ended) {
+            return false;
+        }
+        // Bookings since the layout was built grow the indexes by about two positions each
+        copy(layout->memory, layout->memory + 5, next.memory);
+        next.memory[3] += bookings.recordMemory() + (next.bookingCount - min(next.bookingCount, layout->bookingCount)) * 2 * sizeof(uint32_t);
+        return true;
+    }
+
+    // The latest read view, refreshed first if anything changed since it was
+    // taken, so it is never older than the call; the caller keeps epochs pinned
+    // while it uses the view. A refresh takes no lock unless the tables changed,
+    // and then only shares the state lock to copy them. The seat counts are read
+    // between writes; after ATTEMPTS tries that each overlapped one, the refresh
+    // holds new writes back (see WriteScope) for the one pass it needs.
+    const ReadView& readView() {
+        static const int ATTEMPTS = 8;
+        const ReadView* current = view.load();
+        if (viewIsCurrent(current)) {
+            return *current;
+        }
+        lock_guard<mutex> refreshLock(viewMutex);
+        current = view.load();
+        if (viewIsCurrent(current)) {
+            return *current;
+        }
+        const TableLayout* layout = current->layout;
+        unique_ptr<TableLayout> built;
+        unique_ptr<ReadView> next(new ReadView());
+        for (int attempt = 1;; attempt++) {
+            if (layout->version != layoutVersion.load()) {
+                shared_lock<shared_mutex> lock(stateMutex);
+                built.reset(buildLayout());
+                layout = built.get();
+            }
+            bool gated = attempt > ATTEMPTS;
+            if (gated) {
+                viewGate.store(true);
+                while (writesBegun.load() != writesEnded.load()) {
+                    this_thread::yield();
+                }
+            }
+            bool taken = takeView(layout, *next);
+            if (gated) {
+                viewGate.store(false);
+            }
+            if (taken) {
+                break;
+            }
+            this_thread::yield();
+        }
+        built.release();
+        view.store(next.get());
+        epochs.retire(current);
+        if (current->layout != layout) {
+            epochs.retire(current->layout);
+        }
+        return *next.release();
+    }
+
+    // One waitlist per train and run date; undated trains wait on day 0
+    static uint64_t waitlistKey(int trainId, int32_t day) {
+        return static_cast<uint64_t>(static_cast<uint32_t>(trainId)) << 32 | static_cast<uint32_t>(day);
+    }
+
+    Waitlist& waitlistFor(int trainId, int32_t day) {
+        lock_guard<mutex> lock(waitlistsMutex);
+        unique_ptr<Waitlist>& waitlist = waitlists[waitlistKey(trainId, day)];
+        if (!waitlist) {
+            waitlist.reset(new Waitlist());
+        }
+        return *waitlist;
+    }
+
+    Waitlist* findWaitlist(int trainId, int32_t day) {
+        lock_guard<mutex> lock(waitlistsMutex);
+        auto it = waitlists.find(waitlistKey(trainId, day));
+        return it == waitlists.end() ? nullptr : it->second.get();
+    }
+
+    // Appends a loaded or replayed request to its train run's waitlist
+    void queueWaiting(const WaitlistEntry& entry) {
+        waitlistFor(entry.trainId, entry.travelDay).push(entry, [](size_t) {});
+        uint64_t next = nextTicket.load();
+        while (next <= entry.ticket && !nextTicket.compare_exchange_weak(next, entry.ticket + 1)) {
+        }
+    }
+
+    // Calls fn(entry) for every waiting request, train by train in ID order and
+    // each train's runs by date
+    template<typename Fn>
+    void forEachWaiting(Fn fn) {
+        vector<pair<pair<int, int32_t>, Waitlist*>> lists;
+        {
+            lock_guard<mutex> lock(waitlistsMutex);
+            for (const auto& entry : waitlists) {
+                lists.push_back({ { static_cast<int32_t>(entry.first >> 32), static_cast<int32_t>(entry.first) }, entry.second.get() });
+            }
+        }
+        sort(lists.begin(), lists.end());
+        for (const auto& list : lists) {
+            list.second->forEach(fn);
+        }
+    }
+
+    // Seats a run's waiting requests in order until one does not fit, so the
+    // cost is O(promoted); the caller holds stateMutex exclusively
+    size_t promoteWaiting(Train& train, int32_t day) {
+        Waitlist* waitlist = findWaitlist(train.id, day);
+        if (train.schedule.dated() && !train.bookable(day)) {
+            return 0; // the run has passed or was dropped from the schedule
+        }
+        size_t promoted = 0;
+        WaitlistEntry entry;
+        while (waitlist != nullptr && waitlist->front(entry)) {
+            int fromStop = entry.fromStop, toStop = entry.toStop, seat;
+            train.clampLeg(fromStop, toStop);
+            if (!train.reserveSeat(day, fromStop, toStop, seat)) {
+                break;
+            }
+            BookingRecord booking;
+            if (!bookings.add(booking, entry.userId, train.id, seat, static_cast<int64_t>(time(nullptr)), 0, fromStop, toStop, day)) {
+                train.seatsOn(day)->release(seat, fromStop, toStop);
+                break;
+            }
+            waitlist->popTicket(entry.ticket);
+            journal.append("P", to_string(entry.ticket) + "," + bookingToString(booking));
+            promoted++;
+        }
+        if (promoted > 0) {
+            textFiles.stale[TextFilesState::WAITLIST] = true;
+        }
+        return promoted;
+    }
+
+    // As above for every run of the train with a waitlist
+    size_t promoteWaiting(Train& train) {
+        vector<int32_t> days;
+        {
+            lock_guard<mutex> lock(waitlistsMutex);
+            for (const auto& entry : waitlists) {
+                if (static_cast<int32_t>(entry.first >> 32) == train.id) {
+                    days.push_back(static_cast<int32_t>(entry.first));
+                }
+            }
+        }
+        sort(days.begin(), days.end());
+        size_t promoted = 0;
+        for (int32_t day : days) {
+            promoted += promoteWaiting(train, day);
+        }
+        return promoted;
+    }
+
+    bool findBooking(string_view username, uint64_t bookingId, uint32_t& pos) {
+        long userId = userIndex.find(username);
+        if (userId < 0) {
+            return false;
+        }
+        for (uint32_t candidate : bookings.forUser(static_cast<uint32_t>(userId))) {
+            if (bookings.at(candidate).id == bookingId) {
+                pos = candidate;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Marks a booking cancelled and frees its seat; the caller holds stateMutex exclusively
+    void releaseBooking(uint32_t pos) {
+        BookingRecord booking = bookings.at(pos);
+        if (!bookings.cancel(pos)) {
+            return;
+        }
+        Train* train = findTrain(booking.trainId);
+        SeatInventory* seats = train != nullptr ? train->seatsOn(booking.travelDay) : nullptr;
+        if (seats != nullptr) {
+            int fromStop, toStop;
+            train->legFor(booking, fromStop, toStop);
+            seats->release(booking.seat, fromStop, toStop);
+        }
+    }
+
+    // Inserts the train or overwrites the one with the same ID
+    void putTrain(const Train& value) {
+        tablesChanged();
+        textFiles.stale[TextFilesState::TRAINS] = true;
+        Train* train = findTrain(value.id);
+        if (train != nullptr) {
+            retireSeatMaps();
+            stationIndex.remove(*train);
+            fares.invalidate(value.id);
+            *train = value;
+            stationIndex.add(*train);
+            rebuildSeats(*train);
+            planner.trainChanged(*train);
+            return;
+        }
+        trains.push_back(value);
+        indexTrain(static_cast<uint32_t>(trains.size() - 1));
+        rebuildSeats(trains.back());
+        planner.trainChanged(trains.back());
+    }
+
+    // Tombstones the train in place, so other slots and pointers stay valid, and
+    // cancels its bookings; the cancellations replay with the removal, and a later
+    // train with the same ID cannot inherit them. Returns the bookings cancelled,
+    // or -1 if there is no such train.
+    long eraseTrain(int id) {
+        long slot = trainIndex.find(id);
+        if (slot < 0) {
+            return -1;
+        }
+        trainIndex.erase(id);
+        trainOrder.erase(id);
+        fares.invalidate(id);
+        trains[slot].removed = true;
+        removedTrains++;
+        {
+            lock_guard<mutex> lock(waitlistsMutex);
+            for (auto it = waitlists.begin(); it != waitlists.end();) {
+                if (static_cast<int32_t>(it->first >> 32) == id) {
+                    it = waitlists.erase(it);
+                    textFiles.stale[TextFilesState::WAITLIST] = true;
+                }
+                else {
+                    ++it;
+                }
+            }
+        }
+        long cancelled = 0;
+        for (uint32_t pos : bookings.forTrain(id)) {
+            cancelled += bookings.cancel(pos) ? 1 : 0;
+        }
+        tablesChanged();
+        planner.trainRemoved(id);
+        textFiles.stale[TextFilesState::TRAINS] = true;
+        return cancelled;
+    }
+
+    size_t trainCount() const {
+        return trains.size() - removedTrains;
+    }
+
+    size_t routeCount() const {
+        return routes.size() - removedRoutes;
+    }
+
+    // Slides live records down over tombstones, keeping their order; returns the
+    // slots reclaimed
+    template<typename Record>
+    static size_t compactTable(deque<Record>& table) {
+        size_t kept = 0;
+        for (size_t i = 0; i < table.size(); i++) {
+            if (table[i].removed) {
+                continue;
+            }
+            if (kept != i) {
+                table[kept] = move(table[i]);
+            }
+            kept++;
+        }
+        size_t reclaimed = table.size() - kept;
+        table.erase(table.begin() + kept, table.end());
+        table.shrink_to_fit();
+        return reclaimed;
+    }
+
+    bool compactionDue(bool force) const {
+        return (removedTrains > 0 && (force || removedTrains * 4 >= trains.size()))
+            || (removedRoutes > 0 && (force || removedRoutes * 4 >= routes.size()));
+    }
+
+    // Moves every scheduled train's calendar on to today, making the seat maps for
+    // the runs now within the materialized days, and drops the waitlists of runs
+    // that have passed. Run at startup and by the checkpointer when the date changes.
+    void rollCalendars(int32_t today) {
+        unique_lock<shared_mutex> lock(stateMutex);
+        WriteScope write(*this);
+        retireSeatMaps();
+        for (Train& train : trains) {
+            if (!train.removed && train.schedule.dated()) {
+                train.runs.roll(today);
+                train.materializeRuns(today);
+            }
+        }
+        {
+            lock_guard<mutex> waitLock(waitlistsMutex);
+            for (auto it = waitlists.begin(); it != waitlists.end();) {
+                int32_t day = static_cast<int32_t>(it->first);
+                if (day != 0 && day < today) {
+                    it = waitlists.erase(it);
+                    textFiles.stale[TextFilesState::WAITLIST] = true;
+                }
+                else {
+                    ++it;
+                }
+            }
+        }
+        stateVersion++;
+    }
+
+    // Reclaims tombstoned slots once they are a quarter of their table (or any,
+    // if forced) and rebuilds the slot indexes, so a removal costs O(1) amortized.
+    // Run by the checkpointer; slots move, so it takes the state lock exclusively.
+    size_t compactTables(bool force = false) {
+        {
+            shared_lock<shared_mutex> lock(stateMutex);
+            if (!compactionDue(force)) {
+                return 0;
+            }
+        }
+        unique_lock<shared_mutex> lock(stateMutex);
+        if (!compactionDue(force)) {
+            return 0;
+        }
+        OperationTimer timer(OP_COMPACT_TABLES);
+        WriteScope write(*this);
+        size_t reclaimed = 0;
+        if (removedTrains > 0) {
+            retireSeatMaps();
+            reclaimed += compactTable(trains);
+            removedTrains = 0;
+            trainIndex.rebuild();
+            trainOrder.clear();
+            stationIndex.clear();
+            for (uint32_t slot = 0; slot < trains.size(); slot++) {
+                trainOrder.insert(trains[slot].id, slot);
+                stationIndex.add(trains[slot]);
+            }
+        }
+        if (removedRoutes > 0) {
+            reclaimed += compactTable(routes);
+            removedRoutes = 0;
+            routeIndex.rebuild();
+        }
+        tablesChanged(); // the read views' layout points into the moved slots
+        return reclaimed;
+    }
+
+    // Interns a ';'-separated list of intermediate stops
+    static vector<StationId> parseStops(const string& via) {
+        vector<StationId> stops;
+        FieldSplitter fields(via);
+        string_view stop;
+        while (fields.next(stop, ';')) {
+            if (!stop.empty()) {
+                stops.push_back(Stations::intern(stop));
+            }
+        }
+        return stops;
+    }
+
+    void indexTrain(uint32_t slot) {
+        trainIndex.insert(slot);
+        trainOrder.insert(trains[slot].id, slot);
+        stationIndex.add(trains[slot]);
+    }
+
+    void putRoute(const Route& value) {
+        tablesChanged();
+        textFiles.stale[TextFilesState::ROUTES] = true;
+        Route* route = findRoute(value.id);
+        if (route != nullptr) {
+            *route = value;
+            planner.routeChanged(*route);
+            return;
+        }
+        routes.push_back(value);
+        routeIndex.insert(static_cast<uint32_t>(routes.size() - 1));
+        planner.routeChanged(routes.back());
+    }
+
+    // Tombstones the route in place; compaction reclaims the slot
+    bool eraseRoute(int id) {
+        long slot = routeIndex.find(id);
+        if (slot < 0) {
+            return false;
+        }
+        routeIndex.erase(id);
+        routes[slot].removed = true;
+        removedRoutes++;
+        tablesChanged();
+        planner.routeRemoved(id);
+        textFiles.stale[TextFilesState::ROUTES] = true;
+        return true;
+    }
+
+    // Operation messages go to cout unless the calling thread redirects them,
+    // as batch mode does to capture one result per command
+    static ostream*& messageSink() {
+        static thread_local ostream* sink = nullptr;
+        return sink;
+    }
+
+    static ostream& out() {
+        ostream* sink = messageSink();
+        return sink != nullptr ? *sink : cout;
+    }
+
+    void displayMenu() {
+        cout << "\n--- Railway Management System Menu ---\n";
+        cout << "1. Register User\n2. Login User\n3. Add Train (Admin Only)\n4. Edit Train (Admin Only)\n5. Remove Train (Admin Only)\n6. View Trains\n";
+        cout << "7. Book Ticket\n8. View Bookings\n9. Add Route (Admin Only)\n10. Edit Route (Admin Only)\n11. Remove Route (Admin Only)\n";
+        cout << "12. View Routes\n13. Dashboard Overview (Admin Only)\n14. Generate Reports (Admin Only)\n15. Exit\n";
+    }
+
+    bool registerUser(const string& username, const string& password, const string& role = "User") {
+        OperationTimer timer(OP_REGISTER_USER);
+        unique_lock<shared_mutex> lock(stateMutex);
+        WriteScope write(*this);
+        if (!insertUser(User(username, password, role))) {
+            out() << "User already exists!\n";
+            return false;
+        }
+        journal.append("U", users.back().toString());
+        out() << "User registered successfully!\n";
+        return true;
+    }
+
+    // role, if given, receives the user's role on success
+    bool loginUser(const string& username, const string& password, string* role = nullptr) {
+        OperationTimer timer(OP_LOGIN_USER);
+        shared_lock<shared_mutex> lock(stateMutex);
+        User* user = findUser(username);
+        if (user == nullptr || user->password != password) {
+            out() << "Invalid username or password!\n";
+            return false;
+        }
+        out() << "Login successful! Welcome, " << user->role << " " << username << "\n";
+        if (role != nullptr) {
+            *role = user->role;
+        }
+        return true;
+    }
+
+    // via lists the intermediate stops, separated by ';'; runs is the schedule
+    // ("mon;wed;fri" or "daily", optionally "@first:last"), empty for an undated train
+    bool addTrain(int id, const string& name, const string& source, const string& destination, int seats, const string& via = "",
+        const string& runs = "") {
+        OperationTimer timer(OP_ADD_TRAIN);
+        unique_lock<shared_mutex> lock(stateMutex);
+        WriteScope write(*this);
+        if (findTrain(id) != nullptr) {
+            out() << "Train ID already exists!\n";
+            return false;
+        }
+        Schedule schedule;
+        if (!schedule.parse(runs)) {
+            out() << "Invalid schedule!\n";
+            return false;
+        }
+        trains.emplace_back(id, name, source, destination, seats);
+        trains.back().setRoute(trains.back().source, trains.back().destination, parseStops(via), seats);
+        trains.back().schedule = schedule;
+        trains.back().materializeRuns(currentDay());
+        indexTrain(static_cast<uint32_t>(trains.size() - 1));
+        tablesChanged();
+        planner.trainChanged(trains.back());
+        textFiles.stale[TextFilesState::TRAINS] = true;
+        journal.append("T+", trains.back().toString());
+        out() << "Train added successfully!\n";
+        return true;
+    }
+
+    // Existing bookings keep their seats and stop positions; any that no longer fit are reported
+    bool editTrain(int id, const string& name, const string& source, const string& destination, int seats, const string& via = "",
+        const string& runs = "") {
+        OperationTimer timer(OP_EDIT_TRAIN);
+        unique_lock<shared_mutex> lock(stateMutex);
+        WriteScope write(*this);
+        Train* train = findTrain(id);
+        if (train == nullptr) {
+            out() << "Train not found!\n";
+            return false;
+        }
+        Schedule schedule;
+        if (!schedule.parse(runs)) {
+            out() << "Invalid schedule!\n";
+            return false;
+        }
+        retireSeatMaps();
+        train->name = name;
+        stationIndex.remove(*train);
+        int oldCapacity = train->capacity(), oldSegments = train->segmentCount();
+        train->setRoute(Stations::intern(source), Stations::intern(destination), parseStops(via), seats);
+        train->schedule = schedule;
+        stationIndex.add(*train);
+        if (train->capacity() != oldCapacity || train->segmentCount() != oldSegments) {
+            fares.invalidate(id);
+        }
+        size_t conflicts = rebuildSeats(*train);
+        tablesChanged();
+        planner.trainChanged(*train);
+        textFiles.stale[TextFilesState::TRAINS] = true;
+        journal.append("T=", train->toString());
+        out() << "Train details updated successfully!\n";
+        if (conflicts > 0) {
+            out() << "Warning: " << conflicts << " existing booking(s) no longer fit the new seats or stops.\n";
+        }
+        size_t promoted = promoteWaiting(*train);
+        if (promoted > 0) {
+            out() << promoted << " waitlisted passenger(s) promoted.\n";
+        }
+        return true;
+    }
+
+    bool removeTrain(int id) {
+        OperationTimer timer(OP_REMOVE_TRAIN);
+        unique_lock<shared_mutex> lock(stateMutex);
+        WriteScope write(*this);
+        long cancelled = eraseTrain(id);
+        if (cancelled < 0) {
+            out() << "Train not found!\n";
+            return false;
+        }
+        journal.append("T-", to_string(id));
+        out() << "Train removed successfully!\n";
+        if (cancelled > 0) {
+            out() << cancelled << " booking(s) on it were cancelled.\n";
+        }
+        return true;
+    }
+
+    void printTrain(int id, const string& name, const vector<StationId>& stops, int seats, const Schedule& schedule) {
+        out() << "ID: " << id << ", Name: " << name << ", From: " << Stations::name(stops.front()) << " To: " << Stations::name(stops.back())
+            << ", Seats: " << seats;
+        if (schedule.dated()) {
+            out() << ", Runs: " << schedule.describe();
+        }
+        if (stops.size() > 2) {
+            out() << ", Stops: ";
+            for (size_t i = 0; i < stops.size(); i++) {
+                out() << (i > 0 ? " -> " : "") << Stations::name(stops[i]);
+            }
+        }
+        out() << "\n";
+    }
+
+    // Seats are for the run on day, or the next run if day is 0
+    void printTrain(const Train& train, int32_t day = 0) {
+        printTrain(train.id, train.name, train.stops, day != 0 ? train.seatsFreeOn(day) : train.availableSeats(), train.schedule);
+    }
+
+    void viewTrains() {
+        OperationTimer timer(OP_VIEW_TRAINS);
+        EpochManager::Pin pin(epochs);
+        const ReadView& view = readView();
+        out() << "Available Trains:\n";
+        for (size_t i = 0; i < view.layout->trains.size(); i++) {
+            const TrainInfo& train = view.layout->trains[i];
+            printTrain(train.id, train.name, train.stops, view.available[i], train.schedule);
+        }
+    }
+
+    // Lists trains with firstId <= id <= lastId in id order; returns how many were listed
+    size_t viewTrainsInRange(int firstId, int lastId) {
+        OperationTimer timer(OP_VIEW_TRAINS_RANGE);
+        EpochManager::Pin pin(epochs);
+        const ReadView& view = readView();
+        const TableLayout& layout = *view.layout;
+        out() << "Trains with ID " << firstId << " to " << lastId << ":\n";
+        size_t listed = 0;
+        auto first = lower_bound(layout.byId.begin(), layout.byId.end(), firstId, [&](uint32_t position, int id) {
+            return layout.trains[position].id < id;
+        });
+        for (auto it = first; it != layout.byId.end() && layout.trains[*it].id <= lastId; ++it) {
+            const TrainInfo& train = layout.trains[*it];
+            printTrain(train.id, train.name, train.stops, view.available[*it], train.schedule);
+            listed++;
+        }
+        if (listed == 0) {
+            out() << "No trains found!\n";
+        }
+        return listed;
+    }
+
+    // Books a seat from origin to destination (empty means the first or last stop)
+    // without printing; safe to call from many threads at once. With waitPriority
+    // 0 or more a full train queues the request instead: booking then holds the
+    // ticket number as its id and seat 0. A scheduled train is booked for the run
+    // on travelDay, or its next run if travelDay is 0; undated trains ignore it.
+    BookingStatus reserveTicket(const string& username, int trainId, string_view origin, string_view destination, BookingRecord& booking,
+        int waitPriority = -1, int32_t travelDay = 0) {
+        shared_lock<shared_mutex> lock(stateMutex);
+        Train* train = findTrain(trainId);
+        if (train == nullptr) {
+            return BOOKING_NO_TRAIN;
+        }
+        long userId = userIndex.find(username);
+        if (userId < 0) {
+            return BOOKING_NO_USER;
+        }
+        StationId station;
+        int fromStop = 0, toStop = train->segmentCount();
+        if (!origin.empty()) {
+            fromStop = Stations::find(origin, station) ? train->stopIndex(station) : -1;
+        }
+        if (!destination.empty()) {
+            toStop = Stations::find(destination, station) ? train->stopIndex(station) : -1;
+        }
+        if (fromStop < 0 || toStop < 0 || fromStop >= toStop) {
+            return BOOKING_BAD_STOPS;
+        }
+        int32_t day = 0;
+        if (train->schedule.dated()) {
+            day = travelDay != 0 ? travelDay : train->schedule.nextRun(currentDay());
+            if (!train->bookable(day)) {
+                return BOOKING_NOT_RUNNING;
+            }
+        }
+        int seat;
+        bool reserved;
+        {
+            // A read view must never count the seat without its booking
+            WriteScope write(*this);
+            reserved = train->reserveSeat(day, fromStop, toStop, seat);
+            if (reserved && !bookings.add(booking, static_cast<uint32_t>(userId), trainId, seat, static_cast<int64_t>(time(nullptr)), 0, fromStop,
+                toStop, day)) {
+                train->seatsOn(day)->release(seat, fromStop, toStop);
+                return BOOKING_LEDGER_FULL;
+            }
+        }
+        if (!reserved) {
+            if (waitPriority < 0) {
+                return BOOKING_NO_SEATS;
+            }
+            // Seats are only freed under the exclusive lock, so none can appear before the request is queued
+            WaitlistEntry entry = { nextTicket++, static_cast<uint32_t>(userId), trainId, static_cast<uint16_t>(fromStop),
+                static_cast<uint16_t>(toStop), static_cast<uint32_t>(min(waitPriority, Waitlist::PRIORITIES - 1)), static_cast<int64_t>(time(nullptr)),
+                day, 0 };
+            waitlistFor(trainId, day).push(entry, [&](size_t) {
+                journal.append("W", waitlistEntryToString(entry));
+            });
+            booking = BookingRecord{ entry.ticket, entry.userId, trainId, 0, entry.fromStop, entry.toStop, entry.timestamp, day, 0 };
+            return BOOKING_WAITLISTED;
+        }
+        journal.append("B", bookingToString(booking));
+        return BOOKING_OK;
+    }
+
+    bool bookTicket(const string& username, int trainId, const string& origin = "", const string& destination = "", BookingRecord* booked = nullptr,
+        int waitPriority = -1, int32_t travelDay = 0) {
+        OperationTimer timer(OP_BOOK_TICKET);
+        BookingRecord booking = {};
+        BookingStatus status = reserveTicket(username, trainId, origin, destination, booking, waitPriority, travelDay);
+        if (booked != nullptr) {
+            *booked = booking;
+        }
+        switch (status) {
+        case BOOKING_OK:
+            out() << "Ticket booked successfully! Seat number: " << booking.seat;
+            out() << (booking.travelDay != 0 ? ", travelling on " + formatDate(booking.travelDay) : "") << "\n";
+            break;
+        case BOOKING_NOT_RUNNING:
+            out() << "The train has no run open for booking" << (travelDay != 0 ? " on " + formatDate(travelDay) : string()) << "!\n";
+            break;
+        case BOOKING_BAD_STOPS:
+            out() << "The train does not run from " << (origin.empty() ? "its first stop" : origin) << " to "
+                << (destination.empty() ? "its last stop" : destination) << "!\n";
+            break;
+        case BOOKING_NO_TRAIN:
+            out() << "Train not found!\n";
+            break;
+        case BOOKING_NO_SEATS:
+            out() << "No seats available!\n";
+            break;
+        case BOOKING_NO_USER:
+            out() << "User not found!\n";
+            break;
+        case BOOKING_WAITLISTED:
+            out() << "No seats available; added to the waitlist with ticket " << booking.id << ".\n";
+            break;
+        case BOOKING_LEDGER_FULL:
+            out() << "The booking ledger is full!\n";
+            break;
+        }
+        return status == BOOKING_OK || status == BOOKING_WAITLISTED;
+    }
+
+    // Cancels one of the user's bookings and hands its seat to the train's waitlist
+    bool cancelBooking(const string& username, uint64_t bookingId, size_t* promoted = nullptr) {
+        OperationTimer timer(OP_CANCEL_BOOKING);
+        unique_lock<shared_mutex> lock(stateMutex);
+        WriteScope write(*this);
+        uint32_t pos;
+        if (!findBooking(username, bookingId, pos)) {
+            out() << "Booking not found!\n";
+            return false;
+        }
+        int trainId = bookings.at(pos).trainId;
+        int32_t day = bookings.at(pos).travelDay;
+        if (bookings.at(pos).seat == 0) {
+            out() << "Booking already cancelled!\n";
+            return false;
+        }
+        releaseBooking(pos);
+        journal.append("X", username + "," + to_string(bookingId));
+        Train* train = findTrain(trainId);
+        size_t seated = train != nullptr ? promoteWaiting(*train, day) : 0;
+        out() << "Booking cancelled!\n";
+        if (seated > 0) {
+            out() << seated << " waitlisted passenger(s) promoted.\n";
+        }
+        if (promoted != nullptr) {
+            *promoted = seated;
+        }
+        return true;
+    }
+
+    // Whether a booking still counts against its train's seats: it is not
+    // cancelled, and its run has not passed or its train is undated, whose one
+    // set of seats is held whatever the date
+    bool holdsSeat(const BookingRecord& booking, int32_t today) const {
+        if (booking.seat == 0) {
+            return false;
+        }
+        if (booking.travelDay == 0 || booking.travelDay >= today) {
+            return true;
+        }
+        long slot = trainIndex.find(booking.trainId);
+        return slot >= 0 && !trains[slot].schedule.dated();
+    }
+
+    // Moves each booking made before cutoff that is completed, that is no longer
+    // holds a seat, from the ledger to the archive; one on an undated train is
+    // completed only once cancelled. Ones the archive already holds (a crash came
+    // before the next checkpoint) are only dropped. Ledger positions move, so
+    // this runs before any reader exists: at startup, or in the benchmark.
+    // Returns how many left the ledger.
+    size_t archiveBookings(int64_t cutoff) {
+        unique_lock<shared_mutex> lock(stateMutex);
+        WriteScope write(*this);
+        if (!archive.usable()) {
+            return 0;
+        }
+        int32_t today = currentDay();
+        vector<ArchivedBooking> rows;
+        vector<BookingRecord> kept;
+        bookings.forEachRun([&](const BookingRecord* records, size_t n) {
+            for (size_t i = 0; i < n; i++) {
+                const BookingRecord& booking = records[i];
+                if (archive.holds(booking.id)) {
+                    continue;
+                }
+                if (booking.timestamp >= cutoff || holdsSeat(booking, today)) {
+                    kept.push_back(booking);
+                }
+                else {
+                    ArchivedBooking row = { booking.id, booking.userId, booking.trainId, booking.seat, BookingArchive::NO_STATION,
+                        BookingArchive::NO_STATION, booking.timestamp, booking.travelDay };
+                    const Train* train = findTrain(booking.trainId);
+                    if (train != nullptr) {
+                        int fromStop, toStop;
+                        train->legFor(booking, fromStop, toStop);
+                        row.from = train->stops[fromStop];
+                        row.to = train->stops[toStop];
+                    }
+                    rows.push_back(row);
+                }
+            }
+        });
+        size_t moved = bookings.size() - kept.size();
+        if (moved == 0) {
+            return 0;
+        }
+        if (!rows.empty() && !archive.append(rows)) {
+            cout << "Error: could not write " << archiveFile() << ", keeping bookings in the ledger.\n";
+            return 0;
+        }
+        bookings.assign(kept.data(), kept.size(), bookings.nextId);
+        textFiles.stale[TextFilesState::BOOKINGS] = true;
+        rebuildAllSeats();
+        if (storageOptions.verbose) {
+            cerr << moved << " booking(s) moved to " << archiveFile() << ".\n";
+        }
+        return moved;
+    }
+
+    void printArchived(const ArchivedBooking& booking) {
+        out() << "Booking ID: " << booking.id << ", Train ID: " << booking.trainId;
+        if (booking.from < Stations::count() && booking.to < Stations::count()) {
+            out() << ", From: " << Stations::name(booking.from) << " To: " << Stations::name(booking.to);
+        }
+        if (booking.travelDay != 0) {
+            out() << ", Date: " << formatDate(booking.travelDay);
+        }
+        if (booking.seat == 0) {
+            out() << ", Cancelled (archived)\n";
+        }
+        else {
+            out() << ", Seat: " << booking.seat << " (archived)\n";
+        }
+    }
+
+    void viewBookings(const string& username) {
+        OperationTimer timer(OP_VIEW_BOOKINGS);
+        shared_lock<shared_mutex> lock(stateMutex);
+        out() << "Bookings for " << username << ":\n";
+        long userId = userIndex.find(username);
+        vector<uint32_t> positions;
+        size_t archived = 0;
+        if (userId >= 0) {
+            archive.forUser(static_cast<uint32_t>(userId), [&](const ArchivedBooking& booking) {
+                printArchived(booking);
+                archived++;
+            });
+            positions = bookings.forUser(static_cast<uint32_t>(userId));
+        }
+        if (positions.empty() && archived == 0) {
+            out() << "No bookings found!\n";
+            return;
+        }
+        for (uint32_t pos : positions) {
+            const BookingRecord& booking = bookings.at(pos);
+            const Train* train = findTrain(booking.trainId);
+            out() << "Booking ID: " << booking.id << ", ";
+            if (train == nullptr) {
+                out() << "Train ID: " << booking.trainId << " (no longer in service)";
+            }
+            else {
+                int fromStop, toStop;
+                train->legFor(booking, fromStop, toStop);
+                out() << "Train ID: " << train->id << ", Name: " << train->name << ", From: " << Stations::name(train->stops[fromStop])
+                    << " To: " << Stations::name(train->stops[toStop]);
+            }
+            if (booking.travelDay != 0) {
+                out() << ", Date: " << formatDate(booking.travelDay);
+            }
+            if (booking.seat == 0) {
+                out() << ", Cancelled\n";
+            }
+            else {
+                out() << ", Seat: " << booking.seat << "\n";
+            }
+        }
+    }
+
+    vector<ArchivedBooking> archivedBookingsFor(const string& username) {
+        shared_lock<shared_mutex> lock(stateMutex);
+        vector<ArchivedBooking> result;
+        long userId = userIndex.find(username);
+        if (userId >= 0) {
+            archive.forUser(static_cast<uint32_t>(userId), [&](const ArchivedBooking& booking) {
+                result.push_back(booking);
+            });
+        }
+        return result;
+    }
+
+    vector<BookingRecord> bookingsFor(const string& username) {
+        shared_lock<shared_mutex> lock(stateMutex);
+        vector<BookingRecord> result;
+        long userId = userIndex.find(username);
+        if (userId >= 0) {
+            for (uint32_t pos : bookings.forUser(static_cast<uint32_t>(userId))) {
+                result.push_back(bookings.at(pos));
+            }
+        }
+        return result;
+    }
+
+    bool addRoute(int id, const string& source, const string& destination) {
+        OperationTimer timer(OP_ADD_ROUTE);
+        unique_lock<shared_mutex> lock(stateMutex);
+        WriteScope write(*this);
+        if (findRoute(id) != nullptr) {
+            out() << "Route ID already exists!\n";
+            return false;
+        }
+        routes.emplace_back(id, source, destination);
+        routeIndex.insert(static_cast<uint32_t>(routes.size() - 1));
+        tablesChanged();
+        planner.routeChanged(routes.back());
+        textFiles.stale[TextFilesState::ROUTES] = true;
+        journal.append("R+", routes.back().toString());
+        out() << "Route added successfully!\n";
+        return true;
+    }
+
+    bool editRoute(int id, const string& source, const string& destination) {
+        OperationTimer timer(OP_EDIT_ROUTE);
+        unique_lock<shared_mutex> lock(stateMutex);
+        WriteScope write(*this);
+        Route* route = findRoute(id);
+        if (route == nullptr) {
+            out() << "Route not found!\n";
+            return false;
+        }
+        route->source = Stations::intern(source);
+        route->destination = Stations::intern(destination);
+        tablesChanged();
+        planner.routeChanged(*route);
+        textFiles.stale[TextFilesState::ROUTES] = true;
+        journal.append("R=", route->toString());
+        out() << "Route details updated successfully!\n";
+        return true;
+    }
+
+    bool removeRoute(int id) {
+        OperationTimer timer(OP_REMOVE_ROUTE);
+        unique_lock<shared_mutex> lock(stateMutex);
+        WriteScope write(*this);
+        if (!eraseRoute(id)) {
+            out() << "Route not found!\n";
+            return false;
+        }
+        journal.append("R-", to_string(id));
+        out() << "Route removed successfully!\n";
+        return true;
+    }
+
+    // Calls fn(train, fromStop, toStop), in ID order, for each train calling at origin
+    // and then later at destination; either may be empty to match any station. With
+    // a travel date, scheduled trains that do not run that day are left out. False,
+    // after saying so, if neither station is known. The caller holds stateMutex.
+    template<typename Fn>
+    bool forEachMatch(const string& origin, const string& destination, int32_t travelDay, Fn fn) {
+        StationId from = 0, to = 0;
+        bool known = (origin.empty() || Stations::find(origin, from)) && (destination.empty() || Stations::find(destination, to));
+        vector<int> candidates;
+        if (!known || (origin.empty() && destination.empty())) {
+            out() << "Enter a known origin or destination to search.\n";
+            return false;
+        }
+        if (origin.empty() || destination.empty()) {
+            candidates = stationIndex.trainsAt(origin.empty() ? to : from);
+        }
+        else {
+            StationIndex::intersect(stationIndex.trainsAt(from), stationIndex.trainsAt(to), candidates);
+        }
+        for (int id : candidates) {
+            const Train* train = findTrain(id);
+            if (train == nullptr) {
+                continue; // removed, awaiting compaction
+            }
+            int fromStop = origin.empty() ? 0 : train->stopIndex(from);
+            int toStop = destination.empty() ? train->segmentCount() : train->stopIndex(to);
+            if (fromStop < 0 || toStop < 0 || fromStop >= toStop) {
+                continue; // runs the other way, ends at the origin, or a removed train's ID was reused
+            }
+            if (travelDay != 0 && train->schedule.dated() && !train->schedule.runsOn(travelDay)) {
+                continue;
+            }
+            fn(*train, fromStop, toStop);
+        }
+        return true;
+    }
+
+    // Lists the trains forEachMatch finds, in pages of up to limit trains with IDs above afterId
+    TrainPage searchTrains(const string& origin, const string& destination, int afterId = 0, size_t limit = 20, int32_t travelDay = 0) {
+        OperationTimer timer(OP_SEARCH_TRAINS);
+        shared_lock<shared_mutex> lock(stateMutex);
+        TrainPage page;
+        if (!forEachMatch(origin, destination, travelDay, [&](const Train& train, int, int) {
+                page.total++;
+                if (train.id <= afterId) {
+                    return;
+                }
+                if (page.trainIds.size() == limit) {
+                    page.nextAfterId = page.trainIds.back();
+                    return;
+                }
+                page.trainIds.push_back(train.id);
+            })) {
+            return page;
+        }
+        out() << "Trains" << (origin.empty() ? "" : " from " + origin) << (destination.empty() ? "" : " to " + destination)
+            << (travelDay != 0 ? " on " + formatDate(travelDay) : "") << " (" << page.total << " found):\n";
+        for (int id : page.trainIds) {
+            printTrain(*findTrain(id), travelDay);
+        }
+        if (page.nextAfterId != 0) {
+            out() << "More trains follow; continue after train " << page.nextAfterId << ".\n";
+        }
+        return page;
+    }
+
+    // Prices the leg from origin to destination on every train searchTrains would
+    // find, in one batch. Scheduled trains are quoted for the run on travelDay, or
+    // their next run if travelDay is 0, and left out if it is not open for booking.
+    // Without a travelDay an undated train's quote carries no date, so it is not
+    // priced as travel today.
+    vector<FareQuote> quoteFares(const string& origin, const string& destination, FareClass fareClass = FARE_ECONOMY, int32_t travelDay = 0) {
+        OperationTimer timer(OP_QUOTE_FARES);
+        shared_lock<shared_mutex> lock(stateMutex);
+        vector<FareQuote> quotes;
+        vector<const Train*> matched;
+        vector<int> segments, daysAhead;
+        int32_t today = currentDay();
+        if (!forEachMatch(origin, destination, travelDay, [&](const Train& train, int fromStop, int toStop) {
+                int32_t day = travelDay;
+                if (train.schedule.dated()) {
+                    day = travelDay != 0 ? travelDay : train.schedule.nextRun(today);
+                    if (!train.bookable(day)) {
+                        return;
+                    }
+                }
+                quotes.push_back(FareQuote{ train.id, train.schedule.dated() ? day : 0, train.seatsFreeOn(day, fromStop, toStop), 0 });
+                matched.push_back(&train);
+                segments.push_back(toStop - fromStop);
+                daysAhead.push_back(day != 0 ? day - today : FareEngine::UNDATED);
+            })) {
+            return quotes;
+        }
+        vector<const FareEngine::Table*> tables;
+        fares.lookup(matched, tables);
+        FareEngine::Batch batch;
+        for (size_t i = 0; i < quotes.size(); i++) {
+            batch.add(*tables[i], segments[i], quotes[i].seatsFree, daysAhead[i]);
+        }
+        FareEngine::price(batch, fareClass);
+        out() << "Fares" << (origin.empty() ? "" : " from " + origin) << (destination.empty() ? "" : " to " + destination)
+            << (travelDay != 0 ? " on " + formatDate(travelDay) : "") << ", " << FareEngine::CLASS_NAMES[fareClass] << " class (" << quotes.size()
+            << (quotes.size() == 1 ? " train" : " trains") << "):\n";
+        for (size_t i = 0; i < quotes.size(); i++) {
+            quotes[i].fare = batch.fares[i];
+            out() << "ID: " << quotes[i].trainId << ", Name: " << matched[i]->name << ", Seats: " << quotes[i].seatsFree;
+            out() << (quotes[i].travelDay != 0 ? ", Date: " + formatDate(quotes[i].travelDay) : "") << ", Fare: " << quotes[i].fare << "\n";
+        }
+        return quotes;
+    }
+
+    bool planJourney(const string& from, const string& to, vector<JourneyLeg>* result = nullptr) {
+        OperationTimer timer(OP_PLAN_JOURNEY);
+        shared_lock<shared_mutex> lock(stateMutex);
+        vector<JourneyLeg> legs;
+        if (!planner.plan(from, to, legs)) {
+            out() << "No journey found from " << from << " to " << to << "!\n";
+            return false;
+        }
+        out() << "Journey from " << from << " to " << to << " with the fewest changes (" << legs.size() << (legs.size() == 1 ? " leg" : " legs") << "):\n";
+        for (size_t i = 0; i < legs.size(); i++) {
+            const JourneyLeg& leg = legs[i];
+            if (leg.byTrain) {
+                const Train* train = findTrain(leg.id);
+                out() << i + 1 << ". Train " << leg.id << " (" << (train != nullptr ? train->name : "") << "): ";
+            }
+            else {
+                out() << i + 1 << ". Route " << leg.id << ": ";
+            }
+            out() << Stations::name(leg.from) << " -> " << Stations::name(leg.to) << "\n";
+        }
+        if (result != nullptr) {
+            *result = legs;
+        }
+        return true;
+    }
+
+    void viewRoutes() {
+        OperationTimer timer(OP_VIEW_ROUTES);
+        EpochManager::Pin pin(epochs);
+        const ReadView& view = readView();
+        out() << "Available Routes:\n";
+        for (const Route& route : view.layout->routes) {
+            out() << "ID: " << route.id << ", From: " << route.sourceName() << " To: " << route.destinationName() << "\n";
+        }
+    }
+    void dashboardOverview() {
+        OperationTimer timer(OP_DASHBOARD);
+        EpochManager::Pin pin(epochs);
+        const ReadView& view = readView();
+        long long capacity = view.capacity, remaining = view.remaining;
+        StreamFormatGuard format(out());
+        out() << "Dashboard Overview:\n";
+        out() << "Total Users: " << view.userCount << "\n";
+        out() << "Total Trains: " << view.layout->trains.size() << "\n";
+        out() << "Total Routes: " << view.layout->routes.size() << "\n";
+        out() << "Total Bookings: " << view.bookingCount << "\n";
+        out() << "Seats Sold: " << capacity - remaining << " of " << capacity << " (" << fixed << setprecision(1)
+            << (capacity == 0 ? 0.0 : 100.0 * (capacity - remaining) / capacity) << "% sell-through)\n";
+        const size_t* memory = view.memory;
+        out() << "Memory: users " << memory[0] / 1024 << " KiB, trains " << memory[1] / 1024 << " KiB, routes " << memory[2] / 1024
+            << " KiB, bookings " << memory[3] / 1024 << " KiB, stations " << memory[4] / 1024 << " KiB\n";
+        vector<double> rates = Metrics::intervalRates();
+        out() << "Operations (count, per second since the last overview, p50 / p99 / p999):\n";
+        for (size_t op = 0; op < METRIC_OP_COUNT; op++) {
+            Metrics::Summary summary = Metrics::summary(static_cast<MetricOp>(op));
+            if (summary.count == 0) {
+                continue;
+            }
+            out() << "  " << Metrics::name(static_cast<MetricOp>(op)) << ": " << summary.count << ", " << fixed << setprecision(1)
+                << rates[op] << "/s, " << Metrics::formatLatency(summary.percentile(0.5)) << " / "
+                << Metrics::formatLatency(summary.percentile(0.99)) << " / " << Metrics::formatLatency(summary.percentile(0.999)) << "\n";
+        }
+    }
+
+    // Approximate heap bytes per table, indexes included: users, trains, routes,
+    // bookings, stations. The bookings figure leaves out the records, which grow
+    // without the state lock; views add them (see takeView).
+    void tableMemory(size_t memory[5]) {
+        memory[0] = users.size() * sizeof(User) + userIndex.memoryUsage();
+        for (const User& user : users) {
+            for (const string* field : { &user.username, &user.password, &user.role }) {
+                memory[0] += field->capacity() > 15 ? field->capacity() + 1 : 0;
+            }
+        }
+        memory[1] = trains.size() * sizeof(Train) + trainIndex.memoryUsage() + stationIndex.memoryUsage();
+        for (const Train& train : trains) {
+            memory[1] += train.name.capacity() > 15 ? train.name.capacity() + 1 : 0;
+            memory[1] += train.stops.capacity() * sizeof(StationId) + train.inventory.memoryUsage() + train.runs.memoryUsage();
+        }
+        memory[2] = routes.size() * sizeof(Route) + routeIndex.memoryUsage();
+        memory[3] = bookings.indexMemory();
+        memory[4] = Stations::memoryUsage();
+    }
+
+    // Latency metrics plus table gauges in the Prometheus text format
+    string metricsText() {
+        string text = Metrics::prometheusText();
+        EpochManager::Pin pin(epochs);
+        const ReadView& view = readView();
+        static const char* const tables[5] = { "users", "trains", "routes", "bookings", "stations" };
+        size_t rows[5] = { view.userCount, view.layout->trains.size(), view.layout->routes.size(), view.bookingCount, Stations::count() };
+        long long capacity = view.capacity, remaining = view.remaining;
+        const size_t* memory = view.memory;
+        text += "# TYPE rms_table_rows gauge\n";
+        for (int i = 0; i < 5; i++) {
+            text += "rms_table_rows{table=\"" + string(tables[i]) + "\"} " + to_string(rows[i]) + "\n";
+        }
+        text += "# TYPE rms_table_memory_bytes gauge\n";
+        for (int i = 0; i < 5; i++) {
+            text += "rms_table_memory_bytes{table=\"" + string(tables[i]) + "\"} " + to_string(memory[i]) + "\n";
+        }
+        text += "# TYPE rms_seats_capacity gauge\nrms_seats_capacity " + to_string(capacity) + "\n";
+        text += "# TYPE rms_seats_remaining gauge\nrms_seats_remaining " + to_string(remaining) + "\n";
+        return text;
+    }
+
+    bool writeMetrics(const string& fileName) {
+        string text = metricsText();
+        return FileHandler::saveBytesAtomic(fileName, { { text.data(), text.size() } });
+    }
+
+    // Rewrites the metrics file periodically so a scraper can pick it up
+    void metricsLoop() {
+        unique_lock<mutex> lock(wakeMutex);
+        while (!stopping) {
+            checkpointWake.wait_for(lock, chrono::seconds(storageOptions.metricsIntervalSec));
+            if (stopping) {
+                break;
+            }
+            lock.unlock();
+            writeMetrics(storageOptions.metricsFile);
+            lock.lock();
+        }
+    }
+
+    void generateReports() {
+        OperationTimer timer(OP_GENERATE_REPORTS);
+        out() << "Generating Reports...\n";
+        lock_guard<mutex> reportLock(reports.scanMutex);
+        shared_ptr<ReportEngine::Result> result = make_shared<ReportEngine::Result>();
+        {
+            EpochManager::Pin pin(epochs);
+            reports.project(readView(), *result);
+        }
+        reports.aggregate(*result);
+        {
+            shared_lock<shared_mutex> lock(stateMutex);
+            reports.resolveUsers(*result);
+        }
+        long long capacity = static_cast<long long>(result->seatsSold + result->seatsRemaining);
+        StreamFormatGuard format(out());
+        out() << "Bookings: " << result->bookingCount << " (" << result->orphanBookings << " on trains no longer in service), by "
+            << result->userBookings.size() << " users\n";
+        out() << "Occupancy: " << result->seatsSold << " of " << capacity << " seats sold (" << fixed << setprecision(1)
+            << (capacity == 0 ? 0.0 : 100.0 * result->seatsSold / capacity) << "%)\n";
+        out() << "Top Routes:\n";
+        for (size_t i = 0; i < min(ReportEngine::TOP_ROUTES, result->pairs.size()); i++) {
+            const ReportEngine::StationPair& stationPair = result->pairs[i];
+            out() << i + 1 << ". " << Stations::name(stationPair.source) << " -> " << Stations::name(stationPair.destination) << ": "
+                << stationPair.bookings << " bookings on " << stationPair.trains << " train(s)\n";
+        }
+        reports.writeAsync(result);
+        out() << "Reports Generated Successfully! Writing report_*.csv and report_summary.json in the background.\n";
+    }
+
+};
+
+// Json Line Class
+// Parser for the flat JSON objects used by batch mode. Values may be strings,
+// numbers, booleans or null; nested objects and arrays are rejected.
+class JsonLine {
+private:
+    string_view text;
+    size_t pos;
+
+    void skipSpace() {
+        while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\r' || text[pos] == '\n')) {
+            pos++;
+        }
+    }
+
+    static void appendUtf8(string& out, uint32_t code) {
+        if (code < 0x80) {
+            out += static_cast<char>(code);
+        }
+        else if (code < 0x800) {
+            out += static_cast<char>(0xC0 | (code >> 6));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        }
+        else if (code < 0x10000) {
+            out += static_cast<char>(0xE0 | (code >> 12));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        }
+        else {
+            out += static_cast<char>(0xF0 | (code >> 18));
+            out += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        }
+    }
+
+    bool parseHex4(uint32_t& code) {
+        if (pos + 4 > text.size()) {
+            return false;
+        }
+        uint32_t value = 0;
+        from_chars_result result = from_chars(text.data() + pos, text.data() + pos + 4, value, 16);
+        if (result.ptr != text.data() + pos + 4) {
+            return false;
+        }
+        code = value;
+        pos += 4;
+        return true;
+    }
+
+    bool parseString(string& out) {
+        out.clear();
+        if (pos >= text.size() || text[pos] != '"') {
+            return false;
+        }
+        pos++;
+        while (pos < text.size()) {
+            char c = text[pos++];
+            if (c == '"') {
+                return true;
+            }
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (pos >= text.size()) {
+                return false;
+            }
+            char escape = text[pos++];
+            switch (escape) {
+            case '"':
+            case '\\':
+            case '/':
+                out += escape;
+                break;
+            case 'b':
+                out += '\b';
+                break;
+            case 'f':
+                out += '\f';
+                break;
+            case 'n':
+                out += '\n';
+                break;
+            case 'r':
+                out += '\r';
+                break;
+            case 't':
+                out += '\t';
+                break;
+            case 'u': {
+                uint32_t code;
+                if (!parseHex4(code)) {
+                    return false;
+                }
+                uint32_t low;
+                if (code >= 0xD800 && code < 0xDC00 && text.substr(pos, 2) == "\\u") {
+                    pos += 2;
+                    if (!parseHex4(low) || low < 0xDC00 || low >= 0xE000) {
+                        return false;
+                    }
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                }
+                appendUtf8(out, code);
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+        return false;
+    }
+
+    bool parseLiteral(string& out) {
+        size_t start = pos;
+        while (pos < text.size() && text[pos] != ',' && text[pos] != '}' && text[pos] != ' ' && text[pos] != '\t') {
+            pos++;
+        }
+        string_view literal = text.substr(start, pos - start);
+        double number;
+        if (literal != "true" && literal != "false" && literal != "null" && !parseNumber(literal, number)) {
+            return false;
+        }
+        out.assign(literal);
+        return true;
+    }
+
+public:
+    vector<pair<string, string>> fields; // numbers and booleans keep their literal text
+
+    bool parse(string_view line, string& error) {
+        text = line;
+        pos = 0;
+        fields.clear();
+        skipSpace();
+        if (pos >= text.size() || text[pos] != '{') {
+            error = "expected a JSON object";
+            return false;
+        }
+        pos++;
+        skipSpace();
+        if (pos < text.size() && text[pos] == '}') {
+            pos++;
+        }
+        else {
+            while (true) {
+                string key, value;
+                skipSpace();
+                if (!parseString(key)) {
+                    error = "bad key at column " + to_string(pos + 1);
+                    return false;
+                }
+                skipSpace();
+                if (pos >= text.size() || text[pos] != ':') {
+                    error = "expected ':' at column " + to_string(pos + 1);
+                    return false;
+                }
+                pos++;
+                skipSpace();
+                bool ok = pos < text.size() && text[pos] == '"' ? parseString(value) : parseLiteral(value);
+                if (!ok) {
+                    error = "bad value for \"" + key + "\"";
+                    return false;
+                }
+                fields.emplace_back(move(key), move(value));
+                skipSpace();
+                if (pos < text.size() && text[pos] == ',') {
+                    pos++;
+                    continue;
+                }
+                if (pos < text.size() && text[pos] == '}') {
+                    pos++;
+                    break;
+                }
+                error = "expected ',' or '}' at column " + to_string(pos + 1);
+                return false;
+            }
+        }
+        skipSpace();
+        if (pos != text.size()) {
+            error = "trailing characters after object";
+            return false;
+        }
+        return true;
+    }
+
+    const string* get(const string& key) const {
+        for (const auto& field : fields) {
+            if (field.first == key) {
+                return &field.second;
+            }
+        }
+        return nullptr;
+    }
+};
+
+// Command Handler Class
+// Runs one parsed JSON command against the system and appends its JSON result
+// line. Batch mode uses one; the server keeps one per worker thread.
+class CommandHandler {
+public:
+    struct Command {
+        size_t line;
+        JsonLine json;
+        string error;
+    };
+
+    // Who commands act for. A batch file is trusted: it may change the tables
+    // and acts for whichever user each command names. A server connection acts
+    // for the user it logged in as, and only an admin may change the tables.
+    struct Session {
+        bool trusted;
+        string username; // empty until a login succeeds
+        string role;
+    };
+
+private:
+    RailwayManagementSystem& rms;
+    ostringstream messages;
+
+    bool need(const Command& command, const char* key, string& value, string& error) {
+        const string* field = command.json.get(key);
+        if (field == nullptr) {
+            error = string("missing field \"") + key + "\"";
+            return false;
+        }
+        value = *field;
+        return true;
+    }
+
+    template<typename T>
+    bool needInt(const Command& command, const char* key, T& value, string& error) {
+        string text;
+        if (!need(command, key, text, error)) {
+            return false;
+        }
+        if (!parseNumber(string_view(text), value)) {
+            error = string("field \"") + key + "\" must be an integer";
+            return false;
+        }
+        return true;
+    }
+
+    // The user a booking command acts for: the one it names in a trusted
+    // session, otherwise the one logged in, which it may only repeat
+    bool actingUser(const Command& command, const Session& session, string& username, string& error) {
+        if (session.trusted) {
+            return need(command, "username", username, error);
+        }
+        if (session.username.empty()) {
+            error = "login required";
+            return false;
+        }
+        const string* field = command.json.get("username");
+        if (field != nullptr && *field != session.username) {
+            error = "field \"username\" does not match the login";
+            return false;
+        }
+        username = session.username;
+        return true;
+    }
+
+    // Ops that change the tables or read across every user
+    static bool adminOnly(const string& op) {
+        return op == "addTrain" || op == "editTrain" || op == "removeTrain" || op == "addRoute" || op == "editRoute" || op == "removeRoute"
+            || op == "dashboardOverview" || op == "generateReports" || op == "dumpMetrics";
+    }
+
+    static bool needAdmin(const Session& session, string& error) {
+        string role = session.role;
+        transform(role.begin(), role.end(), role.begin(), [](unsigned char c) { return static_cast<char>(tolower(c)); });
+        if (session.trusted || (!session.username.empty() && role == "admin")) {
+            return true;
+        }
+        error = "admin login required";
+        return false;
+    }
+
+    // A "YYYY-MM-DD" field that may be left out, which reads as day 0
+    bool optionalDate(const Command& command, const char* key, int32_t& day, string& error) {
+        const string* field = command.json.get(key);
+        day = 0;
+        if (field != nullptr && !parseDate(*field, day)) {
+            error = string("field \"") + key + "\" must be a date (YYYY-MM-DD)";
+            return false;
+        }
+        return true;
+    }
+
+public:
+    size_t commandCount;
+    size_t failureCount;
+
+    explicit CommandHandler(RailwayManagementSystem& system) : rms(system), commandCount(0), failureCount(0) {}
+
+    // Runs one command for session, with its messages captured for the result,
+    // and appends the result line to buffer; returns whether the command succeeded
+    bool execute(const Command& command, string& buffer, Session& session) {
+        const string* opField = command.json.get("op");
+        string op = opField != nullptr ? *opField : "";
+        string error = command.error;
+        string extra;
+        bool ok = false;
+        messages.str("");
+        messages.clear();
+        ostream* previousSink = RailwayManagementSystem::messageSink();
+        RailwayManagementSystem::messageSink() = &messages;
+        if (error.empty() && opField == nullptr) {
+            error = "missing field \"op\"";
+        }
+        if (error.empty() && adminOnly(op)) {
+            needAdmin(session, error);
+        }
+        if (error.empty()) {
+            string username, password, role, name, source, destination;
+            int id, seats;
+            const string* stopsField = command.json.get("stops");
+            const string* runsField = command.json.get("runs");
+            const string* fromField = command.json.get("from");
+            const string* toField = command.json.get("to");
+            if (op == "register") {
+                // Always an ordinary user; admins are made from the console
+                if (need(command, "username", username, error) && need(command, "password", password, error)) {
+                    ok = rms.registerUser(username, password, "user");
+                }
+            }
+            else if (op == "login") {
+                if (need(command, "username", username, error) && need(command, "password", password, error)) {
+                    ok = rms.loginUser(username, password, &role);
+                    if (ok) {
+                        session.username = username;
+                        session.role = role;
+                    }
+                }
+            }
+            else if (op == "addTrain" || op == "editTrain") {
+                if (needInt(command, "id", id, error) && need(command, "name", name, error) && need(command, "source", source, error)
+                    && need(command, "destination", destination, error) && needInt(command, "seats", seats, error)) {
+                    string via = stopsField != nullptr ? *stopsField : "";
+                    string runs = runsField != nullptr ? *runsField : "";
+                    ok = op == "addTrain" ? rms.addTrain(id, name, source, destination, seats, via, runs)
+                        : rms.editTrain(id, name, source, destination, seats, via, runs);
+                }
+            }
+            else if (op == "removeTrain") {
+                if (needInt(command, "id", id, error)) {
+                    ok = rms.removeTrain(id);
+                }
+            }
+            else if (op == "addRoute" || op == "editRoute") {
+                if (needInt(command, "id", id, error) && need(command, "source", source, error) && need(command, "destination", destination, error)) {
+                    ok = op == "addRoute" ? rms.addRoute(id, source, destination) : rms.editRoute(id, source, destination);
+                }
+            }
+            else if (op == "removeRoute") {
+                if (needInt(command, "id", id, error)) {
+                    ok = rms.removeRoute(id);
+                }
+            }
+            else if (op == "bookTicket") {
+                BookingRecord booking = {};
+                int priority = -1;
+                int32_t day = 0;
+                if (actingUser(command, session, username, error) && needInt(command, "trainId", id, error)
+                    && (command.json.get("waitlist") == nullptr || needInt(command, "waitlist", priority, error))
+                    && optionalDate(command, "date", day, error)) {
+                    ok = rms.bookTicket(username, id, fromField != nullptr ? *fromField : "", toField != nullptr ? *toField : "", &booking, priority, day);
+                    if (ok && booking.seat == 0) {
+                        extra = ",\"waitlisted\":true,\"ticket\":" + to_string(booking.id);
+                    }
+                    else if (ok) {
+                        extra = ",\"bookingId\":" + to_string(booking.id) + ",\"seat\":" + to_string(booking.seat);
+                    }
+                    if (ok && booking.travelDay != 0) {
+                        extra += ",\"date\":\"" + formatDate(booking.travelDay) + "\"";
+                    }
+                }
+            }
+            else if (op == "cancelBooking") {
+                uint64_t bookingId = 0;
+                size_t promoted = 0;
+                if (actingUser(command, session, username, error) && needInt(command, "bookingId", bookingId, error)) {
+                    ok = rms.cancelBooking(username, bookingId, &promoted);
+                    if (ok) {
+                        extra = ",\"promoted\":" + to_string(promoted);
+                    }
+                }
+            }
+            else if (op == "viewBookings") {
+                if (actingUser(command, session, username, error)) {
+                    ok = true;
+                    extra = ",\"bookings\":[";
+                    bool first = true;
+                    for (const ArchivedBooking& booking : rms.archivedBookingsFor(username)) {
+                        extra += first ? "{" : ",{";
+                        extra += "\"bookingId\":" + to_string(booking.id) + ",\"trainId\":" + to_string(booking.trainId) + ",\"seat\":"
+                            + to_string(booking.seat);
+                        if (booking.from < Stations::count() && booking.to < Stations::count()) {
+                            extra += ",\"from\":";
+                            appendJsonString(extra, Stations::name(booking.from));
+                            extra += ",\"to\":";
+                            appendJsonString(extra, Stations::name(booking.to));
+                        }
+                        extra += ",\"timestamp\":" + to_string(booking.timestamp);
+                        extra += booking.travelDay != 0 ? ",\"date\":\"" + formatDate(booking.travelDay) + "\"" : "";
+                        extra += string(",\"cancelled\":") + (booking.seat == 0 ? "true" : "false") + ",\"archived\":true}";
+                        first = false;
+                    }
+                    for (const BookingRecord& booking : rms.bookingsFor(username)) {
+                        extra += first ? "{" : ",{";
+                        extra += "\"bookingId\":" + to_string(booking.id) + ",\"trainId\":" + to_string(booking.trainId) + ",\"seat\":"
+                            + to_string(booking.seat) + ",\"fromStop\":" + to_string(booking.fromStop) + ",\"toStop\":" + to_string(booking.toStop)
+                            + ",\"timestamp\":" + to_string(booking.timestamp);
+                        extra += booking.travelDay != 0 ? ",\"date\":\"" + formatDate(booking.travelDay) + "\"" : "";
+                        extra += string(",\"cancelled\":") + (booking.seat == 0 ? "true" : "false") + "}";
+                        first = false;
+                    }
+                    extra += "]";
+                }
+            }
+            else if (op == "planJourney") {
+                vector<JourneyLeg> legs;
+                if (need(command, "from", source, error) && need(command, "to", destination, error)) {
+                    ok = rms.planJourney(source, destination, &legs);
+                    extra = ",\"legs\":[";
+                    for (size_t i = 0; i < legs.size(); i++) {
+                        extra += i == 0 ? "{" : ",{";
+                        extra += legs[i].byTrain ? "\"trainId\":" : "\"routeId\":";
+                        extra += to_string(legs[i].id) + ",\"from\":";
+                        appendJsonString(extra, Stations::name(legs[i].from));
+                        extra += ",\"to\":";
+                        appendJsonString(extra, Stations::name(legs[i].to));
+                        extra += "}";
+                    }
+                    extra += "]";
+                }
+            }
+            else if (op == "viewTrains") {
+                rms.viewTrains();
+                ok = true;
+            }
+            else if (op == "viewTrainsInRange") {
+                int firstId = 0, lastId = 0;
+                if (needInt(command, "from", firstId, error) && needInt(command, "to", lastId, error)) {
+                    extra = ",\"count\":" + to_string(rms.viewTrainsInRange(firstId, lastId));
+                    ok = true;
+                }
+            }
+            else if (op == "searchTrains") {
+                int afterId = 0, limit = 20;
+                int32_t day = 0;
+                if ((command.json.get("after") == nullptr || needInt(command, "after", afterId, error))
+                    && (command.json.get("limit") == nullptr || needInt(command, "limit", limit, error)) && optionalDate(command, "date", day, error)) {
+                    TrainPage page = rms.searchTrains(fromField != nullptr ? *fromField : "", toField != nullptr ? *toField : "", afterId,
+                        static_cast<size_t>(max(limit, 1)), day);
+                    extra = ",\"total\":" + to_string(page.total) + ",\"next\":" + to_string(page.nextAfterId) + ",\"trainIds\":[";
+                    for (size_t i = 0; i < page.trainIds.size(); i++) {
+                        extra += (i == 0 ? "" : ",") + to_string(page.trainIds[i]);
+                    }
+                    extra += "]";
+                    ok = true;
+                }
+            }
+            else if (op == "quoteFares") {
+                // "class" is economy, business or first; economy if absent
+                const string* classField = command.json.get("class");
+                FareClass fareClass = FARE_ECONOMY;
+                int32_t day = 0;
+                if (classField != nullptr && !FareEngine::parseClass(*classField, fareClass)) {
+                    error = "field \"class\" must be economy, business or first";
+                }
+                else if (optionalDate(command, "date", day, error)) {
+                    vector<FareQuote> quotes = rms.quoteFares(fromField != nullptr ? *fromField : "", toField != nullptr ? *toField : "", fareClass, day);
+                    extra = string(",\"class\":\"") + FareEngine::CLASS_NAMES[fareClass] + "\",\"quotes\":[";
+                    for (size_t i = 0; i < quotes.size(); i++) {
+                        extra += (i == 0 ? "{" : ",{");
+                        extra += "\"trainId\":" + to_string(quotes[i].trainId) + ",\"seats\":" + to_string(quotes[i].seatsFree) + ",\"fare\":"
+                            + to_string(quotes[i].fare);
+                        extra += quotes[i].travelDay != 0 ? ",\"date\":\"" + formatDate(quotes[i].travelDay) + "\"}" : "}";
+                    }
+                    extra += "]";
+                    ok = true;
+                }
+            }
+            else if (op == "viewRoutes") {
+                rms.viewRoutes();
+                ok = true;
+            }
+            else if (op == "dashboardOverview") {
+                rms.dashboardOverview();
+                ok = true;
+            }
+            else if (op == "generateReports") {
+                rms.generateReports();
+                ok = true;
+            }
+            else if (op == "dumpMetrics") {
+                // Writes the metrics to "file" if given, otherwise returns them as the message
+                const string* file = command.json.get("file");
+                if (file == nullptr) {
+                    messages << rms.metricsText();
+                    ok = true;
+                }
+                else {
+                    ok = rms.writeMetrics(*file);
+                    messages << (ok ? "Metrics written to " : "Could not write ") << *file << "\n";
+                }
+            }
+            else {
+                error = "unknown op";
+            }
+        }
+        RailwayManagementSystem::messageSink() = previousSink;
+        failureCount += ok ? 0 : 1;
+        commandCount++;
+
+        buffer += "{\"line\":" + to_string(command.line) + ",\"op\":";
+        appendJsonString(buffer, op);
+        buffer += ok ? ",\"ok\":true" : ",\"ok\":false";
+        string message = error.empty() ? messages.str() : error;
+        while (!message.empty() && message.back() == '\n') {
+            message.pop_back();
+        }
+        buffer += error.empty() ? ",\"message\":" : ",\"error\":";
+        appendJsonString(buffer, message);
+        buffer += extra;
+        buffer += "}\n";
+        return ok;
+    }
+};
+
+// Batch Runner Class
+// Executes a JSON-lines command stream against the system. A reader thread
+// parses ahead in blocks while the calling thread executes the commands in
+// order; results are JSON lines collected in a buffer and written in large chunks.
+class BatchRunner {
+private:
+    typedef CommandHandler::Command Command;
+
+    static const size_t BLOCK_SIZE = 256;
+    static const size_t MAX_QUEUED_BLOCKS = 16;
+    static const size_t FLUSH_BYTES = 1 << 16;
+
+    FILE* output;
+    string buffer;
+    CommandHandler::Session session;
+    mutex m;
+    condition_variable cv;
+    deque<vector<Command>> queued;
+    bool finished;
+
+    void readAll(istream& in) {
+        vector<Command> block;
+        block.reserve(BLOCK_SIZE);
+        string line;
+        size_t lineNumber = 0;
+        while (getline(in, line)) {
+            lineNumber++;
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (line.find_first_not_of(" \t") == string::npos) {
+                continue;
+            }
+            block.emplace_back();
+            Command& command = block.back();
+            command.line = lineNumber;
+            command.json.parse(line, command.error);
+            if (block.size() == BLOCK_SIZE) {
+                push(move(block));
+                block.clear();
+                block.reserve(BLOCK_SIZE);
+            }
+        }
+        push(move(block));
+        lock_guard<mutex> lock(m);
+        finished = true;
+        cv.notify_all();
+    }
+
+    void push(vector<Command>&& block) {
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [this] { return queued.size() < MAX_QUEUED_BLOCKS; });
+        queued.push_back(move(block));
+        cv.notify_all();
+    }
+
+    bool pop(vector<Command>& block) {
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [this] { return !queued.empty() || finished; });
+        if (queued.empty()) {
+            return false;
+        }
+        block = move(queued.front());
+        queued.pop_front();
+        cv.notify_all();
+        return true;
+    }
+
+    void flush() {
+        fwrite(buffer.data(), 1, buffer.size(), output);
+        buffer.clear();
+    }
+
+public:
+    CommandHandler handler;
+
+    BatchRunner(RailwayManagementSystem& system, FILE* out) : output(out), session{ true, "", "" }, finished(false), handler(system) {
+        buffer.reserve(FLUSH_BYTES * 2);
+    }
+
+    void run(istream& in) {
+        thread reader(&BatchRunner::readAll, this, ref(in));
+        vector<Command> block;
+        while (pop(block)) {
+            for (const Command& command : block) {
+                handler.execute(command, buffer, session);
+                if (buffer.size() >= FLUSH_BYTES) {
+                    flush();
+                }
+            }
+        }
+        reader.join();
+        flush();
+        fflush(output);
+    }
+};
+
+// Runs a JSON-lines command file ("-" for stdin) and writes one JSON result per
+// command to outputFile, or to stdout when no output file is given
+int runBatch(const string& inputFile, const string& outputFile, const StorageOptions& options) {
+    ifstream inFile;
+    if (inputFile != "-") {
+        inFile.open(inputFile, ios::binary);
+        if (!inFile) {
+            cerr << "Cannot open batch file " << inputFile << "\n";
+            return 1;
+        }
+    }
+    FILE* output = outputFile.empty() ? stdout : fopen(outputFile.c_str(), "wb");
+    if (output == nullptr) {
+        cerr << "Cannot create " << outputFile << "\n";
+        return 1;
+    }
+    // Keep stdout for results only; status output goes to stderr
+    streambuf* console = cout.rdbuf();
+    if (output == stdout) {
+        cout.rdbuf(cerr.rdbuf());
+    }
+    {
+        RailwayManagementSystem rms(options);
+        BatchRunner runner(rms, output);
+        auto started = chrono::steady_clock::now();
+        runner.run(inputFile == "-" ? cin : inFile);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+        cerr << "Batch finished: " << runner.handler.commandCount << " commands, " << runner.handler.failureCount << " failed, " << seconds << "s\n";
+    }
+    cout.rdbuf(console);
+    if (output != stdout) {
+        fclose(output);
+    }
+    return 0;
+}
+
+#ifdef __linux__
+static volatile sig_atomic_t serverStopRequested = 0;
+
+static void requestServerStop(int) {
+    serverStopRequested = 1;
+}
+
+// Opens a listening (or, for clients, connected) socket for an address: a path
+// containing '/' is a Unix domain socket, readable and writable by its owner
+// only, otherwise "port" or "host:port" is TCP on localhost unless another IPv4
+// host is given. Listening beyond loopback needs allowRemote. Returns -1 after
+// printing why.
+int openSocket(const string& address, bool listening, bool allowRemote = false) {
+    int fd;
+    sockaddr_storage storage = {};
+    socklen_t length;
+    bool local = address.find('/') != string::npos;
+    if (local) {
+        sockaddr_un& unixAddress = reinterpret_cast<sockaddr_un&>(storage);
+        if (address.size() >= sizeof(unixAddress.sun_path)) {
+            cerr << "Socket path too long: " << address << "\n";
+            return -1;
+        }
+        unixAddress.sun_family = AF_UNIX;
+        memcpy(unixAddress.sun_path, address.c_str(), address.size() + 1);
+        length = static_cast<socklen_t>(sizeof(sockaddr_un));
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listening) {
+            unlink(address.c_str()); // a stale socket file from an earlier run
+        }
+    }
+    else {
+        size_t colon = address.rfind(':');
+        string host = colon == string::npos ? "127.0.0.1" : address.substr(0, colon);
+        uint16_t port = 0;
+        sockaddr_in& inetAddress = reinterpret_cast<sockaddr_in&>(storage);
+        inetAddress.sin_family = AF_INET;
+        if (!parseNumber(string_view(address).substr(colon == string::npos ? 0 : colon + 1), port)
+            || inet_pton(AF_INET, host.c_str(), &inetAddress.sin_addr) != 1) {
+            cerr << "Bad address " << address << "; expected a socket path, a port or host:port\n";
+            return -1;
+        }
+        if (listening && !allowRemote && ntohl(inetAddress.sin_addr.s_addr) >> 24 != 127) {
+            cerr << "Refusing to listen on " << host << ", which is not a loopback address; pass --allow-remote to serve it\n";
+            return -1;
+        }
+        inetAddress.sin_port = htons(port);
+        length = static_cast<socklen_t>(sizeof(sockaddr_in));
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    }
+    if (fd < 0) {
+        cerr << "socket: " << strerror(errno) << "\n";
+        return -1;
+    }
+    int one = 1;
+    if (!local) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    bool ok;
+    if (listening) {
+        if (!local) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        }
+        // No client can connect before listen, so the socket file is private by then
+        ok = bind(fd, reinterpret_cast<sockaddr*>(&storage), length) == 0 && (!local || chmod(address.c_str(), 0600) == 0)
+            && listen(fd, SOMAXCONN) == 0;
+    }
+    else {
+        ok = connect(fd, reinterpret_cast<sockaddr*>(&storage), length) == 0;
+    }
+    if (!ok) {
+        cerr << (listening ? "Cannot listen on " : "Cannot connect to ") << address << ": " << strerror(errno) << "\n";
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Command Server Class
+// Serves the batch protocol over a local socket: every request is one JSON line
+// and gets one JSON result line, in order. A single epoll thread does all socket
+// I/O. Each connection is pinned to one worker, so the requests a client
+// pipelines run in order while different connections run in parallel.
+class CommandServer {
+private:
+    static const uint64_t LISTENER = 0;
+    static const uint64_t WAKER = 1;
+    static const size_t READ_CHUNK = 1 << 16;
+    static const size_t MAX_LINE = 1 << 20;
+    static const size_t MAX_IN_FLIGHT = 1024;  // per connection; reading pauses beyond this
+    static const size_t MAX_OUTPUT = 4 << 20;  // unsent result bytes per connection, likewise
+
+    struct Connection {
+        int fd;
+        size_t worker;
+        string input;       // bytes not yet split into requests
+        string output;      // results not yet written
+        size_t sent;        // bytes of output already written
+        size_t lines;       // requests received, numbering the "line" field
+        size_t inFlight;    // requests queued or running
+        uint32_t armed;     // epoll events currently requested
+        bool peerClosed;    // no more input; close once every result is out
+        shared_ptr<CommandHandler::Session> session; // changed by the connection's worker only
+    };
+
+    struct Job {
+        uint64_t connection;
+        size_t line;
+        string text;
+        shared_ptr<CommandHandler::Session> session;
+    };
+
+    struct Done {
+        uint64_t connection;
+        string result;
+    };
+
+    struct Worker {
+        mutex m;
+        condition_variable cv;
+        deque<Job> jobs;
+        bool stopping;
+        thread runner;
+
+        Worker() : stopping(false) {}
+    };
+
+    RailwayManagementSystem& rms;
+    string address;
+    int listenFd;
+    int epollFd;
+    int wakeFd;
+    vector<unique_ptr<Worker>> workers;
+    unordered_map<uint64_t, Connection> connections; // touched by the I/O thread only
+    uint64_t nextConnection;
+    mutex doneMutex;
+    vector<Done> done;
+
+    void work(Worker& worker) {
+        CommandHandler handler(rms);
+        CommandHandler::Command command;
+        while (true) {
+            Job job;
+            {
+                unique_lock<mutex> lock(worker.m);
+                worker.cv.wait(lock, [&] { return !worker.jobs.empty() || worker.stopping; });
+                if (worker.jobs.empty()) {
+                    return;
+                }
+                job = move(worker.jobs.front());
+                worker.jobs.pop_front();
+            }
+            command.line = job.line;
+            command.error.clear();
+            command.json.parse(job.text, command.error);
+            Done result = { job.connection, string() };
+            handler.execute(command, result.result, *job.session);
+            bool wake;
+            {
+                lock_guard<mutex> lock(doneMutex);
+                wake = done.empty(); // otherwise the I/O thread has a wakeup pending
+                done.push_back(move(result));
+            }
+            if (wake) {
+                uint64_t one = 1;
+                ssize_t written = write(wakeFd, &one, sizeof(one));
+                (void)written;
+            }
+        }
+    }
+
+    void arm(uint64_t id, Connection& connection) {
+        bool reading = !connection.peerClosed && connection.inFlight < MAX_IN_FLIGHT
+            && connection.output.size() - connection.sent < MAX_OUTPUT;
+        uint32_t events = (reading ? static_cast<uint32_t>(EPOLLIN) : 0u) | (connection.sent < connection.output.size() ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+        if (events != connection.armed) {
+            epoll_event event = {};
+            event.events = events;
+            event.data.u64 = id;
+            epoll_ctl(epollFd, EPOLL_CTL_MOD, connection.fd, &event);
+            connection.armed = events;
+        }
+    }
+
+    void closeConnection(uint64_t id) {
+        auto it = connections.find(id);
+        if (it != connections.end()) {
+            close(it->second.fd); // also drops it from the epoll set
+            connections.erase(it);
+        }
+    }
+
+    void accept() {
+        while (true) {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) {
+                return; // EAGAIN once the backlog is empty
+            }
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // fails harmlessly on Unix sockets
+            uint64_t id = nextConnection++;
+            Connection& connection = connections[id];
+            connection.fd = fd;
+            connection.worker = static_cast<size_t>(id % workers.size());
+            connection.sent = 0;
+            connection.lines = 0;
+            connection.inFlight = 0;
+            connection.armed = EPOLLIN;
+            connection.peerClosed = false;
+            connection.session = make_shared<CommandHandler::Session>(CommandHandler::Session{ false, "", "" });
+            epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.u64 = id;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+        }
+    }
+
+    // Hands complete lines to the connection's worker, as far as flow control allows
+    void dispatch(uint64_t id, Connection& connection) {
+        Worker& worker = *workers[connection.worker];
+        size_t start = 0, queued = 0;
+        while (connection.inFlight < MAX_IN_FLIGHT) {
+            size_t end = connection.input.find('\n', start);
+            if (end == string::npos) {
+                break;
+            }
+            size_t last = end;
+            if (last > start && connection.input[last - 1] == '\r') {
+                last--;
+            }
+            connection.lines++;
+            if (connection.input.find_first_not_of(" \t", start) < last) {
+                lock_guard<mutex> lock(worker.m);
+                worker.jobs.push_back(Job{ id, connection.lines, connection.input.substr(start, last - start), connection.session });
+                connection.inFlight++;
+                queued++;
+            }
+            start = end + 1;
+        }
+        connection.input.erase(0, start);
+        if (queued > 0) {
+            worker.cv.notify_one();
+        }
+    }
+
+    // Writes what the socket takes; false if the connection failed
+    bool flush(Connection& connection) {
+        while (connection.sent < connection.output.size()) {
+            ssize_t n = send(connection.fd, connection.output.data() + connection.sent, connection.output.size() - connection.sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            }
+            connection.sent += static_cast<size_t>(n);
+        }
+        connection.output.clear();
+        connection.sent = 0;
+        return true;
+    }
+
+    // Settles a connection after any change: closes it once it is finished,
+    // otherwise queues more of its input and updates its epoll interest
+    void settle(uint64_t id, Connection& connection) {
+        if (connection.input.size() > MAX_LINE && connection.input.find('\n') == string::npos) {
+            closeConnection(id); // not speaking the protocol
+            return;
+        }
+        dispatch(id, connection);
+        if (connection.peerClosed && connection.inFlight == 0 && connection.sent == connection.output.size()) {
+            closeConnection(id);
+            return;
+        }
+        arm(id, connection);
+    }
+
+    void onEvent(uint64_t id, uint32_t events) {
+        auto it = connections.find(id);
+        if (it == connections.end()) {
+            return;
+        }
+        Connection& connection = it->second;
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            closeConnection(id);
+            return;
+        }
+        if (events & EPOLLIN) {
+            char chunk[READ_CHUNK];
+            ssize_t n = recv(connection.fd, chunk, sizeof(chunk), 0);
+            if (n > 0) {
+                connection.input.append(chunk, static_cast<size_t>(n));
+            }
+            else if (n == 0) {
+                connection.peerClosed = true;
+            }
+            else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                closeConnection(id);
+                return;
+            }
+        }
+        if ((events & EPOLLOUT) && !flush(connection)) {
+            closeConnection(id);
+            return;
+        }
+        settle(id, connection);
+    }
+
+    // Moves finished results to their connections and writes them out
+    void deliver() {
+        uint64_t count;
+        ssize_t n = read(wakeFd, &count, sizeof(count));
+        (void)n;
+        vector<Done> finished;
+        {
+            lock_guard<mutex> lock(doneMutex);
+            finished.swap(done);
+        }
+        vector<uint64_t> touched;
+        for (Done& result : finished) {
+            auto it = connections.find(result.connection);
+            if (it == connections.end()) {
+                continue; // the client went away
+            }
+            it->second.output += result.result;
+            it->second.inFlight--;
+            if (touched.empty() || touched.back() != result.connection) {
+                touched.push_back(result.connection);
+            }
+            served++;
+        }
+        for (uint64_t id : touched) {
+            auto it = connections.find(id);
+            if (it == connections.end()) {
+                continue;
+            }
+            if (!flush(it->second)) {
+                closeConnection(id);
+                continue;
+            }
+            settle(id, it->second);
+        }
+    }
+
+public:
+    atomic<uint64_t> served;
+
+    CommandServer(RailwayManagementSystem& system, size_t workerCount)
+        : rms(system), listenFd(-1), epollFd(-1), wakeFd(-1), nextConnection(2), served(0) {
+        for (size_t i = 0; i < max<size_t>(1, workerCount); i++) {
+            workers.emplace_back(new Worker());
+        }
+    }
+
+    ~CommandServer() {
+        for (auto& worker : workers) {
+            {
+                lock_guard<mutex> lock(worker->m);
+                worker->stopping = true;
+            }
+            worker->cv.notify_all();
+            if (worker->runner.joinable()) {
+                worker->runner.join();
+            }
+        }
+        for (auto& entry : connections) {
+            close(entry.second.fd);
+        }
+        for (int fd : { listenFd, epollFd, wakeFd }) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+        if (listenFd >= 0 && address.find('/') != string::npos) {
+            unlink(address.c_str());
+        }
+    }
+
+    bool listenOn(const string& where, bool allowRemote) {
+        address = where;
+        listenFd = openSocket(address, true, allowRemote);
+        if (listenFd < 0) {
+            return false;
+        }
+        fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.u64 = LISTENER;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+        event.data.u64 = WAKER;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+        return true;
+    }
+
+    // Serves until SIGINT or SIGTERM
+    void run() {
+        for (auto& worker : workers) {
+            worker->runner = thread(&CommandServer::work, this, ref(*worker));
+        }
+        struct sigaction action = {};
+        action.sa_handler = requestServerStop;
+        sigaction(SIGINT, &action, nullptr);
+        sigaction(SIGTERM, &action, nullptr);
+        epoll_event events[256];
+        while (!serverStopRequested) {
+            int n = epoll_wait(epollFd, events, 256, 500);
+            for (int i = 0; i < n; i++) {
+                if (events[i].data.u64 == LISTENER) {
+                    accept();
+                }
+                else if (events[i].data.u64 == WAKER) {
+                    deliver();
+                }
+                else {
+                    onEvent(events[i].data.u64, events[i].events);
+                }
+            }
+        }
+    }
+};
+
+// Serves the batch protocol on address until interrupted
+int runServer(const string& address, size_t workerCount, bool allowRemote, const StorageOptions& options) {
+    RailwayManagementSystem rms(options);
+    CommandServer server(rms, workerCount);
+    if (!server.listenOn(address, allowRemote)) {
+        return 1;
+    }
+    cout << "Serving on " << address << " with " << workerCount << " workers; press Ctrl+C to stop.\n";
+    server.run();
+    cout << "Server stopped after " << server.served << " requests.\n";
+    return 0;
+}
+
+// Drives a running server from many connections, each keeping up to depth
+// requests in flight, and reports throughput and latency percentiles. Each
+// connection registers and logs in as a user of its own, then books, lists
+// trains and views bookings as it.
+int runLoadTest(const string& address, int connectionCount, size_t requestsPerConnection, size_t depth, int trainCount) {
+    vector<vector<uint32_t>> latencies(connectionCount); // microseconds
+    vector<size_t> rejected(connectionCount, 0);
+    atomic<int> broken(0);
+    vector<thread> clients;
+    auto started = chrono::steady_clock::now();
+    for (int c = 0; c < connectionCount; c++) {
+        clients.emplace_back([&, c] {
+            int fd = openSocket(address, false);
+            if (fd < 0) {
+                broken++;
+                return;
+            }
+            string username = "load" + to_string(c);
+            string registration = "{\"op\":\"register\",\"username\":\"" + username + "\",\"password\":\"load\"}\n"
+                "{\"op\":\"login\",\"username\":\"" + username + "\",\"password\":\"load\"}\n";
+            size_t unanswered = 2; // answered first and not timed
+            uint64_t state = 0x9E3779B97F4A7C15ULL * (c + 1);
+            deque<chrono::steady_clock::time_point> pending;
+            latencies[c].reserve(requestsPerConnection);
+            string request, input;
+            size_t issued = 0;
+            char chunk[1 << 16];
+            bool registered = false;
+            while (latencies[c].size() < requestsPerConnection) {
+                request.clear();
+                if (!registered) {
+                    request = registration; // its answer is skipped below
+                    registered = true;
+                }
+                while (issued < requestsPerConnection && pending.size() < depth) {
+                    state ^= state << 13;
+                    state ^= state >> 7;
+                    state ^= state << 17;
+                    int trainId = static_cast<int>(state % static_cast<uint64_t>(trainCount)) + 1;
+                    int kind = static_cast<int>((state >> 32) % 10);
+                    if (kind < 5) {
+                        request += "{\"op\":\"bookTicket\",\"trainId\":" + to_string(trainId) + "}\n";
+                    }
+                    else if (kind < 8) {
+                        request += "{\"op\":\"viewTrainsInRange\",\"from\":" + to_string(trainId) + ",\"to\":" + to_string(trainId + 9) + "}\n";
+                    }
+                    else {
+                        request += "{\"op\":\"viewBookings\"}\n";
+                    }
+                    pending.push_back(chrono::steady_clock::now());
+                    issued++;
+                }
+                if (!request.empty() && send(fd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size())) {
+                    broken++;
+                    break;
+                }
+                ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+                if (n <= 0) {
+                    broken++;
+                    break;
+                }
+                input.append(chunk, static_cast<size_t>(n));
+                size_t start = 0, end;
+                while ((end = input.find('\n', start)) != string::npos) {
+                    string_view line(input.data() + start, end - start);
+                    start = end + 1;
+                    if (unanswered > 0) {
+                        unanswered--;
+                        continue;
+                    }
+                    auto elapsed = chrono::steady_clock::now() - pending.front();
+                    pending.pop_front();
+                    latencies[c].push_back(static_cast<uint32_t>(chrono::duration_cast<chrono::microseconds>(elapsed).count()));
+                    rejected[c] += line.find("\"ok\":false") != string_view::npos ? 1 : 0;
+                }
+                input.erase(0, start);
+            }
+            close(fd);
+        });
+    }
+    for (thread& client : clients) {
+        client.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    vector<uint32_t> all;
+    size_t failures = 0;
+    for (int c = 0; c < connectionCount; c++) {
+        all.insert(all.end(), latencies[c].begin(), latencies[c].end());
+        failures += rejected[c];
+    }
+    if (all.empty()) {
+        cerr << "No responses received.\n";
+        return 1;
+    }
+    sort(all.begin(), all.end());
+    auto percentile = [&](double p) {
+        return all[min(all.size() - 1, static_cast<size_t>(p * all.size()))];
+    };
+    printf("{\"benchmark\":\"loadTest\",\"connections\":%d,\"depth\":%zu,\"ops\":%zu,\"seconds\":%f,\"opsPerSec\":%f,\"rejected\":%zu,"
+        "\"p50Us\":%u,\"p99Us\":%u,\"p999Us\":%u,\"maxUs\":%u}\n", connectionCount, depth, all.size(), seconds, all.size() / max(seconds, 1e-9),
+        failures, percentile(0.5), percentile(0.99), percentile(0.999), all.back());
+    return broken > 0 ? 1 : 0;
+}
+#else
+int runServer(const string&, size_t, bool, const StorageOptions&) {
+    cerr << "Server mode needs Linux (epoll).\n";
+    return 1;
+}
 
-public:
-    LinkedList() : head(nullptr) {}
+int runLoadTest(const string&, int, size_t, size_t, int) {
+    cerr << "The load generator needs Linux.\n";
+    return 1;
+}
+#endif
 
-    ~LinkedList() {
-        clear();
+// Books tickets from many threads against an in-memory system and checks that
+// no train was oversold: every train must end with its initial seats minus its
+// successful bookings, and no seat number may be sold twice.
+int runBookingStress(int threadCount, int attemptsPerThread) {
+    const int trainCount = 16;
+    const int seatsPerTrain = max(1, threadCount * attemptsPerThread / (2 * trainCount)); // oversubscribed two to one
+    const int userCount = 256;
+    StorageOptions options;
+    options.persistent = false;
+    RailwayManagementSystem rms(options);
+    for (int i = 0; i < userCount; i++) {
+        rms.insertUser(User("user" + to_string(i), "pw", "user"));
+    }
+    for (int id = 1; id <= trainCount; id++) {
+        rms.putTrain(Train(id, "stress " + to_string(id), "lahore", "karachi", seatsPerTrain));
     }
+    cout << "Booking stress: " << threadCount << " threads x " << attemptsPerThread << " attempts, " << trainCount << " trains x "
+        << seatsPerTrain << " seats\n";
 
-    void append(const T& value) {
-        ListNode<T>* newNode = new ListNode<T>(value);
-        if (!head) {
-            head = newNode;
-        }
-        else {
-            ListNode<T>* current = head;
-            while (current->next) {
-                current = current->next;
+    // Every eighth attempt cancels one of the thread's earlier bookings, another
+    // in eight quotes fares across all the trains, and half the bookings join the
+    // waitlist when the train is full
+    vector<long> cancelled(threadCount, 0);
+    vector<long> quoted(threadCount, 0), badQuotes(threadCount, 0);
+    vector<thread> workers;
+    auto started = chrono::steady_clock::now();
+
+    // Meanwhile a reader checks that every read view is a consistent cut: with
+    // whole-journey bookings only, the seats sold are the bookings not cancelled.
+    // No view may predate the bookings and cancellations made before it was asked for.
+    atomic<bool> done(false);
+    long views = 0, tornViews = 0, staleViews = 0;
+    thread reader([&] {
+        while (!done.load()) {
+            uint64_t ledgerVersion = rms.bookings.version();
+            EpochManager::Pin pin(rms.epochs);
+            const ReadView& view = rms.readView();
+            views++;
+            if (view.capacity - view.remaining != static_cast<long long>(view.bookingCount - view.cancelledCount)) {
+                tornViews++;
             }
-            current->next = newNode;
+            staleViews += view.ledgerVersion < ledgerVersion ? 1 : 0;
         }
+    });
+    for (int t = 0; t < threadCount; t++) {
+        workers.emplace_back([&, t] {
+            ostringstream messages;
+            RailwayManagementSystem::messageSink() = &messages;
+            uint64_t state = 0x9E3779B97F4A7C15ULL * (t + 1);
+            BookingRecord booking = {};
+            vector<pair<string, uint64_t>> held;
+            for (int i = 0; i < attemptsPerThread; i++) {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+                if (i % 8 == 7 && !held.empty()) {
+                    size_t pick = static_cast<size_t>(state % held.size());
+                    cancelled[t] += rms.cancelBooking(held[pick].first, held[pick].second) ? 1 : 0;
+                    held[pick] = held.back();
+                    held.pop_back();
+                    messages.str("");
+                    continue;
+                }
+                if (i % 8 == 3) {
+                    for (const FareQuote& quote : rms.quoteFares("lahore", "karachi", static_cast<FareClass>(state % FARE_CLASSES))) {
+                        quoted[t]++;
+                        badQuotes[t] += quote.seatsFree < 0 || quote.seatsFree > seatsPerTrain || quote.fare <= 0 ? 1 : 0;
+                    }
+                    messages.str("");
+                    continue;
+                }
+                int trainId = static_cast<int>(state % trainCount) + 1;
+                string username = "user" + to_string((state >> 32) % userCount);
+                if (rms.reserveTicket(username, trainId, "", "", booking, (state >> 16) % 2 == 0 ? 0 : -1) == BOOKING_OK) {
+                    held.emplace_back(username, booking.id);
+                }
+            }
+            RailwayManagementSystem::messageSink() = nullptr;
+        });
+    }
+    for (thread& worker : workers) {
+        worker.join();
     }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    done.store(true);
+    reader.join();
 
-    void clear() {
-        while (head) {
-            ListNode<T>* temp = head;
-            head = head->next;
-            delete temp;
+    // Every live booking holds its own seat, the free seats are exactly the rest,
+    // and nobody is left waiting on a train with a free seat
+    bool ok = true;
+    long total = 0, cancels = 0, quotes = 0, bad = 0;
+    for (int t = 0; t < threadCount; t++) {
+        cancels += cancelled[t];
+        quotes += quoted[t];
+        bad += badQuotes[t];
+    }
+    for (int id = 1; id <= trainCount; id++) {
+        int remaining = rms.findTrain(id)->availableSeats();
+        vector<uint32_t> positions = rms.bookings.forTrain(id);
+        vector<char> seatTaken(seatsPerTrain + 1, 0);
+        bool seatsUnique = true;
+        int live = 0;
+        for (uint32_t pos : positions) {
+            int seat = rms.bookings.at(pos).seat;
+            if (seat == 0) {
+                continue;
+            }
+            live++;
+            if (seat < 1 || seat > seatsPerTrain || seatTaken[seat]) {
+                seatsUnique = false;
+            }
+            else {
+                seatTaken[seat] = 1;
+            }
+        }
+        total += static_cast<long>(positions.size());
+        Waitlist* waitlist = rms.findWaitlist(id, 0);
+        size_t waiting = waitlist != nullptr ? waitlist->size() : 0;
+        if (remaining != seatsPerTrain - live || remaining < 0 || !seatsUnique || (waiting > 0 && remaining > 0)) {
+            cout << "Train " << id << ": initial " << seatsPerTrain << ", live " << live << ", remaining " << remaining << ", waiting "
+                << waiting << (seatsUnique ? "" : ", duplicate seats") << "\n";
+            ok = false;
         }
     }
+    cout << total << " bookings and " << cancels << " cancellations in " << seconds << "s (" << static_cast<long>(total / max(seconds, 1e-9))
+        << " bookings/s)\n";
+    cout << views << " read views taken concurrently, " << tornViews << " inconsistent, " << staleViews << " stale\n";
+    cout << quotes << " fares quoted concurrently, " << bad << " out of range\n";
+    ok = ok && tornViews == 0 && staleViews == 0 && bad == 0;
+    cout << (ok ? "PASS: no train oversold\n" : "FAIL: seat counts do not match bookings\n");
+    return ok ? 0 : 1;
+}
 
-    ListNode<T>* getHead() const {
-        return head;
-    }
-};
+// Skewed Random Class
+// xorshift generator with a power-law pick, so low indexes (big stations, busy
+// trains, frequent travellers) are drawn far more often than the tail
+class SkewedRandom {
+private:
+    uint64_t state;
 
-// BST Node
-template<typename K, typename V>
-struct BSTNode {
-    K key;
-    V value;
-    BSTNode* left;
-    BSTNode* right;
+public:
+    SkewedRandom(uint64_t seed) : state(seed * 0x9E3779B97F4A7C15ULL + 1) {}
 
-    BSTNode(const K& k, const V& v) : key(k), value(v), left(nullptr), right(nullptr) {}
-};
+    uint64_t next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
 
-// Binary Search Tree Class
-template<typename K, typename V>
-class BST {
-private:
-    BSTNode<K, V>* root;
+    double uniform() {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
 
-    void insertHelper(BSTNode<K, V>*& node, const K& key, const V& value) {
-        if (!node) {
-            node = new BSTNode<K, V>(key, value);
-        }
-        else if (key < node->key) {
-            insertHelper(node->left, key, value);
-        }
-        else if (key > node->key) {
-            insertHelper(node->right, key, value);
-        }
-        else {
-            // Key already exists, update value
-            node->value = value;
-        }
+    size_t below(size_t n) {
+        return static_cast<size_t>(next() % n);
     }
 
-    V* searchHelper(BSTNode<K, V>* node, const K& key) const {
-        if (!node) {
-            return nullptr;
-        }
-        else if (key < node->key) {
-            return searchHelper(node->left, key);
-        }
-        else if (key > node->key) {
-            return searchHelper(node->right, key);
-        }
-        else {
-            return &(node->value);
-        }
+    size_t skewed(size_t n) {
+        return min(n - 1, static_cast<size_t>(n * pow(uniform(), 3.0)));
     }
+};
 
+// Data Generator Class
+// Writes users.txt, trains.txt, routes.txt, bookings.txt and stations.txt with
+// `rows` users and bookings and one train and one route per hundred users
+class DataGenerator {
 public:
-    BST() : root(nullptr) {}
+    static constexpr const char* FILES[5] = { "stations.txt", "users.txt", "routes.txt", "bookings.txt", "trains.txt" };
 
-    ~BST() {
-        clear();
-    }
+    string directory;
+    size_t userCount;
+    size_t trainCount;
+    size_t routeCount;
+    size_t bookingCount;
+    size_t stationCount;
+    uint64_t seed;
 
-    void insert(const K& key, const V& value) {
-        insertHelper(root, key, value);
-    }
+    DataGenerator(const string& directory, size_t rows, uint64_t seed)
+        : directory(directory), userCount(rows), trainCount(max<size_t>(10, rows / 100)), routeCount(max<size_t>(10, rows / 100)), bookingCount(rows),
+          stationCount(min<size_t>(500, max<size_t>(20, rows / 1000))), seed(seed) {}
 
-    V* search(const K& key) const {
-        return searchHelper(root, key);
+    static string stationName(size_t i) {
+        static const char* const cities[] = { "lahore", "karachi", "islamabad", "rawalpindi", "faisalabad", "multan", "peshawar",
+            "quetta", "hyderabad", "sukkur", "sialkot", "gujranwala", "okara", "bahawalpur", "sargodha", "mardan" };
+        const size_t cityCount = sizeof(cities) / sizeof(cities[0]);
+        return i < cityCount ? string(cities[i]) : string(cities[i % cityCount]) + " " + to_string(i / cityCount);
     }
 
-    void clear() {
-        clearHelper(root);
-        root = nullptr;
+    string path(const char* file) const {
+        return directory + "/" + file;
     }
 
-private:
-    void clearHelper(BSTNode<K, V>* node) {
-        if (node) {
-            clearHelper(node->left);
-            clearHelper(node->right);
-            delete node;
+    bool run() {
+        SkewedRandom random(seed);
+        bool ok = FileHandler::saveLinesAtomic(path("stations.txt"), stationCount, [&](size_t i, string& line) {
+            line = stationName(i);
+        });
+        ok = ok && FileHandler::saveLinesAtomic(path("users.txt"), userCount, [&](size_t i, string& line) {
+            line = "user" + to_string(i) + ",pw" + to_string(random.below(10000)) + (i % 100 == 0 ? ",Admin" : ",User");
+        });
+        // Capacities are drawn first so that every booking gets a distinct seat;
+        // a booking on a full train moves to the next train with room
+        vector<int> capacity(trainCount), sold(trainCount, 0);
+        size_t totalCapacity = 0;
+        for (int& seats : capacity) {
+            seats = static_cast<int>(100 + random.below(400));
+            totalCapacity += seats;
         }
+        if (totalCapacity < bookingCount) {
+            capacity[0] += static_cast<int>(bookingCount - totalCapacity);
+        }
+        ok = ok && FileHandler::saveLinesAtomic(path("routes.txt"), routeCount, [&](size_t i, string& line) {
+            size_t source = random.skewed(stationCount);
+            size_t destination = (source + 1 + random.skewed(stationCount - 1)) % stationCount;
+            line = to_string(i + 1) + "," + stationName(source) + "," + stationName(destination);
+        });
+        // Bookings are spread evenly over the past year
+        int64_t start = static_cast<int64_t>(time(nullptr)) - 365LL * 24 * 3600;
+        ok = ok && FileHandler::saveLinesAtomic(path("bookings.txt"), bookingCount, [&](size_t i, string& line) {
+            size_t train = random.skewed(trainCount);
+            while (sold[train] == capacity[train]) {
+                train = (train + 1) % trainCount;
+            }
+            line = to_string(i + 1) + ",user" + to_string(random.skewed(userCount)) + "," + to_string(train + 1) + "," + to_string(++sold[train])
+                + "," + to_string(start + static_cast<int64_t>(i * (365ULL * 24 * 3600) / bookingCount)) + ",0,0";
+        });
+        ok = ok && FileHandler::saveLinesAtomic(path("trains.txt"), trainCount, [&](size_t i, string& line) {
+            size_t source = random.skewed(stationCount);
+            size_t destination = (source + 1 + random.skewed(stationCount - 1)) % stationCount;
+            string stops = stationName(source);
+            vector<size_t> used = { source, destination };
+            size_t via = random.below(4);
+            for (size_t k = 0; k < via; k++) {
+                size_t stop = random.below(stationCount);
+                if (find(used.begin(), used.end(), stop) == used.end()) {
+                    used.push_back(stop);
+                    stops += ";" + stationName(stop);
+                }
+            }
+            stops += ";" + stationName(destination);
+            line = to_string(i + 1) + ",train " + to_string(i + 1) + "," + stationName(source) + "," + stationName(destination) + ","
+                + to_string(capacity[i]) + "," + stops;
+        });
+        return ok;
     }
 };
 
-// FileHandler Class
-class FileHandler {
-public:
-    static void saveToFile(const string& filename, const vector<string>& data) {
-        ofstream outFile(filename);
-        for (const string& line : data) {
-            outFile << line << endl;
-        }
-        outFile.close();
+// Writes the data files into directory, creating it if needed; existing files
+// are only overwritten when forced
+int runGenerate(const string& directory, size_t rows, uint64_t seed, bool force) {
+    if (!FileHandler::makeDirectory(directory)) {
+        cout << "Error: could not create " << directory << "\n";
+        return 1;
     }
-
-    static vector<string> loadFromFile(const string& filename) {
-        vector<string> data;
-        ifstream inFile(filename);
-        string line;
-        while (getline(inFile, line)) {
-            data.push_back(line);
+    DataGenerator generator(directory, rows, seed);
+    for (const char* file : DataGenerator::FILES) {
+        if (!force && FileHandler::fileExists(generator.path(file))) {
+            cout << "Error: " << generator.path(file) << " exists; pass --force to overwrite it\n";
+            return 1;
         }
-        inFile.close();
-        return data;
     }
-};
+    auto started = chrono::steady_clock::now();
+    if (!generator.run()) {
+        cout << "Error: could not write the data files\n";
+        return 1;
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    cout << "Generated " << generator.userCount << " users, " << generator.trainCount << " trains, " << generator.routeCount << " routes, "
+        << generator.bookingCount << " bookings over " << generator.stationCount << " stations in " << seconds << "s\n";
+    if (FileHandler::fileExists(generator.path(RailwayManagementSystem::snapshotFile()))) {
+        cout << "Note: " << generator.path(RailwayManagementSystem::snapshotFile()) << " exists; start with --import-text to use the new files.\n";
+    }
+    return 0;
+}
 
-// Railway Management System Class
-class RailwayManagementSystem {
+// Benchmark Class
+// Measures the core operations against the text files in the working
+// directory and prints one JSON object per measurement on stdout
+class Benchmark {
 public:
-    vector<User> users;
-    vector<Train> trains;
-    vector<Route> routes;
-    unordered_map<string, vector<Train>> bookings;
+    size_t operations;
+    SkewedRandom random;
+
+    Benchmark(size_t operations) : operations(operations), random(42) {}
 
-    RailwayManagementSystem() {
-        loadUsers();
-        loadTrains();
-        loadRoutes();
-        loadBookings();
+    void report(const string& name, size_t ops, double seconds) {
+        string line = "{\"benchmark\":";
+        appendJsonString(line, name);
+        line += ",\"ops\":" + to_string(ops) + ",\"seconds\":" + to_string(seconds) + ",\"nsPerOp\":"
+            + to_string(ops == 0 ? 0.0 : seconds * 1e9 / ops) + ",\"opsPerSec\":" + to_string(seconds <= 0 ? 0.0 : ops / seconds) + "}\n";
+        fwrite(line.data(), 1, line.size(), stdout);
+        fflush(stdout);
     }
 
-    ~RailwayManagementSystem() {
-        saveUsers();
-        saveTrains();
-        saveRoutes();
-        saveBookings();
+    template<typename Fn>
+    static double measure(Fn fn) {
+        auto started = chrono::steady_clock::now();
+        fn();
+        return chrono::duration<double>(chrono::steady_clock::now() - started).count();
     }
 
-    void loadUsers() {
-        vector<string> data = FileHandler::loadFromFile("users.txt");
-        cout << "Loading user data...\n"; // Debug output
-        for (const string& line : data) {
-            users.push_back(User::fromString(line));
-        }
-        cout << "Number of users loaded: " << users.size() << "\n"; // Debug output
+    int run() {
+        // Status output from the loaders goes to stderr; stdout carries results only
+        streambuf* console = cout.rdbuf();
+        cout.rdbuf(cerr.rdbuf());
+        ostream discard(nullptr);
+        RailwayManagementSystem::messageSink() = &discard;
+        int status = measureAll();
+        RailwayManagementSystem::messageSink() = nullptr;
+        cout.rdbuf(console);
+        return status;
     }
 
-    void saveUsers() {
-        vector<string> data;
-        for (const User& user : users) {
-            data.push_back(user.toString());
+    int measureAll() {
+        StorageOptions options;
+        options.persistent = false;
+        RailwayManagementSystem rms(options);
+
+        double seconds = measure([&] {
+            rms.loadStations();
+            rms.loadUsers();
+            rms.loadTrains();
+            rms.loadRoutes();
+            rms.loadBookings();
+            rms.rebuildAllSeats();
+        });
+        size_t rows = rms.users.size() + rms.trains.size() + rms.routes.size() + rms.bookings.size();
+        report("loadText", rows, seconds);
+        if (rms.users.empty() || rms.trains.empty()) {
+            cerr << "No users or trains to benchmark; run --generate on this directory first.\n";
+            return 1;
         }
-        cout << "Saving user data...\n"; // Debug output
-        FileHandler::saveToFile("users.txt", data);
-        cout << "User data saved successfully.\n"; // Debug output
-    }
-    void loadTrains() {
-        vector<string> data = FileHandler::loadFromFile("trains.txt");
-        cout << "Loading train data...\n"; // Debug output
-        for (const string& line : data) {
-            trains.push_back(Train::fromString(line));
+
+        static const char* const tables[4] = { "users", "trains", "routes", "bookings" };
+        seconds = measure([&] {
+            TextLines data[4] = { rms.serializeUsers(), rms.serializeTrains(), rms.serializeRoutes(), rms.serializeBookings() };
+            for (int i = 0; i < 4; i++) {
+                FileHandler::saveToFileAtomic(string("bench.") + tables[i] + ".txt", data[i]);
+            }
+        });
+        report("saveText", rows, seconds);
+        for (const char* table : tables) {
+            remove((string("bench.") + table + ".txt").c_str());
         }
-        cout << "Number of trains loaded: " << trains.size() << "\n"; // Debug output
-    }
 
-    void saveTrains() {
-        vector<string> data;
-        for (const Train& train : trains) {
-            data.push_back(train.toString());
+        const char* snapshotName = "bench.snap";
+        seconds = measure([&] {
+            SnapshotWriter writer;
+            rms.buildSnapshot(writer);
+            writer.writeTo(snapshotName, 0, rms.bookings.nextId);
+        });
+        report("saveSnapshot", rows, seconds);
+        seconds = measure([&] {
+            RailwayManagementSystem loaded(options);
+            loaded.loadSnapshot(snapshotName);
+            loaded.rebuildAllSeats();
+        });
+        report("loadSnapshot", rows, seconds);
+        remove(snapshotName);
+
+        const size_t shardCount = 8;
+        seconds = measure([&] {
+            SnapshotWriter writer;
+            vector<SnapshotWriter> shards(shardCount);
+            rms.buildSnapshot(writer, shards, 1);
+            RailwayManagementSystem::writeSnapshot(snapshotName, writer, shards, 1, 0, rms.bookings.nextId);
+        });
+        report("saveSnapshotSharded", rows, seconds);
+        seconds = measure([&] {
+            RailwayManagementSystem loaded(options);
+            loaded.loadSnapshot(snapshotName);
+            loaded.rebuildAllSeats();
+        });
+        report("loadSnapshotSharded", rows, seconds);
+        remove(snapshotName);
+        for (size_t k = 0; k < shardCount; k++) {
+            remove(RailwayManagementSystem::shardFileName(snapshotName, 1, k).c_str());
         }
-        cout << "Saving train data...\n"; // Debug output
-        FileHandler::saveToFile("trains.txt", data);
-        cout << "Train data saved successfully.\n"; // Debug output
-    }
 
-    void loadRoutes() {
-        vector<string> data = FileHandler::loadFromFile("routes.txt");
-        cout << "Loading route data...\n"; // Debug output
-        for (const string& line : data) {
-            routes.push_back(Route::fromString(line));
+        // Lookups follow the same skew as the generated bookings
+        vector<string> usernames(operations);
+        vector<int> trainIds(operations);
+        for (size_t i = 0; i < operations; i++) {
+            usernames[i] = rms.users[random.skewed(rms.users.size())].username;
+            trainIds[i] = rms.trains[random.skewed(rms.trains.size())].id;
         }
-        cout << "Number of routes loaded: " << routes.size() << "\n"; // Debug output
-    }
+        size_t hits = 0;
+        seconds = measure([&] {
+            for (size_t i = 0; i < operations; i++) {
+                hits += rms.findUser(usernames[i]) != nullptr;
+            }
+        });
+        report("findUser", operations, seconds);
+        seconds = measure([&] {
+            for (size_t i = 0; i < operations; i++) {
+                hits += rms.findTrain(trainIds[i]) != nullptr;
+            }
+        });
+        report("findTrain", operations, seconds);
+        seconds = measure([&] {
+            for (size_t i = 0; i < operations; i++) {
+                hits += rms.bookTicket(usernames[i], trainIds[i]);
+            }
+        });
+        report("bookTicket", operations, seconds);
 
-    void saveRoutes() {
-        vector<string> data;
-        for (const Route& route : routes) {
-            data.push_back(route.toString());
+        // A daily train booked across its whole booking horizon; finding a
+        // date's seats costs the same a week or a year ahead
+        int datedId = 1;
+        for (const Train& train : rms.trains) {
+            datedId = max(datedId, train.id + 1);
         }
-        cout << "Saving route data...\n"; // Debug output
-        FileHandler::saveToFile("routes.txt", data);
-        cout << "Route data saved successfully.\n"; // Debug output
-    }
+        rms.addTrain(datedId, "bench daily", "bench a", "bench b", 1000, "", "daily");
+        int32_t today = currentDay();
+        seconds = measure([&] {
+            for (size_t i = 0; i < operations; i++) {
+                hits += rms.bookTicket(usernames[i], datedId, "", "", nullptr, -1, today + static_cast<int32_t>(i * 7919 % Train::BOOKING_DAYS));
+            }
+        });
+        report("bookTicketDated", operations, seconds);
 
-    void loadBookings() {
-        vector<string> data = FileHandler::loadFromFile("bookings.txt");
-        cout << "Loading booking data...\n"; // Debug output
-        for (const string& line : data) {
-            stringstream ss(line);
-            string username, trainStr;
-            getline(ss, username, ':');
-            while (getline(ss, trainStr, ';')) {
-                bookings[username].push_back(Train::fromString(trainStr));
+        // Fare quotes for the searches customers make, counted per train priced;
+        // then the pricing loop alone over one large batch
+        size_t quoted = 0;
+        size_t searches = min<size_t>(operations, 10000);
+        seconds = measure([&] {
+            for (size_t i = 0; i < searches; i++) {
+                const Train* train = rms.findTrain(trainIds[i]);
+                quoted += rms.quoteFares(train->sourceName(), train->destinationName(), static_cast<FareClass>(i % FARE_CLASSES)).size();
             }
+        });
+        report("quoteFares", quoted, seconds);
+        FareEngine::Batch batch;
+        FareEngine::Table table = { vector<float>(16, 1000.0f), 1.0f / 500 };
+        for (size_t i = 0; i < 4096; i++) {
+            batch.add(table, static_cast<int>(i % 16), static_cast<int>(i % 500), static_cast<int32_t>(i % Train::BOOKING_DAYS));
         }
-        cout << "Number of bookings loaded: " << bookings.size() << "\n"; // Debug output
-    }
+        size_t rounds = max<size_t>(operations / 64, 1);
+        seconds = measure([&] {
+            for (size_t i = 0; i < rounds; i++) {
+                FareEngine::price(batch, static_cast<FareClass>(i % FARE_CLASSES));
+                hits += batch.fares[i % batch.count] > 0;
+            }
+        });
+        report("priceFares", rounds * batch.count, seconds);
 
-    void saveBookings() {
-        vector<string> data;
-        for (const auto& booking : bookings) {
-            stringstream ss;
-            ss << booking.first << ":";
-            for (const Train& train : booking.second) {
-                ss << train.toString() << ";";
+        size_t views = min<size_t>(operations, 10000);
+        seconds = measure([&] {
+            for (size_t i = 0; i < views; i++) {
+                rms.viewBookings(usernames[i]);
             }
-            data.push_back(ss.str());
-        }
-        cout << "Saving booking data...\n"; // Debug output
-        FileHandler::saveToFile("bookings.txt", data);
-        cout << "Booking data saved successfully.\n"; // Debug output
-    }
+        });
+        report("viewBookings", views, seconds);
 
+        size_t reports = 10;
+        seconds = measure([&] {
+            for (size_t i = 0; i < reports; i++) {
+                rms.generateReports();
+            }
+        });
+        report("generateReports", reports, seconds);
 
-    User* findUser(const string& username) {
-        for (auto& user : users) {
-            if (user.username == username) {
-                return &user;
+        // The older half of the bookings cancelled and aged out, then histories
+        // read back from the archive. Archiving must leave every seat count as it was.
+        vector<pair<string, uint64_t>> cancellations;
+        for (uint32_t pos = 0; pos < rms.bookings.size() / 2; pos++) {
+            const BookingRecord& booking = rms.bookings.at(pos);
+            if (booking.seat != 0) {
+                cancellations.emplace_back(rms.users[booking.userId].username, booking.id);
             }
         }
-        return nullptr;
-    }
-
-    Train* findTrain(int trainId) {
-        for (auto& train : trains) {
-            if (train.id == trainId) {
-                return &train;
+        seconds = measure([&] {
+            for (const pair<string, uint64_t>& cancellation : cancellations) {
+                hits += rms.cancelBooking(cancellation.first, cancellation.second);
+            }
+        });
+        report("cancelBooking", cancellations.size(), seconds);
+        auto seatsLeft = [&] {
+            long long seats = 0;
+            for (const Train& train : rms.trains) {
+                seats += train.removed ? 0 : train.availableSeats();
             }
+            return seats;
+        };
+        long long seatsBefore = seatsLeft();
+        const char* archiveName = "bench.archive";
+        remove(archiveName);
+        size_t textBytes = rms.serializeBookings().text.size();
+        size_t archived = 0;
+        seconds = measure([&] {
+            rms.archive.open(archiveName);
+            archived = rms.archiveBookings(INT64_MAX);
+        });
+        report("archiveBookings", archived, seconds);
+        if (seatsLeft() != seatsBefore) {
+            cerr << "Error: archiving changed the seats available from " << seatsBefore << " to " << seatsLeft() << "\n";
+            remove(archiveName);
+            return 1;
         }
-        return nullptr;
-    }
-
-    Route* findRoute(int routeId) {
-        for (auto& route : routes) {
-            if (route.id == routeId) {
-                return &route;
+        cerr << "Archive: " << rms.archive.fileBytes() << " bytes for " << archived << " bookings, " << textBytes << " bytes as text\n";
+        seconds = measure([&] {
+            for (size_t i = 0; i < views; i++) {
+                rms.viewBookings(usernames[i]);
             }
+        });
+        report("viewBookingsArchived", views, seconds);
+        seconds = measure([&] {
+            for (size_t i = 0; i < views; i++) {
+                rms.archive.forTrain(trainIds[i], [&](const ArchivedBooking&) { hits++; });
+            }
+        });
+        report("archiveTrainHistory", views, seconds);
+        remove(archiveName);
+
+        // A bulk timetable change: every train removed, then the tombstones reclaimed
+        vector<int> removals;
+        for (const Train& train : rms.trains) {
+            removals.push_back(train.id);
         }
-        return nullptr;
+        seconds = measure([&] {
+            for (int id : removals) {
+                hits += rms.removeTrain(id);
+            }
+        });
+        report("removeTrain", removals.size(), seconds);
+        size_t reclaimed = 0;
+        seconds = measure([&] {
+            reclaimed = rms.compactTables(true);
+        });
+        report("compactTables", reclaimed, seconds);
+        cerr << "Benchmark finished (" << hits << " hits)\n";
+        return 0;
     }
+};
 
-    void displayMenu() {
-        cout << "\n--- Railway Management System Menu ---\n";
-        cout << "1. Register User\n2. Login User\n3. Add Train (Admin Only)\n4. Edit Train (Admin Only)\n5. Remove Train (Admin Only)\n6. View Trains\n";
-        cout << "7. Book Ticket\n8. View Bookings\n9. Add Route (Admin Only)\n10. Edit Route (Admin Only)\n11. Remove Route (Admin Only)\n";
-        cout << "12. View Routes\n13. Dashboard Overview (Admin Only)\n14. Generate Reports (Admin Only)\n15. Exit\n";
+// main function
+int main(int argc, char* argv[]) {
+    if (argc >= 2 && string(argv[1]) == "--stress-bookings") {
+        int threadCount = argc >= 3 ? max(1, atoi(argv[2])) : static_cast<int>(max(2u, thread::hardware_concurrency()));
+        int attempts = argc >= 4 ? max(1, atoi(argv[3])) : 100000;
+        return runBookingStress(threadCount, attempts);
     }
-
-    void registerUser(const string& username, const string& password, const string& role = "User") {
-        if (findUser(username) != nullptr) {
-            cout << "User already exists!\n";
-            return;
+    if (argc >= 2 && string(argv[1]) == "--generate") {
+        vector<string> arguments;
+        bool force = false;
+        for (int i = 2; i < argc; i++) {
+            if (string(argv[i]) == "--force") {
+                force = true;
+            }
+            else {
+                arguments.push_back(argv[i]);
+            }
         }
-        users.emplace_back(username, password, role);
-        cout << "User registered successfully!\n";
-    }
-
-    bool loginUser(const string& username, const string& password) {
-        User* user = findUser(username);
-        if (user == nullptr || user->password != password) {
-            cout << "Invalid username or password!\n";
-            return false;
+        if (arguments.empty()) {
+            cerr << "Usage: --generate <directory> [rows] [seed] [--force]\n";
+            return 1;
         }
-        cout << "Login successful! Welcome, " << user->role << " " << username << "\n";
-        return true;
+        size_t rows = arguments.size() >= 2 ? static_cast<size_t>(max(1000LL, atoll(arguments[1].c_str()))) : 100000;
+        uint64_t seed = arguments.size() >= 3 ? static_cast<uint64_t>(atoll(arguments[2].c_str())) : 1;
+        return runGenerate(arguments[0], rows, seed, force);
     }
-
-    void addTrain(int id, const string& name, const string& source, const string& destination, int seats) {
-        if (findTrain(id) != nullptr) {
-            cout << "Train ID already exists!\n";
-            return;
+    if (argc >= 2 && string(argv[1]) == "--load-test") {
+        if (argc < 3) {
+            cerr << "Usage: --load-test <address> [connections] [requests per connection] [pipeline depth] [train ids]\n";
+            return 1;
         }
-        trains.emplace_back(id, name, source, destination, seats);
-        cout << "Train added successfully!\n";
+        int connections = argc >= 4 ? max(1, atoi(argv[3])) : 16;
+        size_t requests = argc >= 5 ? static_cast<size_t>(max(1LL, atoll(argv[4]))) : 10000;
+        size_t depth = argc >= 6 ? static_cast<size_t>(max(1LL, atoll(argv[5]))) : 16;
+        int trains = argc >= 7 ? max(1, atoi(argv[6])) : 200;
+        return runLoadTest(argv[2], connections, requests, depth, trains);
     }
-
-    void editTrain(int id, const string& name, const string& source, const string& destination, int seats) {
-        Train* train = findTrain(id);
-        if (train == nullptr) {
-            cout << "Train not found!\n";
-            return;
-        }
-        train->name = name;
-        train->source = source;
-        train->destination = destination;
-        train->seats = seats;
-        cout << "Train details updated successfully!\n";
+    if (argc >= 2 && string(argv[1]) == "--bench") {
+        Benchmark benchmark(argc >= 3 ? static_cast<size_t>(max(1LL, atoll(argv[2]))) : 100000);
+        return benchmark.run();
     }
-
-    void removeTrain(int id) {
-        auto it = remove_if(trains.begin(), trains.end(), [id](const Train& t) { return t.id == id; });
-        if (it == trains.end()) {
-            cout << "Train not found!\n";
-            return;
+    StorageOptions storageOptions;
+    string batchFile, batchOutput, serveAddress;
+    size_t serveWorkers = max(2u, thread::hardware_concurrency());
+    bool allowRemote = false;
+    for (int i = 1; i < argc; i++) {
+        string flag = argv[i];
+        if (flag == "--import-text") {
+            storageOptions.importText = true;
+            continue;
         }
-        trains.erase(it, trains.end());
-        cout << "Train removed successfully!\n";
-    }
-
-    void viewTrains() {
-        cout << "Available Trains:\n";
-        for (const auto& train : trains) {
-            cout << "ID: " << train.id << ", Name: " << train.name << ", From: " << train.source << " To: " << train.destination << ", Seats: " << train.seats << "\n";
+        if (flag == "--export-text") {
+            storageOptions.mirrorText = true;
+            continue;
         }
-    }
-
-    void bookTicket(const string& username, int trainId) {
-        Train* train = findTrain(trainId);
-        if (train == nullptr) {
-            cout << "Train not found!\n";
-            return;
+        if (flag == "--verbose") {
+            storageOptions.verbose = true;
+            continue;
         }
-        if (train->seats == 0) {
-            cout << "No seats available!\n";
-            return;
+        if (flag == "--allow-remote") {
+            allowRemote = true;
+            continue;
         }
-        train->seats--;
-        bookings[username].push_back(*train);
-        cout << "Ticket booked successfully!\n";
-    }
-
-    void viewBookings(const string& username) {
-        cout << "Bookings for " << username << ":\n";
-        if (bookings.find(username) == bookings.end()) {
-            cout << "No bookings found!\n";
-            return;
+        if (i + 1 >= argc) {
+            cout << "Missing value for " << flag << "\n";
+            break;
         }
-        for (const auto& train : bookings[username]) {
-            cout << "Train ID: " << train.id << ", Name: " << train.name << ", From: " << train.source << " To: " << train.destination << "\n";
+        string argument = argv[++i];
+        long value = atol(argument.c_str());
+        if (flag == "--batch") {
+            batchFile = argument;
         }
-    }
-
-    void addRoute(int id, const string& source, const string& destination) {
-        if (findRoute(id) != nullptr) {
-            cout << "Route ID already exists!\n";
-            return;
+        else if (flag == "--out") {
+            batchOutput = argument;
         }
-        routes.emplace_back(id, source, destination);
-        cout << "Route added successfully!\n";
-    }
-
-    void editRoute(int id, const string& source, const string& destination) {
-        Route* route = findRoute(id);
-        if (route == nullptr) {
-            cout << "Route not found!\n";
-            return;
+        else if (flag == "--serve") {
+            serveAddress = argument;
         }
-        route->source = source;
-        route->destination = destination;
-        cout << "Route details updated successfully!\n";
-    }
-
-    void removeRoute(int id) {
-        auto it = remove_if(routes.begin(), routes.end(), [id](const Route& r) { return r.id == id; });
-        if (it == routes.end()) {
-            cout << "Route not found!\n";
-            return;
+        else if (flag == "--workers") {
+            serveWorkers = static_cast<size_t>(max(1L, value));
         }
-        routes.erase(it, routes.end());
-        cout << "Route removed successfully!\n";
-    }
-
-    void viewRoutes() {
-        cout << "Available Routes:\n";
-        for (const auto& route : routes) {
-            cout << "ID: " << route.id << ", From: " << route.source << " To: " << route.destination << "\n";
-
+        else if (flag == "--sync-every") {
+            storageOptions.syncEveryRecords = value > 0 ? static_cast<size_t>(value) : 1;
+        }
+        else if (flag == "--sync-interval-ms") {
+            storageOptions.syncIntervalMs = static_cast<int>(max(1L, value));
+        }
+        else if (flag == "--checkpoint-sec") {
+            storageOptions.checkpointIntervalSec = static_cast<int>(max(1L, value));
+        }
+        else if (flag == "--metrics-out") {
+            storageOptions.metricsFile = argument;
+        }
+        else if (flag == "--metrics-interval-sec") {
+            storageOptions.metricsIntervalSec = static_cast<int>(max(1L, value));
+        }
+        else if (flag == "--archive-after-days") {
+            storageOptions.archiveAfterDays = static_cast<int>(max(0L, value));
+        }
+        else if (flag == "--snapshot-shards") {
+            storageOptions.snapshotShards = static_cast<size_t>(min(max(1L, value), static_cast<long>(MAX_SNAPSHOT_SHARDS)));
+        }
+        else {
+            cout << "Unknown option " << flag << "\n";
         }
     }
-    void dashboardOverview() {
-        cout << "Dashboard Overview:\n";
-        cout << "Total Users: " << users.size() << "\n";
-        cout << "Total Trains: " << trains.size() << "\n";
-        cout << "Total Routes: " << routes.size() << "\n";
+    if (!batchFile.empty()) {
+        return runBatch(batchFile, batchOutput, storageOptions);
     }
-
-    void generateReports() {
-        cout << "Generating Reports...\n";
-        // Some placeholder code for generating reports
-        cout << "Reports Generated Successfully!\n";
+    if (!serveAddress.empty()) {
+        return runServer(serveAddress, serveWorkers, allowRemote, storageOptions);
     }
-
-};
-// main function
-int main() {
-    RailwayManagementSystem rms;
+    RailwayManagementSystem rms(storageOptions);
     bool loggedIn = false;
     string currentUser;
     string userRole;
@@ -561,10 +9451,10 @@ int main() {
                 if (userRole == "admin") {
                     cout << "1. Add Train\n2. Edit Train\n3. Remove Train\n4. View Trains\n";
                     cout << "5. Add Route\n6. Edit Route\n7. Remove Route\n8. View Routes\n";
-                    cout << "9. Dashboard Overview\n10. Generate Reports\n11. Logout\n";
+                    cout << "9. Dashboard Overview\n10. Generate Reports\n11. View Trains by ID Range\n12. Logout\n";
                 }
                 else if (userRole == "user") {
-                    cout << "1. Book Ticket\n2. View Bookings\n3. Logout\n";
+                    cout << "1. Book Ticket\n2. View Bookings\n3. Plan Journey (Fewest Changes)\n4. Search Trains\n5. Cancel Booking\n6. Quote Fares\n7. Logout\n";
                 }
                 else {
                     cout << "Invalid user role! Exiting...\n";
@@ -582,7 +9472,7 @@ int main() {
                         int trainId;
                         cout << "Enter Train ID: ";
                         cin >> trainId;
-                        string name, source, destination;
+                        string name, source, destination, via, runs;
                         int seats;
                         cout << "Enter Train Name: ";
                         cin.ignore();
@@ -591,16 +9481,20 @@ int main() {
                         getline(cin, source);
                         cout << "Enter Destination: ";
                         getline(cin, destination);
+                        cout << "Enter Intermediate Stops (separated by ';', blank for none): ";
+                        getline(cin, via);
+                        cout << "Enter Run Days (e.g. mon;wed;fri or daily, optionally @first:last dates; blank for a single run): ";
+                        getline(cin, runs);
                         cout << "Enter Number of Seats: ";
                         cin >> seats;
-                        rms.addTrain(trainId, name, source, destination, seats);
+                        rms.addTrain(trainId, name, source, destination, seats, via, runs);
                         break;
                     }
                     case 2: {
                         int trainId;
                         cout << "Enter Train ID to edit: ";
                         cin >> trainId;
-                        string name, source, destination;
+                        string name, source, destination, via, runs;
                         int seats;
                         cout << "Enter Train Name: ";
                         cin.ignore();
@@ -609,9 +9503,13 @@ int main() {
                         getline(cin, source);
                         cout << "Enter Destination: ";
                         getline(cin, destination);
+                        cout << "Enter Intermediate Stops (separated by ';', blank for none): ";
+                        getline(cin, via);
+                        cout << "Enter Run Days (e.g. mon;wed;fri or daily, optionally @first:last dates; blank for a single run): ";
+                        getline(cin, runs);
                         cout << "Enter Number of Seats: ";
                         cin >> seats;
-                        rms.editTrain(trainId, name, source, destination, seats);
+                        rms.editTrain(trainId, name, source, destination, seats, via, runs);
                         break;
                     }
                     case 3: {
@@ -671,6 +9569,15 @@ int main() {
                         break;
                     }
                     case 11: {
+                        int firstId, lastId;
+                        cout << "Enter First Train ID: ";
+                        cin >> firstId;
+                        cout << "Enter Last Train ID: ";
+                        cin >> lastId;
+                        rms.viewTrainsInRange(firstId, lastId);
+                        break;
+                    }
+                    case 12: {
                         loggedIn = false;
                         cout << "Logged out successfully!\n";
                         break;
@@ -685,7 +9592,23 @@ int main() {
                         int trainId;
                         cout << "Enter Train ID to book: ";
                         cin >> trainId;
-                        rms.bookTicket(currentUser, trainId);
+                        string origin, destination;
+                        cout << "Enter Origin Stop (blank for the first stop): ";
+                        cin.ignore();
+                        getline(cin, origin);
+                        cout << "Enter Destination Stop (blank for the last stop): ";
+                        getline(cin, destination);
+                        string date, wait;
+                        int32_t day = 0;
+                        cout << "Enter Travel Date (YYYY-MM-DD, blank for the next run): ";
+                        getline(cin, date);
+                        if (!date.empty() && !parseDate(date, day)) {
+                            cout << "Invalid date!\n";
+                            break;
+                        }
+                        cout << "Join the waitlist if the train is full? (y/n): ";
+                        getline(cin, wait);
+                        rms.bookTicket(currentUser, trainId, origin, destination, nullptr, wait == "y" || wait == "Y" ? 1 : -1, day);
                         break;
                     }
                     case 2: {
@@ -693,6 +9616,71 @@ int main() {
                         break;
                     }
                     case 3: {
+                        string from, to;
+                        cout << "Enter Source: ";
+                        getline(cin, from);
+                        cout << "Enter Destination: ";
+                        getline(cin, to);
+                        rms.planJourney(from, to);
+                        break;
+                    }
+                    case 4: {
+                        string from, to;
+                        cout << "Enter Origin (blank for any): ";
+                        getline(cin, from);
+                        cout << "Enter Destination (blank for any): ";
+                        getline(cin, to);
+                        string date;
+                        int32_t day = 0;
+                        cout << "Enter Travel Date (YYYY-MM-DD, blank for any): ";
+                        getline(cin, date);
+                        if (!date.empty() && !parseDate(date, day)) {
+                            cout << "Invalid date!\n";
+                            break;
+                        }
+                        int afterId = 0;
+                        string more = "y";
+                        while (more == "y" || more == "Y") {
+                            afterId = rms.searchTrains(from, to, afterId, 20, day).nextAfterId;
+                            if (afterId == 0) {
+                                break;
+                            }
+                            cout << "Show more? (y/n): ";
+                            getline(cin, more);
+                        }
+                        break;
+                    }
+                    case 5: {
+                        uint64_t bookingId;
+                        cout << "Enter Booking ID to cancel: ";
+                        cin >> bookingId;
+                        rms.cancelBooking(currentUser, bookingId);
+                        break;
+                    }
+                    case 6: {
+                        string from, to, date, className;
+                        cout << "Enter Origin (blank for any): ";
+                        getline(cin, from);
+                        cout << "Enter Destination (blank for any): ";
+                        getline(cin, to);
+                        int32_t day = 0;
+                        cout << "Enter Travel Date (YYYY-MM-DD, blank for the next run): ";
+                        getline(cin, date);
+                        if (!date.empty() && !parseDate(date, day)) {
+                            cout << "Invalid date!\n";
+                            break;
+                        }
+                        FareClass fareClass = FARE_ECONOMY;
+                        cout << "Enter Class (economy, business or first; blank for economy): ";
+                        getline(cin, className);
+                        if (!className.empty() && !FareEngine::parseClass(className, fareClass)) {
+                            cout << "Invalid class!\n";
+                            break;
+                        }
+                        rms.quoteFares(from, to, fareClass, day);
+                        break;
+                    }
+                    case 7: {
                         loggedIn = false;
                         cout << "Logged out successfully!\n";
                         break;